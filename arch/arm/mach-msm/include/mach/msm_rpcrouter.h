@@ -224,12 +224,36 @@ int msm_rpc_create_server2(struct msm_rpc_server *server);
 
 struct msm_rpc_client;
 
+/*
+ * An asynchronous client request.  The structure is owned by the caller
+ * and must stay valid until the request is done: either 'done' has been
+ * called, msm_rpc_client_async_wait() has returned, or
+ * msm_rpc_client_async_cancel() returned 0.
+ *
+ * ret_func, ret_data and done are filled in by the caller before
+ * submitting; rc holds the result once the request is done.
+ */
+struct msm_rpc_client_async {
+	struct list_head list;
+	uint32_t xid;
+
+	int (*ret_func)(struct msm_rpc_client *client,
+			struct msm_rpc_xdr *xdr, void *data);
+	void *ret_data;
+
+	/* called from the client read thread; may be NULL */
+	void (*done)(struct msm_rpc_client *client,
+		     struct msm_rpc_client_async *req);
+
+	struct completion complete;
+	int rc;
+};
+
 struct msm_rpc_client {
 	struct task_struct *read_thread;
 	struct task_struct *cb_thread;
 
 	struct msm_rpc_endpoint *ept;
-	wait_queue_head_t reply_wait;
 
 	uint32_t prog, ver;
 
@@ -260,7 +284,9 @@ struct msm_rpc_client {
 	struct completion complete;
 	struct completion cb_complete;
 
-	struct mutex req_lock;
+	/* requests waiting for a reply, matched by xid */
+	spinlock_t async_lock;
+	struct list_head async_list;
 };
 
 struct msm_rpc_client_info {
@@ -301,6 +327,18 @@ int msm_rpc_client_req2(struct msm_rpc_client *client, uint32_t proc,
 			void *result_data,
 			long timeout);
 
+int msm_rpc_client_req_async(struct msm_rpc_client *client, uint32_t proc,
+			     int (*arg_func)(struct msm_rpc_client *,
+					     struct msm_rpc_xdr *, void *),
+			     void *arg_data,
+			     struct msm_rpc_client_async *req);
+
+int msm_rpc_client_async_wait(struct msm_rpc_client *client,
+			      struct msm_rpc_client_async *req, long timeout);
+
+int msm_rpc_client_async_cancel(struct msm_rpc_client *client,
+				struct msm_rpc_client_async *req);
+
 void *msm_rpc_start_accepted_reply(struct msm_rpc_client *client,
 				   uint32_t xid, uint32_t accept_status);
 
@@ -50,6 +50,56 @@ int smd_read_avail(smd_channel_t *ch);
 */
 int smd_cur_packet_size(smd_channel_t *ch);
 
+/* A region of the shared fifo, in two pieces where it wraps around;
+** len[1] is 0 if it doesn't.
+*/
+struct smd_span {
+	void *data[2];
+	int len[2];
+};
+
+/* Zero-copy writes: smd_write_reserve() returns the fifo space for a
+** packet of exactly len bytes, or for up to len bytes of a stream, and
+** how many bytes that is. It fails with -ENOMEM if there is no room.
+** Fill it in place, then smd_write_commit() the bytes written to hand
+** them over. Callers serialize as for smd_write().
+*/
+int smd_write_reserve(smd_channel_t *ch, int len, struct smd_span *span);
+int smd_write_commit(smd_channel_t *ch, int len);
+
+/* Zero-copy reads: smd_read_peek() returns the readable data of the
+** current packet, or of the stream, in place and its length.
+** smd_read_consume() releases len bytes of it. Not for use from the
+** notify callback of a packet channel.
+*/
+int smd_read_peek(smd_channel_t *ch, struct smd_span *span);
+int smd_read_consume(smd_channel_t *ch, int len);
+
+/* Interrupt coalescing: the other processor is only interrupted once
+** pkts packets or bytes bytes have been written (tx) or read (rx) since
+** the last interrupt; a limit of 0 is not used and both 0, the default,
+** interrupts every time. A caller that coalesces must flush at the end
+** of each batch, or the other side may not see the data or free space.
+*/
+void smd_set_coalesce(smd_channel_t *ch, unsigned tx_pkts, unsigned tx_bytes,
+		      unsigned rx_pkts, unsigned rx_bytes);
+void smd_write_flush(smd_channel_t *ch);
+void smd_read_flush(smd_channel_t *ch);
+
+/* Polled receive for busy channels, in the manner of NAPI: the first
+** interrupt masks the channel's SMD_EVENT_DATA notifications and queues
+** it to be polled from softirq context. poll() may do up to budget
+** units of work (packets, say) and returns how many it did; a channel
+** that uses its whole budget is polled again. Once drained, the client
+** calls smd_poll_complete() to unmask, which re-polls straight away if
+** anything came in meanwhile. Open and close events are still notified.
+** smd_poll_disable() may not be called from poll(); smd_close() does it.
+*/
+int smd_poll_enable(smd_channel_t *ch, int (*poll)(void *priv, int budget),
+		    int weight);
+void smd_poll_disable(smd_channel_t *ch);
+void smd_poll_complete(smd_channel_t *ch);
+
 
 #if 0
 /* these are interruptable waits which will block you until the specified
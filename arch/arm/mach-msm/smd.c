@@ -90,6 +90,11 @@ static int msm_smd_debug_mask;
 module_param_named(debug_mask, msm_smd_debug_mask,
 		   int, S_IRUGO | S_IWUSR | S_IWGRP);
 
+/* work the poll tasklet may do in one run before yielding */
+static int msm_smd_poll_budget = 300;
+module_param_named(poll_budget, msm_smd_poll_budget,
+		   int, S_IRUGO | S_IWUSR | S_IWGRP);
+
 #if defined(CONFIG_MSM_SMD_DEBUG)
 #define SMD_DBG(x...) do {				\
 		if (msm_smd_debug_mask & MSM_SMD_DEBUG) \
@@ -281,6 +286,21 @@ struct smd_channel {
 	unsigned last_state;
 	void (*notify_other_cpu)(void);
 
+	/* bytes reserved by smd_write_reserve(), header included */
+	unsigned reserved;
+	/* work not yet signalled to the other cpu, and the limits at which
+	 * we do so; zero limits interrupt on every read or write */
+	unsigned tx_pending_pkts, tx_pending_bytes;
+	unsigned rx_pending_pkts, rx_pending_bytes;
+	unsigned tx_coalesce_pkts, tx_coalesce_bytes;
+	unsigned rx_coalesce_pkts, rx_coalesce_bytes;
+
+	/* polled receive, see smd_poll_enable() */
+	int (*poll)(void *priv, int budget);
+	int poll_weight;
+	unsigned poll_state;
+	struct list_head poll_list;
+
 	char name[20];
 	struct platform_device pdev;
 	unsigned type;
@@ -471,6 +491,55 @@ static void ch_write_done(struct smd_channel *ch, unsigned count)
 	ch->send->fHEAD = 1;
 }
 
+/* describe 'len' bytes of a fifo from 'offset', split where it wraps */
+static void ch_span(struct smd_channel *ch, unsigned char *fifo,
+		    unsigned offset, unsigned len, struct smd_span *span)
+{
+	unsigned n = min(len, ch->fifo_size - offset);
+
+	span->data[0] = fifo + offset;
+	span->len[0] = n;
+	span->data[1] = fifo;
+	span->len[1] = len - n;
+}
+
+static int ch_coalesce_full(unsigned pkts, unsigned bytes,
+			    unsigned max_pkts, unsigned max_bytes)
+{
+	if (!max_pkts && !max_bytes)
+		return 1;
+	return (max_pkts && pkts >= max_pkts) ||
+		(max_bytes && bytes >= max_bytes);
+}
+
+/* account for written data, interrupting the other cpu unless coalescing */
+static void ch_tx_notify(struct smd_channel *ch, unsigned pkts,
+			 unsigned bytes)
+{
+	ch->tx_pending_pkts += pkts;
+	ch->tx_pending_bytes += bytes;
+	if (ch_coalesce_full(ch->tx_pending_pkts, ch->tx_pending_bytes,
+			     ch->tx_coalesce_pkts, ch->tx_coalesce_bytes)) {
+		ch->tx_pending_pkts = 0;
+		ch->tx_pending_bytes = 0;
+		ch->notify_other_cpu();
+	}
+}
+
+/* likewise for fifo space freed by reading */
+static void ch_rx_notify(struct smd_channel *ch, unsigned pkts,
+			 unsigned bytes)
+{
+	ch->rx_pending_pkts += pkts;
+	ch->rx_pending_bytes += bytes;
+	if (ch_coalesce_full(ch->rx_pending_pkts, ch->rx_pending_bytes,
+			     ch->rx_coalesce_pkts, ch->rx_coalesce_bytes)) {
+		ch->rx_pending_pkts = 0;
+		ch->rx_pending_bytes = 0;
+		ch->notify_other_cpu();
+	}
+}
+
 static void ch_set_state(struct smd_channel *ch, unsigned n)
 {
 	if (n == SMD_SS_OPENED) {
@@ -531,6 +600,132 @@ static void smd_state_change(struct smd_channel *ch,
 	}
 }
 
+/* poll_state bits, protected by smd_lock */
+#define SMD_POLL_SCHED	1	/* notifications masked, being polled */
+#define SMD_POLL_MISSED	2	/* events arrived while masked */
+
+static LIST_HEAD(smd_poll_list);
+static struct smd_channel *smd_poll_running;
+
+static void smd_poll_handler(unsigned long arg);
+static DECLARE_TASKLET(smd_poll_tasklet, smd_poll_handler, 0);
+
+/* called with smd_lock held */
+static void smd_poll_schedule(struct smd_channel *ch)
+{
+	ch->poll_state |= SMD_POLL_SCHED;
+	if (list_empty(&ch->poll_list))
+		list_add_tail(&ch->poll_list, &smd_poll_list);
+	tasklet_schedule(&smd_poll_tasklet);
+}
+
+/* called with smd_lock held */
+static void ch_notify_data(struct smd_channel *ch)
+{
+	if (!ch->poll)
+		ch->notify(ch->priv, SMD_EVENT_DATA);
+	else if (ch->poll_state & SMD_POLL_SCHED)
+		ch->poll_state |= SMD_POLL_MISSED;
+	else
+		smd_poll_schedule(ch);
+}
+
+static void smd_poll_handler(unsigned long arg)
+{
+	unsigned long flags;
+	unsigned long time_limit = jiffies + 2;
+	int budget = msm_smd_poll_budget;
+	struct smd_channel *ch;
+	int (*poll)(void *priv, int budget);
+	int weight, work;
+
+	spin_lock_irqsave(&smd_lock, flags);
+	while (!list_empty(&smd_poll_list)) {
+		/* leave the rest for the next run, as net_rx_action does */
+		if (budget <= 0 || time_after(jiffies, time_limit)) {
+			tasklet_schedule(&smd_poll_tasklet);
+			break;
+		}
+
+		ch = list_first_entry(&smd_poll_list, struct smd_channel,
+				      poll_list);
+		list_del_init(&ch->poll_list);
+		poll = ch->poll;
+		weight = ch->poll_weight;
+		smd_poll_running = ch;
+		spin_unlock_irqrestore(&smd_lock, flags);
+
+		work = poll(ch->priv, weight);
+		budget -= work;
+
+		spin_lock_irqsave(&smd_lock, flags);
+		smd_poll_running = NULL;
+		/* it used all its weight without completing, so go round
+		 * again after the others have had a turn */
+		if (work >= weight && ch->poll &&
+		    (ch->poll_state & SMD_POLL_SCHED) &&
+		    list_empty(&ch->poll_list))
+			list_add_tail(&ch->poll_list, &smd_poll_list);
+	}
+	spin_unlock_irqrestore(&smd_lock, flags);
+}
+
+int smd_poll_enable(smd_channel_t *ch, int (*poll)(void *priv, int budget),
+		    int weight)
+{
+	unsigned long flags;
+
+	if (!poll || weight <= 0)
+		return -EINVAL;
+
+	spin_lock_irqsave(&smd_lock, flags);
+	ch->poll = poll;
+	ch->poll_weight = weight;
+	ch->poll_state = 0;
+	/* pick up anything that arrived before the switch */
+	smd_poll_schedule(ch);
+	spin_unlock_irqrestore(&smd_lock, flags);
+
+	return 0;
+}
+EXPORT_SYMBOL(smd_poll_enable);
+
+void smd_poll_disable(smd_channel_t *ch)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&smd_lock, flags);
+	ch->poll = NULL;
+	ch->poll_state = 0;
+	list_del_init(&ch->poll_list);
+	while (smd_poll_running == ch) {
+		spin_unlock_irqrestore(&smd_lock, flags);
+		cpu_relax();
+		spin_lock_irqsave(&smd_lock, flags);
+	}
+	spin_unlock_irqrestore(&smd_lock, flags);
+}
+EXPORT_SYMBOL(smd_poll_disable);
+
+void smd_poll_complete(smd_channel_t *ch)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&smd_lock, flags);
+	if (!ch->poll)
+		goto out;
+	/* anything that came in while masked may not have been seen */
+	if (ch->poll_state & SMD_POLL_MISSED) {
+		ch->poll_state &= ~SMD_POLL_MISSED;
+		smd_poll_schedule(ch);
+	} else {
+		ch->poll_state &= ~SMD_POLL_SCHED;
+	}
+out:
+	spin_unlock_irqrestore(&smd_lock, flags);
+}
+EXPORT_SYMBOL(smd_poll_complete);
+
 static void handle_smd_irq(struct list_head *list, void (*notify)(void))
 {
 	unsigned long flags;
@@ -564,7 +759,7 @@ static void handle_smd_irq(struct list_head *list, void (*notify)(void))
 			smd_state_change(ch, ch->last_state, tmp);
 		if (ch_flags) {
 			ch->update_state(ch);
-			ch->notify(ch->priv, SMD_EVENT_DATA);
+			ch_notify_data(ch);
 		}
 	}
 	if (do_notify)
@@ -666,19 +861,14 @@ static int smd_is_packet(struct smd_alloc_elm *alloc_elm)
 		return 0;
 }
 
-static int smd_stream_write(smd_channel_t *ch, const void *_data, int len)
+/* copy into the fifo without telling the other cpu */
+static int ch_write(smd_channel_t *ch, const void *_data, int len)
 {
 	void *ptr;
 	const unsigned char *buf = _data;
 	unsigned xfer;
 	int orig_len = len;
 
-	SMD_DBG("smd_stream_write() %d -> ch%d\n", len, ch->n);
-	if (len < 0)
-		return -EINVAL;
-	else if (len == 0)
-		return 0;
-
 	while ((xfer = ch_write_buffer(ch, &ptr)) != 0) {
 		if (!ch_is_open(ch))
 			break;
@@ -692,12 +882,26 @@ static int smd_stream_write(smd_channel_t *ch, const void *_data, int len)
 			break;
 	}
 
-	if (orig_len - len)
-		ch->notify_other_cpu();
-
 	return orig_len - len;
 }
 
+static int smd_stream_write(smd_channel_t *ch, const void *_data, int len)
+{
+	int r;
+
+	SMD_DBG("smd_stream_write() %d -> ch%d\n", len, ch->n);
+	if (len < 0)
+		return -EINVAL;
+	else if (len == 0)
+		return 0;
+
+	r = ch_write(ch, _data, len);
+	if (r)
+		ch_tx_notify(ch, 1, r);
+
+	return r;
+}
+
 static int smd_packet_write(smd_channel_t *ch, const void *_data, int len)
 {
 	int ret;
@@ -716,7 +920,7 @@ static int smd_packet_write(smd_channel_t *ch, const void *_data, int len)
 	hdr[1] = hdr[2] = hdr[3] = hdr[4] = 0;
 
 
-	ret = smd_stream_write(ch, hdr, sizeof(hdr));
+	ret = ch_write(ch, hdr, sizeof(hdr));
 	if (ret < 0 || ret != sizeof(hdr)) {
 		SMD_DBG("%s failed to write pkt header: "
 			"%d returned\n", __func__, ret);
@@ -724,7 +928,9 @@ static int smd_packet_write(smd_channel_t *ch, const void *_data, int len)
 	}
 
 
-	ret = smd_stream_write(ch, _data, len);
+	ret = ch_write(ch, _data, len);
+	/* one interrupt for header and payload */
+	ch_tx_notify(ch, 1, sizeof(hdr) + ret);
 	if (ret < 0 || ret != len) {
 		SMD_DBG("%s failed to write pkt data: "
 			"%d returned\n", __func__, ret);
@@ -743,7 +949,7 @@ static int smd_stream_read(smd_channel_t *ch, void *data, int len)
 
 	r = ch_read(ch, data, len);
 	if (r > 0)
-		ch->notify_other_cpu();
+		ch_rx_notify(ch, 1, r);
 
 	return r;
 }
@@ -761,7 +967,7 @@ static int smd_packet_read(smd_channel_t *ch, void *data, int len)
 
 	r = ch_read(ch, data, len);
 	if (r > 0)
-		ch->notify_other_cpu();
+		ch_rx_notify(ch, 1, r);
 
 	spin_lock_irqsave(&smd_lock, flags);
 	ch->current_packet -= r;
@@ -783,7 +989,7 @@ static int smd_packet_read_from_cb(smd_channel_t *ch, void *data, int len)
 
 	r = ch_read(ch, data, len);
 	if (r > 0)
-		ch->notify_other_cpu();
+		ch_rx_notify(ch, 1, r);
 
 	ch->current_packet -= r;
 	update_packet_state(ch);
@@ -847,6 +1053,7 @@ static int smd_alloc_channel(struct smd_alloc_elm *alloc_elm)
 		return -1;
 	}
 	ch->n = alloc_elm->cid;
+	INIT_LIST_HEAD(&ch->poll_list);
 
 	if (smd_alloc_v2(ch) && smd_alloc_v1(ch)) {
 		kfree(ch);
@@ -903,7 +1110,7 @@ static inline void notify_loopback_smd(void)
 
 	spin_lock_irqsave(&smd_lock, flags);
 	list_for_each_entry(ch, &smd_ch_list_loopback, ch_list) {
-		ch->notify(ch->priv, SMD_EVENT_DATA);
+		ch_notify_data(ch);
 	}
 	spin_unlock_irqrestore(&smd_lock, flags);
 }
@@ -920,6 +1127,7 @@ static int smd_alloc_loopback_channel(void)
 		return -1;
 	}
 	ch->n = SMD_LOOPBACK_CID;
+	INIT_LIST_HEAD(&ch->poll_list);
 
 	ch->send = &smd_loopback_ctl;
 	ch->recv = &smd_loopback_ctl;
@@ -1001,6 +1209,11 @@ int smd_named_open_on_edge(const char *name, uint32_t edge,
 	ch->current_packet = 0;
 	ch->last_state = SMD_SS_CLOSED;
 	ch->priv = priv;
+	ch->reserved = 0;
+	ch->tx_pending_pkts = ch->tx_pending_bytes = 0;
+	ch->rx_pending_pkts = ch->rx_pending_bytes = 0;
+	ch->tx_coalesce_pkts = ch->tx_coalesce_bytes = 0;
+	ch->rx_coalesce_pkts = ch->rx_coalesce_bytes = 0;
 
 	if (edge == SMD_LOOPBACK_TYPE) {
 		ch->last_state = SMD_SS_OPENED;
@@ -1053,6 +1266,8 @@ int smd_close(smd_channel_t *ch)
 
 	SMD_INFO("smd_close(%s)\n", ch->name);
 
+	smd_poll_disable(ch);
+
 	spin_lock_irqsave(&smd_lock, flags);
 	ch->notify = do_nothing_notify;
 	list_del(&ch->ch_list);
@@ -1128,6 +1343,142 @@ int smd_cur_packet_size(smd_channel_t *ch)
 	return ch->current_packet;
 }
 
+static int ch_is_packet(smd_channel_t *ch)
+{
+	return ch->write == smd_packet_write;
+}
+
+int smd_write_reserve(smd_channel_t *ch, int len, struct smd_span *span)
+{
+	unsigned hdr[5];
+	unsigned avail, head;
+	struct smd_span hspan;
+
+	if (len <= 0)
+		return -EINVAL;
+	if (!ch_is_open(ch))
+		return -ENODEV;
+
+	avail = smd_stream_write_avail(ch);
+	head = ch->send->head;
+
+	if (ch_is_packet(ch)) {
+		if (avail < len + SMD_HEADER_SIZE)
+			goto full;
+
+		hdr[0] = len;
+		hdr[1] = hdr[2] = hdr[3] = hdr[4] = 0;
+		ch_span(ch, ch->send_data, head, SMD_HEADER_SIZE, &hspan);
+		memcpy(hspan.data[0], hdr, hspan.len[0]);
+		memcpy(hspan.data[1], (char *)hdr + hspan.len[0],
+		       hspan.len[1]);
+
+		ch->reserved = SMD_HEADER_SIZE + len;
+		head = (head + SMD_HEADER_SIZE) & ch->fifo_mask;
+	} else {
+		if (!avail)
+			goto full;
+		if (len > avail)
+			len = avail;
+		ch->reserved = len;
+	}
+
+	ch_span(ch, ch->send_data, head, len, span);
+	return len;
+
+full:
+	/* let the other side drain what we've held back */
+	smd_write_flush(ch);
+	return -ENOMEM;
+}
+EXPORT_SYMBOL(smd_write_reserve);
+
+int smd_write_commit(smd_channel_t *ch, int len)
+{
+	unsigned total = len;
+
+	if (ch_is_packet(ch))
+		total += SMD_HEADER_SIZE;
+	if (len <= 0 || total > ch->reserved ||
+	    (ch_is_packet(ch) && total != ch->reserved))
+		return -EINVAL;
+
+	/* the data must be visible before the head that publishes it */
+	wmb();
+	ch_write_done(ch, total);
+	ch->reserved = 0;
+	ch_tx_notify(ch, 1, total);
+
+	return 0;
+}
+EXPORT_SYMBOL(smd_write_commit);
+
+void smd_write_flush(smd_channel_t *ch)
+{
+	if (ch->tx_pending_pkts) {
+		ch->tx_pending_pkts = 0;
+		ch->tx_pending_bytes = 0;
+		ch->notify_other_cpu();
+	}
+}
+EXPORT_SYMBOL(smd_write_flush);
+
+int smd_read_peek(smd_channel_t *ch, struct smd_span *span)
+{
+	int len = ch->read_avail(ch);
+
+	if (len > 0)
+		ch_span(ch, ch->recv_data, ch->recv->tail, len, span);
+	return len;
+}
+EXPORT_SYMBOL(smd_read_peek);
+
+int smd_read_consume(smd_channel_t *ch, int len)
+{
+	unsigned long flags;
+
+	if (len < 0 || len > ch->read_avail(ch))
+		return -EINVAL;
+	if (!len)
+		return 0;
+
+	ch_read_done(ch, len);
+	if (ch_is_packet(ch)) {
+		spin_lock_irqsave(&smd_lock, flags);
+		ch->current_packet -= len;
+		/* the packet's header counts as read with its last byte */
+		ch_rx_notify(ch, !ch->current_packet,
+			     len + (ch->current_packet ? 0 : SMD_HEADER_SIZE));
+		update_packet_state(ch);
+		spin_unlock_irqrestore(&smd_lock, flags);
+	} else {
+		ch_rx_notify(ch, 1, len);
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL(smd_read_consume);
+
+void smd_read_flush(smd_channel_t *ch)
+{
+	if (ch->rx_pending_pkts || ch->rx_pending_bytes) {
+		ch->rx_pending_pkts = 0;
+		ch->rx_pending_bytes = 0;
+		ch->notify_other_cpu();
+	}
+}
+EXPORT_SYMBOL(smd_read_flush);
+
+void smd_set_coalesce(smd_channel_t *ch, unsigned tx_pkts, unsigned tx_bytes,
+		      unsigned rx_pkts, unsigned rx_bytes)
+{
+	ch->tx_coalesce_pkts = tx_pkts;
+	ch->tx_coalesce_bytes = tx_bytes;
+	ch->rx_coalesce_pkts = rx_pkts;
+	ch->rx_coalesce_bytes = rx_bytes;
+}
+EXPORT_SYMBOL(smd_set_coalesce);
+
 int smd_tiocmget(smd_channel_t *ch)
 {
 	return  (ch->recv->fDSR ? TIOCM_DSR : 0) |
@@ -76,6 +76,10 @@ static void check_and_wakeup(struct smd_pkt_dev *smd_pkt_devp);
 static uint smd_pkt_modem_wait;
 module_param_named(modem_wait_timeout, smd_pkt_modem_wait,
 		   uint, S_IRUGO | S_IWUSR | S_IWGRP);
+/* take modem notifications only while the reader is waiting for one */
+static uint smd_pkt_poll;
+module_param_named(poll, smd_pkt_poll,
+		   uint, S_IRUGO | S_IWUSR | S_IWGRP);
 
 #define DEBUG
 #undef DEBUG
@@ -183,6 +187,11 @@ ssize_t smd_pkt_read(struct file *file,
 
 	chl = smd_pkt_devp->ch;
 wait_for_packet:
+	/* drained, so let the next packet's interrupt through */
+	if (smd_cur_packet_size(chl) == 0 ||
+	    smd_read_avail(chl) < smd_cur_packet_size(chl))
+		smd_poll_complete(chl);
+
 	r = wait_event_interruptible(smd_pkt_devp->ch_wait_queue,
 				     (smd_cur_packet_size(chl) > 0 &&
 				      smd_read_avail(chl) >=
@@ -368,6 +377,24 @@ static void check_and_wakeup(struct smd_pkt_dev *smd_pkt_devp)
 	D(KERN_ERR "%s: after wake_up\n", __func__);
 }
 
+/*
+ * Polled mode: wake the reader and leave the channel masked until it
+ * finds nothing left to read. Only the reader does any work.
+ */
+static int ch_poll(void *priv, int budget)
+{
+	struct smd_pkt_dev *smd_pkt_devp = priv;
+	int sz;
+
+	sz = smd_cur_packet_size(smd_pkt_devp->ch);
+	if (sz && sz <= smd_read_avail(smd_pkt_devp->ch))
+		wake_up_interruptible(&smd_pkt_devp->ch_wait_queue);
+	else
+		smd_poll_complete(smd_pkt_devp->ch);
+
+	return 0;
+}
+
 static void ch_notify(void *priv, unsigned event)
 {
 	struct smd_pkt_dev *smd_pkt_devp = priv;
@@ -538,8 +565,11 @@ int smd_pkt_open(struct inode *inode, struct file *file)
 		} else if (!smd_pkt_devp->is_open) {
 			pr_err("%s: Invalid open notification\n", __func__);
 			r = -ENODEV;
-		} else
+		} else {
 			r = 0;
+			if (smd_pkt_poll)
+				smd_poll_enable(smd_pkt_devp->ch, ch_poll, 1);
+		}
 	}
 release_pil:
 	if (peripheral && (r < 0))
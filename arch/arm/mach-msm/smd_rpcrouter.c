@@ -39,6 +39,9 @@
 #include <linux/platform_device.h>
 #include <linux/uaccess.h>
 #include <linux/debugfs.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/rculist.h>
 
 #include <asm/byteorder.h>
 
@@ -134,6 +137,11 @@ if (smd_rpcrouter_debug_mask & NTFY_MSG) \
 static LIST_HEAD(local_endpoints);
 static LIST_HEAD(remote_endpoints);
 
+/* endpoint lookup by address, under the same locks as the lists above */
+#define RPCROUTER_EPT_HASH_BITS 5
+static struct hlist_head local_endpoints_hash[1 << RPCROUTER_EPT_HASH_BITS];
+static struct hlist_head remote_endpoints_hash[1 << RPCROUTER_EPT_HASH_BITS];
+
 static LIST_HEAD(server_list);
 
 static wait_queue_head_t newserver_wait;
@@ -275,12 +283,39 @@ static int rpcrouter_send_control_msg(struct rpcrouter_xprt_info *xprt_info,
 	return 0;
 }
 
+static void rr_free_packet(struct rr_packet *pkt)
+{
+	kfree(pkt->data);
+	kfree(pkt);
+}
+
+static void rr_lat_record(unsigned long *hist, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int n = 0;
+
+	if (us > 1)
+		n = min_t(int, ilog2((unsigned long)us),
+			  RPCROUTER_LAT_BUCKETS - 1);
+	hist[n]++;
+}
+
+static struct hlist_head *local_ept_bucket(uint32_t cid)
+{
+	return &local_endpoints_hash[hash_32(cid, RPCROUTER_EPT_HASH_BITS)];
+}
+
+static struct hlist_head *remote_ept_bucket(uint32_t pid, uint32_t cid)
+{
+	return &remote_endpoints_hash[hash_32(pid ^ cid,
+					      RPCROUTER_EPT_HASH_BITS)];
+}
+
 static void modem_reset_start_cleanup(void)
 {
 	struct msm_rpc_endpoint *ept;
 	struct rr_remote_endpoint *r_ept;
 	struct rr_packet *pkt, *tmp_pkt;
-	struct rr_fragment *frag, *next;
 	struct msm_rpc_reply *reply, *reply_tmp;
 	unsigned long flags;
 
@@ -307,13 +342,7 @@ static void modem_reset_start_cleanup(void)
 			list_for_each_entry_safe(pkt, tmp_pkt,
 						 &ept->incomplete, list) {
 				list_del(&pkt->list);
-				frag = pkt->first;
-				while (frag != NULL) {
-					next = frag->next;
-					kfree(frag);
-					frag = next;
-				}
-			kfree(pkt);
+				rr_free_packet(pkt);
 			}
 			spin_unlock(&ept->incomplete_lock);
 			/* remove all completed packets waiting to be read*/
@@ -321,13 +350,7 @@ static void modem_reset_start_cleanup(void)
 			list_for_each_entry_safe(pkt, tmp_pkt, &ept->read_q,
 						 list) {
 				list_del(&pkt->list);
-				frag = pkt->first;
-				while (frag != NULL) {
-					next = frag->next;
-					kfree(frag);
-					frag = next;
-				}
-				kfree(pkt);
+				rr_free_packet(pkt);
 			}
 			spin_unlock(&ept->read_q_lock);
 			/* Set restart state for local ep */
@@ -534,6 +557,7 @@ struct msm_rpc_endpoint *msm_rpcrouter_create_local_endpoint(dev_t dev)
 
 	spin_lock_irqsave(&local_endpoints_lock, flags);
 	list_add_tail(&ept->list, &local_endpoints);
+	hlist_add_head_rcu(&ept->hash, local_ept_bucket(ept->cid));
 	spin_unlock_irqrestore(&local_endpoints_lock, flags);
 	return ept;
 }
@@ -543,6 +567,7 @@ int msm_rpcrouter_destroy_local_endpoint(struct msm_rpc_endpoint *ept)
 	int rc;
 	union rr_control_msg msg;
 	struct msm_rpc_reply *reply, *reply_tmp;
+	struct rr_packet *pkt, *tmp_pkt;
 	unsigned long flags;
 	struct rpcrouter_xprt_info *xprt_info;
 
@@ -551,7 +576,10 @@ int msm_rpcrouter_destroy_local_endpoint(struct msm_rpc_endpoint *ept)
 	** destroying it.*/
 	spin_lock_irqsave(&local_endpoints_lock, flags);
 	list_del(&ept->list);
+	hlist_del_rcu(&ept->hash);
 	spin_unlock_irqrestore(&local_endpoints_lock, flags);
+	/* wait out do_read_data(), which finds us without the lock */
+	synchronize_rcu();
 	if (ept->dst_pid != 0xffffffff) {
 		msg.cmd = RPCROUTER_CTRL_CMD_REMOVE_CLIENT;
 		msg.cli.pid = ept->pid;
@@ -581,6 +609,15 @@ int msm_rpcrouter_destroy_local_endpoint(struct msm_rpc_endpoint *ept)
 	}
 	spin_unlock_irqrestore(&ept->reply_q_lock, flags);
 
+	list_for_each_entry_safe(pkt, tmp_pkt, &ept->incomplete, list) {
+		list_del(&pkt->list);
+		rr_free_packet(pkt);
+	}
+	list_for_each_entry_safe(pkt, tmp_pkt, &ept->read_q, list) {
+		list_del(&pkt->list);
+		rr_free_packet(pkt);
+	}
+
 	wake_lock_destroy(&ept->read_q_wake_lock);
 	wake_lock_destroy(&ept->reply_q_wake_lock);
 	kfree(ept);
@@ -604,16 +641,19 @@ static int rpcrouter_create_remote_endpoint(uint32_t pid, uint32_t cid)
 
 	spin_lock_irqsave(&remote_endpoints_lock, flags);
 	list_add_tail(&new_c->list, &remote_endpoints);
+	hlist_add_head(&new_c->hash, remote_ept_bucket(pid, cid));
 	new_c->quota_restart_state = RESTART_NORMAL;
 	spin_unlock_irqrestore(&remote_endpoints_lock, flags);
 	return 0;
 }
 
+/* call under rcu_read_lock() or local_endpoints_lock */
 static struct msm_rpc_endpoint *rpcrouter_lookup_local_endpoint(uint32_t cid)
 {
 	struct msm_rpc_endpoint *ept;
+	struct hlist_node *pos;
 
-	list_for_each_entry(ept, &local_endpoints, list) {
+	hlist_for_each_entry_rcu(ept, pos, local_ept_bucket(cid), hash) {
 		if (ept->cid == cid)
 			return ept;
 	}
@@ -624,10 +664,11 @@ static struct rr_remote_endpoint *rpcrouter_lookup_remote_endpoint(uint32_t pid,
 								   uint32_t cid)
 {
 	struct rr_remote_endpoint *ept;
+	struct hlist_node *pos;
 	unsigned long flags;
 
 	spin_lock_irqsave(&remote_endpoints_lock, flags);
-	list_for_each_entry(ept, &remote_endpoints, list) {
+	hlist_for_each_entry(ept, pos, remote_ept_bucket(pid, cid), hash) {
 		if ((ept->pid == pid) && (ept->cid == cid)) {
 			spin_unlock_irqrestore(&remote_endpoints_lock, flags);
 			D("%s: Found r_ept %p for %d:%08x\n", __func__, ept,
@@ -822,6 +863,7 @@ static int process_control_msg(struct rpcrouter_xprt_info *xprt_info,
 		if (r_ept) {
 			spin_lock_irqsave(&remote_endpoints_lock, flags);
 			list_del(&r_ept->list);
+			hlist_del(&r_ept->hash);
 			spin_unlock_irqrestore(&remote_endpoints_lock, flags);
 			kfree(r_ept);
 		}
@@ -886,6 +928,36 @@ static void *rr_malloc(unsigned sz)
 	return ptr;
 }
 
+static struct rr_packet *rr_new_packet(struct rr_header *hdr, uint32_t mid,
+				       uint32_t size)
+{
+	struct rr_packet *pkt = rr_malloc(sizeof(struct rr_packet));
+
+	pkt->data = rr_malloc(size);
+	pkt->size = size;
+	memcpy(&pkt->hdr, hdr, sizeof(*hdr));
+	pkt->mid = mid;
+	pkt->length = 0;
+	return pkt;
+}
+
+/* make room for len more bytes; only long messages ever need to move */
+static void rr_packet_reserve(struct rr_packet *pkt, uint32_t len)
+{
+	uint32_t size = pkt->size;
+	void *data;
+
+	if (pkt->length + len <= size)
+		return;
+
+	size = max(2 * size, pkt->length + len);
+	data = rr_malloc(size);
+	memcpy(data, pkt->data, pkt->length);
+	kfree(pkt->data);
+	pkt->data = data;
+	pkt->size = size;
+}
+
 static int rr_read(struct rpcrouter_xprt_info *xprt_info,
 		   void *data, uint32_t len)
 {
@@ -941,9 +1013,9 @@ static char *type_to_str(int i)
 static void do_read_data(struct work_struct *work)
 {
 	struct rr_header hdr;
-	struct rr_packet *pkt;
-	struct rr_fragment *frag;
+	struct rr_packet *pkt, *tmp;
 	struct msm_rpc_endpoint *ept;
+	void *data;
 #if defined(CONFIG_MSM_ONCRPCROUTER_DEBUG)
 	struct rpc_request_hdr *rq;
 #endif
@@ -995,21 +1067,51 @@ static void do_read_data(struct work_struct *work)
 		goto fail_io;
 
 	hdr.size -= sizeof(pm);
+	mid = PACMARK_MID(pm);
+
+	/* Take the partial packet this fragment continues, if any, off
+	 * the endpoint so that the payload can be read straight into it.
+	 */
+	pkt = NULL;
+	rcu_read_lock();
+	ept = rpcrouter_lookup_local_endpoint(hdr.dst_cid);
+	if (ept) {
+		spin_lock_irqsave(&ept->incomplete_lock, flags);
+		list_for_each_entry(tmp, &ept->incomplete, list) {
+			if (tmp->mid == mid) {
+				list_del(&tmp->list);
+				pkt = tmp;
+				break;
+			}
+		}
+		spin_unlock_irqrestore(&ept->incomplete_lock, flags);
+	}
+	rcu_read_unlock();
+
+	if (!ept) {
+		DIAG("no local ept for cid %08x\n", hdr.dst_cid);
+		if (rr_read(xprt_info, xprt_info->r2r_buf, hdr.size))
+			goto fail_io;
+		goto done;
+	}
 
-	frag = rr_malloc(sizeof(*frag));
-	frag->next = NULL;
-	frag->length = hdr.size;
-	if (rr_read(xprt_info, frag->data, hdr.size)) {
-		kfree(frag);
+	if (!pkt)
+		pkt = rr_new_packet(&hdr, mid, PACMARK_LAST(pm) ?
+				    hdr.size : RPCROUTER_REASM_SIZE);
+	rr_packet_reserve(pkt, hdr.size);
+	data = pkt->data + pkt->length;
+	if (rr_read(xprt_info, data, hdr.size)) {
+		rr_free_packet(pkt);
 		goto fail_io;
 	}
+	pkt->length += hdr.size;
 
 #if defined(CONFIG_MSM_ONCRPCROUTER_DEBUG)
 	if ((smd_rpcrouter_debug_mask & RAW_PMR) &&
 	    ((pm >> 30 & 0x1) || (pm >> 31 & 0x1))) {
 		uint32_t xid = 0;
 		if (pm >> 30 & 0x1) {
-			rq = (struct rpc_request_hdr *) frag->data;
+			rq = (struct rpc_request_hdr *) data;
 			xid = ntohl(rq->xid);
 		}
 		if ((pm >> 31 & 0x1) || (pm >> 30 & 0x1))
@@ -1023,7 +1125,7 @@ static void do_read_data(struct work_struct *work)
 	}
 
 	if (smd_rpcrouter_debug_mask & SMEM_LOG) {
-		rq = (struct rpc_request_hdr *) frag->data;
+		rq = (struct rpc_request_hdr *) data;
 		if (rq->xid == 0)
 			smem_log_event(SMEM_LOG_PROC_ID_APPS |
 				       RPC_ROUTER_LOG_EVENT_MID_READ,
@@ -1039,73 +1141,31 @@ static void do_read_data(struct work_struct *work)
 	}
 #endif
 
-	spin_lock_irqsave(&local_endpoints_lock, flags);
-	ept = rpcrouter_lookup_local_endpoint(hdr.dst_cid);
-	if (!ept) {
-		spin_unlock_irqrestore(&local_endpoints_lock, flags);
-		DIAG("no local ept for cid %08x\n", hdr.dst_cid);
-		kfree(frag);
-		goto done;
-	}
-
-	/* See if there is already a partial packet that matches our mid
-	 * and if so, append this fragment to that packet.
-	 */
-	mid = PACMARK_MID(pm);
-	spin_lock(&ept->incomplete_lock);
-	list_for_each_entry(pkt, &ept->incomplete, list) {
-		if (pkt->mid == mid) {
-			pkt->last->next = frag;
-			pkt->last = frag;
-			pkt->length += frag->length;
-			if (PACMARK_LAST(pm)) {
-				list_del(&pkt->list);
-				spin_unlock(&ept->incomplete_lock);
-				goto packet_complete;
-			}
-			spin_unlock(&ept->incomplete_lock);
-			spin_unlock_irqrestore(&local_endpoints_lock, flags);
-			goto done;
-		}
-	}
-	spin_unlock(&ept->incomplete_lock);
-	spin_unlock_irqrestore(&local_endpoints_lock, flags);
-	/* This mid is new -- create a packet for it, and put it on
-	 * the incomplete list if this fragment is not a last fragment,
-	 * otherwise put it on the read queue.
-	 */
-	pkt = rr_malloc(sizeof(struct rr_packet));
-	pkt->first = frag;
-	pkt->last = frag;
-	memcpy(&pkt->hdr, &hdr, sizeof(hdr));
-	pkt->mid = mid;
-	pkt->length = frag->length;
-
-	spin_lock_irqsave(&local_endpoints_lock, flags);
+	/* The endpoint may have gone while we slept in rr_read() */
+	rcu_read_lock();
 	ept = rpcrouter_lookup_local_endpoint(hdr.dst_cid);
 	if (!ept) {
-		spin_unlock_irqrestore(&local_endpoints_lock, flags);
+		rcu_read_unlock();
 		DIAG("no local ept for cid %08x\n", hdr.dst_cid);
-		kfree(frag);
-		kfree(pkt);
+		rr_free_packet(pkt);
 		goto done;
 	}
 	if (!PACMARK_LAST(pm)) {
-		spin_lock(&ept->incomplete_lock);
+		spin_lock_irqsave(&ept->incomplete_lock, flags);
 		list_add_tail(&pkt->list, &ept->incomplete);
-		spin_unlock(&ept->incomplete_lock);
-		spin_unlock_irqrestore(&local_endpoints_lock, flags);
+		spin_unlock_irqrestore(&ept->incomplete_lock, flags);
+		rcu_read_unlock();
 		goto done;
 	}
 
-packet_complete:
-	spin_lock(&ept->read_q_lock);
+	pkt->rx_time = ktime_get();
+	spin_lock_irqsave(&ept->read_q_lock, flags);
 	D("%s: take read lock on ept %p\n", __func__, ept);
 	wake_lock_timeout(&ept->read_q_wake_lock, HZ*10);
 	list_add_tail(&pkt->list, &ept->read_q);
 	wake_up(&ept->wait_q);
-	spin_unlock(&ept->read_q_lock);
-	spin_unlock_irqrestore(&local_endpoints_lock, flags);
+	spin_unlock_irqrestore(&ept->read_q_lock, flags);
+	rcu_read_unlock();
 done:
 
 	if (hdr.confirm_rx) {
@@ -1588,36 +1648,15 @@ EXPORT_SYMBOL(msm_rpc_write);
 int msm_rpc_read(struct msm_rpc_endpoint *ept, void **buffer,
 		 unsigned user_len, long timeout)
 {
-	struct rr_fragment *frag, *next;
-	char *buf;
+	void *data;
 	int rc;
 
-	rc = __msm_rpc_read(ept, &frag, user_len, timeout);
+	rc = __msm_rpc_read(ept, &data, user_len, timeout);
 	if (rc <= 0)
 		return rc;
 
-	/* single-fragment messages conveniently can be
-	 * returned as-is (the buffer is at the front)
-	 */
-	if (frag->next == 0) {
-		*buffer = (void*) frag;
-		return rc;
-	}
-
-	/* multi-fragment messages, we have to do it the
-	 * hard way, which is rather disgusting right now
-	 */
-	buf = rr_malloc(rc);
-	*buffer = buf;
-
-	while (frag != NULL) {
-		memcpy(buf, frag->data, frag->length);
-		next = frag->next;
-		buf += frag->length;
-		kfree(frag);
-		frag = next;
-	}
-
+	/* messages are reassembled in one buffer, so hand it over */
+	*buffer = data;
 	return rc;
 }
 EXPORT_SYMBOL(msm_rpc_read);
@@ -1639,6 +1678,7 @@ int msm_rpc_call_reply(struct msm_rpc_endpoint *ept, uint32_t proc,
 {
 	struct rpc_request_hdr *req = _request;
 	struct rpc_reply_hdr *reply;
+	ktime_t start;
 	int rc;
 
 	if (request_size < sizeof(*req))
@@ -1654,6 +1694,7 @@ int msm_rpc_call_reply(struct msm_rpc_endpoint *ept, uint32_t proc,
 	req->vers = ept->dst_vers;
 	req->procedure = cpu_to_be32(proc);
 
+	start = ktime_get();
 	rc = msm_rpc_write(ept, req, request_size);
 	if (rc < 0)
 		return rc;
@@ -1679,6 +1720,7 @@ int msm_rpc_call_reply(struct msm_rpc_endpoint *ept, uint32_t proc,
 			kfree(reply);
 			continue;
 		}
+		rr_lat_record(ept->call_lat, start);
 		if (reply->reply_stat != 0) {
 			rc = -EPERM;
 			break;
@@ -1715,7 +1757,7 @@ static inline int ept_packet_available(struct msm_rpc_endpoint *ept)
 }
 
 int __msm_rpc_read(struct msm_rpc_endpoint *ept,
-		   struct rr_fragment **frag_ret,
+		   void **data,
 		   unsigned len, long timeout)
 {
 	struct rr_packet *pkt;
@@ -1790,14 +1832,15 @@ int __msm_rpc_read(struct msm_rpc_endpoint *ept,
 	list_del(&pkt->list);
 	spin_unlock_irqrestore(&ept->read_q_lock, flags);
 
+	rr_lat_record(ept->read_lat, pkt->rx_time);
 	rc = pkt->length;
 
-	*frag_ret = pkt->first;
-	rq = (void*) pkt->first->data;
+	rq = pkt->data;
 	if ((rc >= (sizeof(uint32_t) * 3)) && (rq->type == 0)) {
 		/* RPC CALL */
 		reply = get_avail_reply(ept);
 		if (!reply) {
+			rr_free_packet(pkt);
 			rc = -ENOMEM;
 			goto read_release_lock;
 		}
@@ -1809,6 +1852,7 @@ int __msm_rpc_read(struct msm_rpc_endpoint *ept,
 		set_pend_reply(ept, reply);
 	}
 
+	*data = pkt->data;
 	kfree(pkt);
 
 	IO("READ on ept %p (%d bytes)\n", ept, rc);
@@ -2186,6 +2230,37 @@ static int dump_msm_rpc_endpoint(char *buf, int max)
 	return i;
 }
 
+static int dump_latency(char *buf, int max)
+{
+	int i = 0;
+	int n;
+	unsigned long flags;
+	struct msm_rpc_endpoint *ept;
+
+	i += scnprintf(buf + i, max - i, "usec");
+	for (n = 1; n < RPCROUTER_LAT_BUCKETS; n++)
+		i += scnprintf(buf + i, max - i, " <%u", 1U << n);
+	i += scnprintf(buf + i, max - i, " more\n\n");
+
+	spin_lock_irqsave(&local_endpoints_lock, flags);
+	list_for_each_entry(ept, &local_endpoints, list) {
+		i += scnprintf(buf + i, max - i, "cid: 0x%08x prog: 0x%08x\n",
+			       ept->cid, be32_to_cpu(ept->dst_prog));
+		i += scnprintf(buf + i, max - i, "read:");
+		for (n = 0; n < RPCROUTER_LAT_BUCKETS; n++)
+			i += scnprintf(buf + i, max - i, " %lu",
+				       ept->read_lat[n]);
+		i += scnprintf(buf + i, max - i, "\ncall:");
+		for (n = 0; n < RPCROUTER_LAT_BUCKETS; n++)
+			i += scnprintf(buf + i, max - i, " %lu",
+				       ept->call_lat[n]);
+		i += scnprintf(buf + i, max - i, "\n\n");
+	}
+	spin_unlock_irqrestore(&local_endpoints_lock, flags);
+
+	return i;
+}
+
 #define DEBUG_BUFMAX 4096
 static char debug_buffer[DEBUG_BUFMAX];
 
@@ -2229,6 +2304,8 @@ static void debugfs_init(void)
 		     dump_remote_endpoints);
 	debug_create("dump_servers", 0444, dent,
 		     dump_servers);
+	debug_create("latency", 0444, dent,
+		     dump_latency);
 
 }
 
@@ -21,6 +21,7 @@
 #include <linux/types.h>
 #include <linux/list.h>
 #include <linux/cdev.h>
+#include <linux/ktime.h>
 #include <linux/platform_device.h>
 #include <linux/msm_rpcrouter.h>
 #include <linux/wakelock.h>
@@ -88,19 +89,22 @@ struct rr_header {
 
 #define RPCROUTER_MAX_REMOTE_SERVERS		100
 
-struct rr_fragment {
-	unsigned char data[RPCROUTER_MSGSIZE_MAX];
-	uint32_t length;
-	struct rr_fragment *next;
-};
+/* buffer for a message whose first fragment isn't its last */
+#define RPCROUTER_REASM_SIZE			(4 * RPCROUTER_MSGSIZE_MAX)
+
+/* latency histograms: bucket n counts [2^n, 2^(n+1)) us, the last
+ * everything above */
+#define RPCROUTER_LAT_BUCKETS			16
 
 struct rr_packet {
 	struct list_head list;
-	struct rr_fragment *first;
-	struct rr_fragment *last;
+	/* fragments are read straight into place, end to end */
+	void *data;
+	uint32_t size;
 	struct rr_header hdr;
 	uint32_t mid;
 	uint32_t length;
+	ktime_t rx_time;
 };
 
 #define PACMARK_LAST(n) ((n) & 0x80000000)
@@ -134,6 +138,7 @@ struct rr_server {
 struct rr_remote_endpoint {
 	uint32_t pid;
 	uint32_t cid;
+	struct hlist_node hash;
 
 	int tx_quota_cntr;
 	int quota_restart_state;
@@ -154,6 +159,8 @@ struct msm_rpc_reply {
 
 struct msm_rpc_endpoint {
 	struct list_head list;
+	/* by cid, looked up under RCU when dispatching */
+	struct hlist_node hash;
 
 	/* incomplete packets waiting for assembly */
 	struct list_head incomplete;
@@ -194,6 +201,10 @@ struct msm_rpc_endpoint {
 
 	/* device node if this endpoint is accessed via userspace */
 	dev_t dev;
+
+	/* time packets waited on read_q, and msm_rpc_call_reply() took */
+	unsigned long read_lat[RPCROUTER_LAT_BUCKETS];
+	unsigned long call_lat[RPCROUTER_LAT_BUCKETS];
 };
 
 enum write_data_type {
@@ -216,7 +227,7 @@ struct rpcrouter_xprt {
 /* shared between smd_rpcrouter*.c */
 void msm_rpcrouter_xprt_notify(struct rpcrouter_xprt *xprt, unsigned event);
 int __msm_rpc_read(struct msm_rpc_endpoint *ept,
-		   struct rr_fragment **frag,
+		   void **data,
 		   unsigned len, long timeout);
 
 int msm_rpcrouter_close(void);
@@ -89,14 +89,90 @@ static int rpc_clients_cb_thread(void *data)
 	complete_and_exit(&client->cb_complete, 0);
 }
 
+/*
+ * Takes the request waiting for reply 'xid' off the pending list, so that
+ * it can't be cancelled any more.
+ */
+static struct msm_rpc_client_async *
+rpc_clients_async_find(struct msm_rpc_client *client, uint32_t xid)
+{
+	struct msm_rpc_client_async *req;
+
+	spin_lock(&client->async_lock);
+	list_for_each_entry(req, &client->async_list, list) {
+		if (req->xid == xid) {
+			list_del_init(&req->list);
+			spin_unlock(&client->async_lock);
+			return req;
+		}
+	}
+	spin_unlock(&client->async_lock);
+	return NULL;
+}
+
+static void rpc_clients_async_done(struct msm_rpc_client *client,
+				   struct msm_rpc_client_async *req, int rc)
+{
+	req->rc = rc;
+	if (req->done)
+		req->done(client, req);
+	else
+		complete(&req->complete);
+}
+
+static void rpc_clients_async_reply(struct msm_rpc_client *client,
+				    struct msm_rpc_client_async *req,
+				    void *buffer, int size)
+{
+	struct rpc_reply_hdr rpc_rsp;
+	int rc = 0;
+
+	xdr_init_input(&client->xdr, buffer, size);
+	xdr_recv_reply(&client->xdr, &rpc_rsp);
+
+	if (rpc_rsp.reply_stat != RPCMSG_REPLYSTAT_ACCEPTED) {
+		pr_err("%s: RPC call was denied! %d\n",
+		       __func__, rpc_rsp.reply_stat);
+		rc = -EPERM;
+	} else if (rpc_rsp.data.acc_hdr.accept_stat !=
+		   RPC_ACCEPTSTAT_SUCCESS) {
+		pr_err("%s: RPC call was not successful (%d)\n", __func__,
+		       rpc_rsp.data.acc_hdr.accept_stat);
+		rc = -EINVAL;
+	} else if (req->ret_func)
+		rc = req->ret_func(client, &client->xdr, req->ret_data);
+
+	xdr_clean_input(&client->xdr);
+	rpc_clients_async_done(client, req, rc);
+}
+
+/* Fails every request still waiting for a reply with 'rc' */
+static void rpc_clients_async_flush(struct msm_rpc_client *client, int rc)
+{
+	struct msm_rpc_client_async *req;
+	LIST_HEAD(pending);
+
+	spin_lock(&client->async_lock);
+	list_splice_init(&client->async_list, &pending);
+	spin_unlock(&client->async_lock);
+
+	while (!list_empty(&pending)) {
+		req = list_first_entry(&pending, struct msm_rpc_client_async,
+				       list);
+		list_del_init(&req->list);
+		rpc_clients_async_done(client, req, rc);
+	}
+}
+
 static int rpc_clients_thread(void *data)
 {
 	void *buffer;
-	uint32_t type;
+	uint32_t type, xid;
 	struct msm_rpc_client *client;
 	int rc = 0;
 	struct msm_rpc_client_cb_item *cb_item;
 	struct rpc_request_hdr req;
+	struct msm_rpc_client_async *async_req;
 
 	client = data;
 	for (;;) {
@@ -108,6 +184,10 @@ static int rpc_clients_thread(void *data)
 			break;
 		}
 
+		/* the remote end went away, no reply is coming */
+		if (rc == -ENETRESET)
+			rpc_clients_async_flush(client, rc);
+
 		if (rc < ((int)(sizeof(uint32_t) * 2))) {
 			kfree(buffer);
 			continue;
@@ -115,8 +195,16 @@ static int rpc_clients_thread(void *data)
 
 		type = be32_to_cpu(*((uint32_t *)buffer + 1));
 		if (type == 1) {
-			xdr_init_input(&client->xdr, buffer, rc);
-			wake_up(&client->reply_wait);
+			xid = be32_to_cpu(*(uint32_t *)buffer);
+			async_req = rpc_clients_async_find(client, xid);
+			if (async_req)
+				rpc_clients_async_reply(client, async_req,
+							buffer, rc);
+			else {
+				pr_info("%s: no request for reply xid %d\n",
+					__func__, xid);
+				kfree(buffer);
+			}
 		} else if (type == 0) {
 			if (client->cb_thread == NULL) {
 				xdr_init_input(&client->cb_xdr, buffer, rc);
@@ -152,6 +240,7 @@ static int rpc_clients_thread(void *data)
 			}
 		}
 	}
+	rpc_clients_async_flush(client, -ESHUTDOWN);
 	complete_and_exit(&client->complete, 0);
 }
 
@@ -182,8 +271,8 @@ static struct msm_rpc_client *msm_rpc_create_client(void)
 	}
 	xdr_init_output(&client->cb_xdr, buf, MSM_RPC_MSGSIZE_MAX);
 
-	init_waitqueue_head(&client->reply_wait);
-	mutex_init(&client->req_lock);
+	spin_lock_init(&client->async_lock);
+	INIT_LIST_HEAD(&client->async_list);
 	client->buf = NULL;
 	client->cb_buf = NULL;
 	client->cb_size = 0;
@@ -414,6 +503,45 @@ int msm_rpc_unregister_client(struct msm_rpc_client *client)
 }
 EXPORT_SYMBOL(msm_rpc_unregister_client);
 
+/*
+ * Adapters between the raw buffer argument and return functions of
+ * msm_rpc_client_req() and the xdr based request path.
+ */
+struct rpc_clients_req1 {
+	int (*arg_func)(struct msm_rpc_client *client, void *buf, void *data);
+	void *arg_data;
+	int (*ret_func)(struct msm_rpc_client *client, void *buf, void *data);
+	void *ret_data;
+};
+
+static int rpc_clients_arg1(struct msm_rpc_client *client,
+			    struct msm_rpc_xdr *xdr, void *data)
+{
+	struct rpc_clients_req1 *req1 = data;
+	int rc;
+
+	if (!req1->arg_func)
+		return 0;
+
+	rc = req1->arg_func(client, xdr->out_buf + xdr->out_index,
+			    req1->arg_data);
+	if (rc > 0)
+		xdr->out_index += rc;
+	return rc;
+}
+
+static int rpc_clients_ret1(struct msm_rpc_client *client,
+			    struct msm_rpc_xdr *xdr, void *data)
+{
+	struct rpc_clients_req1 *req1 = data;
+
+	if (!req1->ret_func)
+		return 0;
+
+	return req1->ret_func(client, xdr->in_buf +
+			      sizeof(struct rpc_reply_hdr), req1->ret_data);
+}
+
 /*
  * Interface to be used to send a client request.
  * If the request takes any arguments or expects any return, the user
@@ -449,82 +577,25 @@ int msm_rpc_client_req(struct msm_rpc_client *client, uint32_t proc,
 				       void *buf, void *data),
 		       void *ret_data, long timeout)
 {
-	struct rpc_reply_hdr *rpc_rsp;
-	int rc = 0;
-	uint32_t req_xid;
-
-	mutex_lock(&client->req_lock);
-
-	msm_rpc_setup_req((struct rpc_request_hdr *)client->xdr.out_buf,
-			  client->prog, client->ver, proc);
-	client->xdr.out_index = sizeof(struct rpc_request_hdr);
-	req_xid = *(uint32_t *)client->xdr.out_buf;
-	if (arg_func) {
-		rc = arg_func(client,
-			      (void *)((struct rpc_request_hdr *)
-				       client->xdr.out_buf + 1),
-			      arg_data);
-		if (rc < 0)
-			goto release_locks;
-		else
-			client->xdr.out_index += rc;
-	}
-
-	rc = msm_rpc_write(client->ept, client->xdr.out_buf,
-			   client->xdr.out_index);
-	if (rc < 0) {
-		pr_err("%s: couldn't send RPC request:%d\n", __func__, rc);
-		goto release_locks;
-	} else
-		rc = 0;
-
-	if (timeout < 0)
-		timeout = msecs_to_jiffies(10000);
-
-	do {
-		rc = wait_event_timeout(client->reply_wait,
-					xdr_read_avail(&client->xdr), timeout);
-		if (rc == 0) {
-			pr_err("%s: request timeout\n", __func__);
-			rc = -ETIMEDOUT;
-			goto release_locks;
-		}
-
-		rpc_rsp = (struct rpc_reply_hdr *)client->xdr.in_buf;
-		if (req_xid != rpc_rsp->xid) {
-			pr_info("%s: xid mismatch, req %d reply %d\n",
-			       __func__, be32_to_cpu(req_xid),
-			       be32_to_cpu(rpc_rsp->xid));
-			timeout = rc;
-			xdr_clean_input(&client->xdr);
-		} else
-			rc = 0;
-	} while (rc);
-
-	if (be32_to_cpu(rpc_rsp->reply_stat) != RPCMSG_REPLYSTAT_ACCEPTED) {
-		pr_err("%s: RPC call was denied! %d\n", __func__,
-		       be32_to_cpu(rpc_rsp->reply_stat));
-		rc = -EPERM;
-		goto free_and_release;
-	}
+	struct msm_rpc_client_async req;
+	struct rpc_clients_req1 req1 = {
+		.arg_func = arg_func,
+		.arg_data = arg_data,
+		.ret_func = ret_func,
+		.ret_data = ret_data,
+	};
+	int rc;
 
-	if (be32_to_cpu(rpc_rsp->data.acc_hdr.accept_stat) !=
-	    RPC_ACCEPTSTAT_SUCCESS) {
-		pr_err("%s: RPC call was not successful (%d)\n", __func__,
-		       be32_to_cpu(rpc_rsp->data.acc_hdr.accept_stat));
-		rc = -EINVAL;
-		goto free_and_release;
-	}
+	req.ret_func = rpc_clients_ret1;
+	req.ret_data = &req1;
+	req.done = NULL;
 
-	if (ret_func)
-		rc = ret_func(client, (void *)(rpc_rsp + 1), ret_data);
+	rc = msm_rpc_client_req_async(client, proc, rpc_clients_arg1, &req1,
+				      &req);
+	if (rc < 0)
+		return rc;
 
- free_and_release:
-	xdr_clean_input(&client->xdr);
-	client->xdr.out_index = 0;
- release_locks:
-	mutex_unlock(&client->req_lock);
-	return rc;
+	return msm_rpc_client_async_wait(client, &req, timeout);
 }
 EXPORT_SYMBOL(msm_rpc_client_req);
 
@@ -563,78 +634,145 @@ int msm_rpc_client_req2(struct msm_rpc_client *client, uint32_t proc,
 					struct msm_rpc_xdr *xdr, void *data),
 			void *ret_data, long timeout)
 {
-	struct rpc_reply_hdr rpc_rsp;
-	int rc = 0;
-	uint32_t req_xid;
+	struct msm_rpc_client_async req;
+	int rc;
+
+	req.ret_func = ret_func;
+	req.ret_data = ret_data;
+	req.done = NULL;
 
-	mutex_lock(&client->req_lock);
+	rc = msm_rpc_client_req_async(client, proc, arg_func, arg_data, &req);
+	if (rc < 0)
+		return rc;
+
+	return msm_rpc_client_async_wait(client, &req, timeout);
+}
+EXPORT_SYMBOL(msm_rpc_client_req2);
+
+/*
+ * Interface to be used to send a client request without waiting for the
+ * reply.  Any number of requests may be outstanding on a client; replies
+ * are matched to their request by xid in the client read thread, which
+ * unmarshals the result with req->ret_func and then either calls
+ * req->done or completes req->complete.
+ *
+ * ret_func and done run in the read thread and must not sleep waiting
+ * for another reply on the same client.
+ *
+ * client: pointer to client data sturcture
+ *
+ * proc: procedure being requested
+ *
+ * arg_func: argument function pointer.  'xdr' is the xdr being used.
+ *   'data' is arg_data.
+ *
+ * arg_data: passed as an input parameter to argument function.
+ *
+ * req: caller owned request; ret_func, ret_data and done must be set.
+ *
+ * Return Value:
+ *        0 if the request was sent, otherwise an error code is returned
+ *        and req is not referenced any more.
+ */
+int msm_rpc_client_req_async(struct msm_rpc_client *client, uint32_t proc,
+			     int (*arg_func)(struct msm_rpc_client *client,
+					     struct msm_rpc_xdr *xdr,
+					     void *data),
+			     void *arg_data,
+			     struct msm_rpc_client_async *req)
+{
+	int rc;
 
 	xdr_start_request(&client->xdr, client->prog, client->ver, proc);
-	req_xid = be32_to_cpu(*(uint32_t *)client->xdr.out_buf);
+	req->xid = be32_to_cpu(*(uint32_t *)client->xdr.out_buf);
 	if (arg_func) {
 		rc = arg_func(client, &client->xdr, arg_data);
 		if (rc < 0) {
 			mutex_unlock(&client->xdr.out_lock);
-			goto release_locks;
+			return rc;
 		}
 	}
 
+	/* the reply can come back before msm_rpc_write() returns */
+	init_completion(&req->complete);
+	req->rc = 0;
+	spin_lock(&client->async_lock);
+	list_add_tail(&req->list, &client->async_list);
+	spin_unlock(&client->async_lock);
+
 	rc = xdr_send_msg(&client->xdr);
 	if (rc < 0) {
 		pr_err("%s: couldn't send RPC request:%d\n", __func__, rc);
-		goto release_locks;
-	} else
-		rc = 0;
+		msm_rpc_client_async_cancel(client, req);
+		return rc;
+	}
 
+	return 0;
+}
+EXPORT_SYMBOL(msm_rpc_client_req_async);
+
+/*
+ * Interface to be used to wait for the reply to a request sent with
+ * msm_rpc_client_req_async() without a 'done' function.  The request is
+ * cancelled if no reply arrives in time.
+ *
+ * client: pointer to client data sturcture
+ *
+ * req: request being waited for
+ *
+ * timeout: timeout for reply wait in jiffies.  If negative timeout is
+ *   specified a default timeout of 10s is used.
+ *
+ * Return Value:
+ *        result of the request, or -ETIMEDOUT.
+ */
+int msm_rpc_client_async_wait(struct msm_rpc_client *client,
+			      struct msm_rpc_client_async *req, long timeout)
+{
 	if (timeout < 0)
 		timeout = msecs_to_jiffies(10000);
 
-	do {
-		rc = wait_event_timeout(client->reply_wait,
-					xdr_read_avail(&client->xdr), timeout);
-		if (rc == 0) {
+	if (!wait_for_completion_timeout(&req->complete, timeout)) {
+		if (!msm_rpc_client_async_cancel(client, req)) {
 			pr_err("%s: request timeout\n", __func__);
-			rc = -ETIMEDOUT;
-			goto release_locks;
+			return -ETIMEDOUT;
 		}
+		/* the reply is being handled right now */
+		wait_for_completion(&req->complete);
+	}
 
-		xdr_recv_reply(&client->xdr, &rpc_rsp);
-		/* TODO: may be this check should be a xdr function */
-		if (req_xid != rpc_rsp.xid) {
-			pr_info("%s: xid mismatch, req %d reply %d\n",
-				__func__, req_xid, rpc_rsp.xid);
-			timeout = rc;
-			xdr_clean_input(&client->xdr);
-		} else
-			rc = 0;
-	} while (rc);
+	return req->rc;
+}
+EXPORT_SYMBOL(msm_rpc_client_async_wait);
 
-	if (rpc_rsp.reply_stat != RPCMSG_REPLYSTAT_ACCEPTED) {
-		pr_err("%s: RPC call was denied! %d\n",
-		       __func__, rpc_rsp.reply_stat);
-		rc = -EPERM;
-		goto free_and_release;
-	}
+/*
+ * Interface to be used to give up on a request sent with
+ * msm_rpc_client_req_async().  A late reply is dropped.
+ *
+ * client: pointer to client data sturcture
+ *
+ * req: request to be cancelled
+ *
+ * Return Value:
+ *        0 if the request was cancelled and is no longer referenced,
+ *        -EBUSY if its reply is already being handled, in which case
+ *        it completes as usual.
+ */
+int msm_rpc_client_async_cancel(struct msm_rpc_client *client,
+				struct msm_rpc_client_async *req)
+{
+	int rc = -EBUSY;
 
-	if (rpc_rsp.data.acc_hdr.accept_stat != RPC_ACCEPTSTAT_SUCCESS) {
-		pr_err("%s: RPC call was not successful (%d)\n", __func__,
-		       rpc_rsp.data.acc_hdr.accept_stat);
-		rc = -EINVAL;
-		goto free_and_release;
+	spin_lock(&client->async_lock);
+	if (!list_empty(&req->list)) {
+		list_del_init(&req->list);
+		rc = 0;
 	}
+	spin_unlock(&client->async_lock);
 
-	if (ret_func)
-		rc = ret_func(client, &client->xdr, ret_data);
-
- free_and_release:
-	xdr_clean_input(&client->xdr);
-	/* TODO: put it in xdr_reset_output */
-	client->xdr.out_index = 0;
- release_locks:
-	mutex_unlock(&client->req_lock);
 	return rc;
 }
-EXPORT_SYMBOL(msm_rpc_client_req2);
+EXPORT_SYMBOL(msm_rpc_client_async_cancel);
 
 /*
  * Interface to be used to start accepted reply message required in
@@ -34,6 +34,12 @@
 
 static DEFINE_MUTEX(smd_tty_lock);
 
+/* Reads per poll for channels received in polled mode; 0 takes an
+ * interrupt for every modem notification instead. */
+static int smd_tty_poll_weight;
+module_param_named(poll_weight, smd_tty_poll_weight,
+		   int, S_IRUGO | S_IWUSR | S_IWGRP);
+
 struct smd_tty_info {
 	smd_channel_t *ch;
 	struct tty_struct *tty;
@@ -41,6 +47,8 @@ struct smd_tty_info {
 	int open_count;
 	struct tasklet_struct tty_tsklt;
 	struct timer_list buf_req_timer;
+	/* the tasklet and the smd poll may both be reading */
+	spinlock_t rx_lock;
 };
 
 static struct smd_tty_info smd_tty[MAX_SMD_TTYS];
@@ -51,17 +59,19 @@ static void buf_req_retry(unsigned long param)
 	tasklet_hi_schedule(&info->tty_tsklt);
 }
 
-static void smd_tty_read(unsigned long param)
+/* returns the number of reads done, up to budget */
+static int smd_tty_rx(struct smd_tty_info *info, int budget)
 {
 	unsigned char *ptr;
 	int avail;
-	struct smd_tty_info *info = (struct smd_tty_info *)param;
 	struct tty_struct *tty = info->tty;
+	int work;
 
 	if (!tty)
-		return;
+		return 0;
 
-	for (;;) {
+	spin_lock(&info->rx_lock);
+	for (work = 0; work < budget; work++) {
 		if (test_bit(TTY_THROTTLED, &tty->flags)) break;
 		avail = smd_read_avail(info->ch);
 		if (avail == 0)
@@ -74,10 +84,11 @@ static void smd_tty_read(unsigned long param)
 				info->buf_req_timer.expires = jiffies +
 							((30 * HZ)/1000);
 				info->buf_req_timer.function = buf_req_retry;
-				info->buf_req_timer.data = param;
+				info->buf_req_timer.data = (unsigned long)info;
 				add_timer(&info->buf_req_timer);
 			}
-			return;
+			spin_unlock(&info->rx_lock);
+			return work;
 		}
 
 		if (smd_read(info->ch, ptr, avail) != avail) {
@@ -91,9 +102,28 @@ static void smd_tty_read(unsigned long param)
 		wake_lock_timeout(&info->wake_lock, HZ / 2);
 		tty_flip_buffer_push(tty);
 	}
+	spin_unlock(&info->rx_lock);
 
 	/* XXX only when writable and necessary */
 	tty_wakeup(tty);
+	return work;
+}
+
+static void smd_tty_read(unsigned long param)
+{
+	smd_tty_rx((struct smd_tty_info *)param, INT_MAX);
+}
+
+static int smd_tty_poll(void *priv, int budget)
+{
+	struct smd_tty_info *info = priv;
+	int work;
+
+	work = smd_tty_rx(info, budget);
+	if (work < budget)
+		smd_poll_complete(info->ch);
+
+	return work;
 }
 
 static void smd_tty_notify(void *priv, unsigned event)
@@ -135,6 +165,7 @@ static int smd_tty_open(struct tty_struct *tty, struct file *f)
 		info->tty = tty;
 		tasklet_init(&info->tty_tsklt, smd_tty_read,
 			     (unsigned long)info);
+		spin_lock_init(&info->rx_lock);
 		wake_lock_init(&info->wake_lock, WAKE_LOCK_SUSPEND, name);
 		if (!info->ch) {
 			if (n == 36) {
@@ -150,6 +181,9 @@ static int smd_tty_open(struct tty_struct *tty, struct file *f)
 
 			res = smd_open(name, &info->ch, info,
 				       smd_tty_notify);
+			if (!res && smd_tty_poll_weight > 0)
+				smd_poll_enable(info->ch, smd_tty_poll,
+						smd_tty_poll_weight);
 		}
 	}
 	mutex_unlock(&smd_tty_lock);
@@ -166,6 +200,8 @@ static void smd_tty_close(struct tty_struct *tty, struct file *f)
 
 	mutex_lock(&smd_tty_lock);
 	if (--info->open_count == 0) {
+		if (info->ch)
+			smd_poll_disable(info->ch);
 		info->tty = 0;
 		tty->driver_data = 0;
 		del_timer(&info->buf_req_timer);
@@ -21,6 +21,7 @@
 #include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/list.h>
+#include <linux/rbtree.h>
 #include <linux/vmalloc.h>
 #include <linux/io.h>
 #include <linux/debugfs.h>
@@ -28,6 +29,7 @@
 #include <linux/mempolicy.h>
 #include <linux/kobject.h>
 #include <linux/pm_runtime.h>
+#include <linux/workqueue.h>
 #ifdef CONFIG_MEMORY_HOTPLUG
 #include <linux/memory.h>
 #include <linux/memory_hotplug.h>
@@ -76,6 +78,9 @@
  */
 #define PMEM_FLAGS_SUBMAP 0x1 << 3
 #define PMEM_FLAGS_UNSUBMAP 0x1 << 4
+/* indicates the allocation may be moved by defragmentation, it is cleared
+ * for good once the physical address is handed out or the file is shared */
+#define PMEM_FLAGS_MOVABLE (0x1 << 5)
 
 struct pmem_data {
 	/* in alloc mode: an index into the bitmap
@@ -101,9 +106,17 @@ struct pmem_data {
 	struct list_head region_list;
 	/* a linked list of data so we can access them for debugging */
 	struct list_head list;
-#if PMEM_DEBUG
+	/* references taken by get_pmem_addr for hardware use, a movable
+	 * allocation is not moved while any are held */
 	int ref;
-#endif
+	/* the file this data belongs to */
+	struct file *file;
+	/* the single master mapping of a movable allocation and its mm,
+	 * on which we hold an mm_count reference */
+	struct vm_area_struct *movable_vma;
+	struct mm_struct *movable_mm;
+	/* last defragmentation pass that looked at this data */
+	unsigned int defrag_gen;
 };
 
 struct pmem_bits {
@@ -116,6 +129,17 @@ struct pmem_region_node {
 	struct list_head list;
 };
 
+/* a run of quanta in the extent allocator, either free or allocated */
+struct pmem_extent {
+	/* in free_by_addr if free, in allocated if not */
+	struct rb_node addr_node;
+	/* in free_by_size, free extents only */
+	struct rb_node size_node;
+	/* first quantum and number of quanta */
+	unsigned long start;
+	unsigned long quanta;
+};
+
 #define PMEM_DEBUG_MSGS 0
 #if PMEM_DEBUG_MSGS
 #define DLOG(fmt,args...) \
@@ -226,6 +250,18 @@ struct pmem_info {
 			unsigned long used;      /* Bytes currently allocated */
 			struct list_head alist;  /* List of allocations       */
 		} system_mem;
+
+		struct {
+			/* free extents, ordered by start */
+			struct rb_root free_by_addr;
+			/* free extents, ordered by size then start */
+			struct rb_root free_by_size;
+			/* allocated extents, ordered by start */
+			struct rb_root allocated;
+			unsigned long free_quanta;
+			unsigned long nr_free;
+			unsigned long nr_allocated;
+		} extent;
 	} allocator;
 
 	int id;
@@ -265,6 +301,21 @@ struct pmem_info {
 	 * map and unmap as needed
 	 */
 	int map_on_demand;
+
+	/* allocation requests and failures, protected by arena_mutex */
+	unsigned long alloc_count;
+	unsigned long alloc_failures;
+	/*
+	 * defragmentation of movable allocations, extent allocator only;
+	 * defrag_mutex serializes passes and protects the counters
+	 */
+	struct mutex defrag_mutex;
+	struct work_struct defrag_work;
+	unsigned int defrag_gen;
+	unsigned long defrag_runs;
+	unsigned long defrag_moved;
+	unsigned long defrag_bytes_moved;
+	unsigned long defrag_busy;
 };
 #define to_pmem_info_id(a) (container_of(a, struct pmem_info, kobj)->id)
 
@@ -402,6 +453,8 @@ static ssize_t show_pmem_allocator_type(int id, char *buf)
 		return scnprintf(buf, PAGE_SIZE, "%s\n", "Bitmap");
 	case PMEM_ALLOCATORTYPE_SYSTEM:
 		return scnprintf(buf, PAGE_SIZE, "%s\n", "System heap");
+	case PMEM_ALLOCATORTYPE_EXTENT:
+		return scnprintf(buf, PAGE_SIZE, "%s\n", "Extent tree");
 	default:
 		return scnprintf(buf, PAGE_SIZE,
 			"??? Invalid allocator type (%d) for this region! "
@@ -445,11 +498,24 @@ static ssize_t show_pmem_mapped_regions(int id, char *buf)
 }
 RO_PMEM_ATTR(mapped_regions);
 
+static ssize_t show_pmem_alloc_stats(int id, char *buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ret = scnprintf(buf, PAGE_SIZE, "allocations: %lu\nfailures: %lu\n",
+		pmem[id].alloc_count, pmem[id].alloc_failures);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(alloc_stats);
+
 #define PMEM_COMMON_SYSFS_ATTRS \
 	&pmem_attr_base.attr, \
 	&pmem_attr_size.attr, \
 	&pmem_attr_allocator_type.attr, \
-	&pmem_attr_mapped_regions.attr
+	&pmem_attr_mapped_regions.attr, \
+	&pmem_attr_alloc_stats.attr
 
 
 static ssize_t show_pmem_allocated(int id, char *buf)
@@ -592,6 +658,93 @@ static struct kobj_type pmem_system_ktype = {
 	.default_attrs = pmem_system_attrs,
 };
 
+static unsigned long pmem_extent_largest_free(int id);
+
+static ssize_t show_pmem_extent_stats(int id, char *buf)
+{
+	unsigned long free_quanta, largest;
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	free_quanta = pmem[id].allocator.extent.free_quanta;
+	largest = pmem_extent_largest_free(id);
+	ret = scnprintf(buf, PAGE_SIZE,
+		"free quanta: %lu\n"
+		"largest free extent: %lu\n"
+		"free extents: %lu\n"
+		"allocated extents: %lu\n"
+		"fragmentation: %lu%%\n",
+		free_quanta, largest,
+		pmem[id].allocator.extent.nr_free,
+		pmem[id].allocator.extent.nr_allocated,
+		free_quanta ? 100 - largest * 100 / free_quanta : 0);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(extent_stats);
+
+static ssize_t show_pmem_free_extents(int id, char *buf)
+{
+	struct rb_node *n;
+	struct pmem_extent *e;
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ret = scnprintf(buf, PAGE_SIZE, "start\tquanta\n");
+	for (n = rb_first(&pmem[id].allocator.extent.free_by_addr);
+			n && (PAGE_SIZE - ret); n = rb_next(n)) {
+		e = rb_entry(n, struct pmem_extent, addr_node);
+		ret += scnprintf(buf + ret, PAGE_SIZE - ret, "%lu\t%lu\n",
+			e->start, e->quanta);
+	}
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(free_extents);
+
+static void pmem_defrag(int id);
+
+static ssize_t show_pmem_defrag(int id, char *buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].defrag_mutex);
+	ret = scnprintf(buf, PAGE_SIZE,
+		"passes: %lu\n"
+		"moved: %lu\n"
+		"bytes moved: %lu\n"
+		"busy: %lu\n",
+		pmem[id].defrag_runs, pmem[id].defrag_moved,
+		pmem[id].defrag_bytes_moved, pmem[id].defrag_busy);
+	mutex_unlock(&pmem[id].defrag_mutex);
+	return ret;
+}
+
+/* any write runs a defragmentation pass */
+static ssize_t store_pmem_defrag(int id, const char *buf, size_t count)
+{
+	pmem_defrag(id);
+	return count;
+}
+RW_PMEM_ATTR(defrag);
+
+static struct attribute *pmem_extent_attrs[] = {
+	PMEM_COMMON_SYSFS_ATTRS,
+
+	PMEM_BITMAP_BUDDY_BESTFIT_COMMON_SYSFS_ATTRS,
+
+	&pmem_attr_extent_stats.attr,
+	&pmem_attr_free_extents.attr,
+	&pmem_attr_defrag.attr,
+
+	NULL
+};
+
+static struct kobj_type pmem_extent_ktype = {
+	.sysfs_ops = &pmem_ops,
+	.default_attrs = pmem_extent_attrs,
+};
+
 static int pmem_allocate_from_id(const int id, const unsigned long size,
 						const unsigned int align)
 {
@@ -603,8 +756,14 @@ static int pmem_allocate_from_id(const int id, const unsigned long size,
 
 	ret = pmem[id].allocate(id, size, align);
 
-	if (ret < 0)
+	pmem[id].alloc_count++;
+	if (ret < 0) {
+		pmem[id].alloc_failures++;
 		pmem_put_region(id);
+		/* make room for the next attempt */
+		if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_EXTENT)
+			schedule_work(&pmem[id].defrag_work);
+	}
 
 	return ret;
 }
@@ -858,6 +1017,151 @@ static int pmem_free_bitmap(int id, int bitnum)
 	return -1;
 }
 
+/*
+ * Extent allocator: free extents are kept in two rbtrees, one ordered by
+ * address for coalescing on free and one by size for best-fit allocation;
+ * allocated extents are kept by address so free and len are O(log n).
+ * All of it is protected by arena_mutex.
+ */
+static void pmem_extent_insert_addr(struct rb_root *root,
+		struct pmem_extent *new)
+{
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+	struct pmem_extent *e;
+
+	while (*p) {
+		parent = *p;
+		e = rb_entry(parent, struct pmem_extent, addr_node);
+		if (new->start < e->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new->addr_node, parent, p);
+	rb_insert_color(&new->addr_node, root);
+}
+
+static void pmem_extent_insert_size(int id, struct pmem_extent *new)
+{
+	struct rb_node **p = &pmem[id].allocator.extent.free_by_size.rb_node;
+	struct rb_node *parent = NULL;
+	struct pmem_extent *e;
+
+	while (*p) {
+		parent = *p;
+		e = rb_entry(parent, struct pmem_extent, size_node);
+		if (new->quanta < e->quanta ||
+			(new->quanta == e->quanta && new->start < e->start))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new->size_node, parent, p);
+	rb_insert_color(&new->size_node,
+		&pmem[id].allocator.extent.free_by_size);
+}
+
+static void pmem_extent_add_free(int id, struct pmem_extent *e)
+{
+	pmem_extent_insert_addr(&pmem[id].allocator.extent.free_by_addr, e);
+	pmem_extent_insert_size(id, e);
+	pmem[id].allocator.extent.nr_free++;
+}
+
+static void pmem_extent_del_free(int id, struct pmem_extent *e)
+{
+	rb_erase(&e->addr_node, &pmem[id].allocator.extent.free_by_addr);
+	rb_erase(&e->size_node, &pmem[id].allocator.extent.free_by_size);
+	pmem[id].allocator.extent.nr_free--;
+}
+
+/* smallest free extent of at least 'quanta' quanta, or NULL */
+static struct pmem_extent *pmem_extent_best_fit(int id, unsigned long quanta)
+{
+	struct rb_node *n = pmem[id].allocator.extent.free_by_size.rb_node;
+	struct pmem_extent *e, *best = NULL;
+
+	while (n) {
+		e = rb_entry(n, struct pmem_extent, size_node);
+		if (e->quanta >= quanta) {
+			best = e;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	return best;
+}
+
+static unsigned long pmem_extent_largest_free(int id)
+{
+	struct rb_node *n = rb_last(&pmem[id].allocator.extent.free_by_size);
+
+	return n ? rb_entry(n, struct pmem_extent, size_node)->quanta : 0;
+}
+
+static struct pmem_extent *pmem_extent_find_allocated(int id,
+		unsigned long start)
+{
+	struct rb_node *n = pmem[id].allocator.extent.allocated.rb_node;
+	struct pmem_extent *e;
+
+	while (n) {
+		e = rb_entry(n, struct pmem_extent, addr_node);
+		if (start < e->start)
+			n = n->rb_left;
+		else if (start > e->start)
+			n = n->rb_right;
+		else
+			return e;
+	}
+	return NULL;
+}
+
+static int pmem_free_extent(int id, int index)
+{
+	/* caller should hold the lock on arena_mutex! */
+	struct pmem_extent *e, *prev = NULL, *next = NULL;
+	struct rb_node *n;
+	char currtask_name[FIELD_SIZEOF(struct task_struct, comm) + 1];
+
+	DLOG("index %d\n", index);
+
+	e = pmem_extent_find_allocated(id, index);
+	if (!e) {
+		printk(KERN_ALERT "pmem: %s: Attempt to free unallocated "
+			"index %d, id %d, pid %d(%s)\n", __func__, index, id,
+			current->pid, get_task_comm(currtask_name, current));
+		return -1;
+	}
+	rb_erase(&e->addr_node, &pmem[id].allocator.extent.allocated);
+	pmem[id].allocator.extent.nr_allocated--;
+	pmem[id].allocator.extent.free_quanta += e->quanta;
+
+	/* coalesce with the free neighbours, if they touch */
+	pmem_extent_insert_addr(&pmem[id].allocator.extent.free_by_addr, e);
+	n = rb_prev(&e->addr_node);
+	if (n)
+		prev = rb_entry(n, struct pmem_extent, addr_node);
+	n = rb_next(&e->addr_node);
+	if (n)
+		next = rb_entry(n, struct pmem_extent, addr_node);
+	rb_erase(&e->addr_node, &pmem[id].allocator.extent.free_by_addr);
+
+	if (prev && prev->start + prev->quanta == e->start) {
+		pmem_extent_del_free(id, prev);
+		prev->quanta += e->quanta;
+		kfree(e);
+		e = prev;
+	}
+	if (next && e->start + e->quanta == next->start) {
+		pmem_extent_del_free(id, next);
+		e->quanta += next->quanta;
+		kfree(next);
+	}
+	pmem_extent_add_free(id, e);
+	return 0;
+}
+
 static int pmem_free_system(int id, int index)
 {
 	/* caller should hold the lock on arena_mutex! */
@@ -927,6 +1231,14 @@ static int pmem_free_space_bitmap(int id, struct pmem_freespace *fs)
 	return 0;
 }
 
+static int pmem_free_space_extent(int id, struct pmem_freespace *fs)
+{
+	fs->total = pmem[id].allocator.extent.free_quanta * pmem[id].quantum;
+	fs->largest = pmem_extent_largest_free(id) * pmem[id].quantum;
+
+	return 0;
+}
+
 static int pmem_free_space_system(int id, struct pmem_freespace *fs)
 {
 	fs->total = pmem[id].size;
@@ -988,6 +1300,9 @@ static int pmem_release(struct inode *inode, struct file *file)
 			data->task = NULL;
 		}
 
+	if (data->movable_mm)
+		mmdrop(data->movable_mm);
+
 	file->private_data = NULL;
 
 	list_for_each_safe(elt, elt2, &data->region_list) {
@@ -1031,9 +1346,11 @@ static int pmem_open(struct inode *inode, struct file *file)
 	data->vma = NULL;
 	data->pid = 0;
 	data->master_file = NULL;
-#if PMEM_DEBUG
 	data->ref = 0;
-#endif
+	data->file = file;
+	data->movable_vma = NULL;
+	data->movable_mm = NULL;
+	data->defrag_gen = 0;
 	INIT_LIST_HEAD(&data->region_list);
 	init_rwsem(&data->sem);
 
@@ -1373,6 +1690,114 @@ leave:
 	return bitnum;
 }
 
+/*
+ * Allocates 'quanta' quanta at 'start' out of the free extent 'e', which
+ * must contain them. Returns 'start', or -1 if out of memory.
+ */
+static int pmem_extent_carve(const int id, struct pmem_extent *e,
+		unsigned long start, unsigned long quanta)
+{
+	struct pmem_extent *a, *right;
+
+	/* the allocated extent, plus one more if we split a free one */
+	a = kmalloc(sizeof(*a), GFP_KERNEL);
+	right = kmalloc(sizeof(*right), GFP_KERNEL);
+	if (!a || !right) {
+		kfree(a);
+		kfree(right);
+		return -1;
+	}
+
+	pmem_extent_del_free(id, e);
+	right->start = start + quanta;
+	right->quanta = e->start + e->quanta - right->start;
+	e->quanta = start - e->start;
+
+	if (e->quanta)
+		pmem_extent_add_free(id, e);
+	else
+		kfree(e);
+	if (right->quanta)
+		pmem_extent_add_free(id, right);
+	else
+		kfree(right);
+
+	a->start = start;
+	a->quanta = quanta;
+	pmem_extent_insert_addr(&pmem[id].allocator.extent.allocated, a);
+	pmem[id].allocator.extent.nr_allocated++;
+	pmem[id].allocator.extent.free_quanta -= quanta;
+
+	return start;
+}
+
+static int pmem_allocator_extent(const int id,
+		const unsigned long len,
+		const unsigned int align)
+{
+	/* caller should hold the lock on arena_mutex! */
+	struct pmem_extent *e;
+	unsigned long quanta_needed, spacing, start;
+
+	DLOG("extent id %d, len %ld, align %u\n", id, len, align);
+
+	quanta_needed = (len + pmem[id].quantum - 1) / pmem[id].quantum;
+	if (!quanta_needed ||
+		quanta_needed > pmem[id].allocator.extent.free_quanta)
+		return -1;
+
+	/* base is quantum aligned, so align in quanta from the region base */
+	spacing = max_t(unsigned long, align / pmem[id].quantum, 1);
+
+	/*
+	 * Best fit, falling back to the smallest extent that is certain to
+	 * fit once aligned so that both lookups stay O(log n).
+	 */
+	e = pmem_extent_best_fit(id, quanta_needed);
+	if (e && spacing > 1 &&
+		ALIGN(pmem[id].base / pmem[id].quantum + e->start, spacing) +
+			quanta_needed >
+		pmem[id].base / pmem[id].quantum + e->start + e->quanta)
+		e = pmem_extent_best_fit(id, quanta_needed + spacing - 1);
+	if (!e) {
+#if PMEM_DEBUG
+		printk(KERN_ALERT "pmem: %s: no free extent of %lu quanta "
+			"aligned to %u in region %d\n", __func__,
+			quanta_needed, align, id);
+#endif
+		return -1;
+	}
+
+	start = ALIGN(pmem[id].base / pmem[id].quantum + e->start, spacing) -
+		pmem[id].base / pmem[id].quantum;
+
+	return pmem_extent_carve(id, e, start, quanta_needed);
+}
+
+/*
+ * Allocates 'quanta' quanta from the lowest free extent that starts below
+ * 'limit', for moving an allocation down. Movable allocations are only
+ * ever quantum aligned, so no alignment is needed. Returns -1 if there is
+ * no such extent.
+ */
+static int pmem_extent_alloc_below(const int id, unsigned long limit,
+		unsigned long quanta)
+{
+	/* caller should hold the lock on arena_mutex! */
+	struct rb_node *n;
+	struct pmem_extent *e;
+
+	for (n = rb_first(&pmem[id].allocator.extent.free_by_addr); n;
+			n = rb_next(n)) {
+		e = rb_entry(n, struct pmem_extent, addr_node);
+		if (e->start >= limit)
+			break;
+		if (e->quanta >= quanta)
+			return pmem_extent_carve(id, e, e->start, quanta);
+	}
+	return -1;
+}
+
 static int pmem_allocator_system(const int id,
 		const unsigned long len,
 		const unsigned int align)
@@ -1463,6 +1888,11 @@ static unsigned long pmem_start_addr_bitmap(int id, struct pmem_data *data)
 	return data->index * pmem[id].quantum + pmem[id].base;
 }
 
+static unsigned long pmem_start_addr_extent(int id, struct pmem_data *data)
+{
+	return data->index * pmem[id].quantum + pmem[id].base;
+}
+
 static unsigned long pmem_start_addr_system(int id, struct pmem_data *data)
 {
 	return (unsigned long)(((struct alloc_list *)(data->index))->aaddr);
@@ -1510,6 +1940,24 @@ static unsigned long pmem_len_bitmap(int id, struct pmem_data *data)
 	return ret;
 }
 
+static unsigned long pmem_len_extent(int id, struct pmem_data *data)
+{
+	struct pmem_extent *e;
+	unsigned long ret = 0;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	e = pmem_extent_find_allocated(id, data->index);
+	if (e)
+		ret = e->quanta * pmem[id].quantum;
+	mutex_unlock(&pmem[id].arena_mutex);
+#if PMEM_DEBUG
+	if (!e)
+		pr_alert("pmem: %s: can't find extent %d!\n", __func__,
+			data->index);
+#endif
+	return ret;
+}
+
 static unsigned long pmem_len_system(int id, struct pmem_data *data)
 {
 	unsigned long ret = 0;
@@ -1602,11 +2050,14 @@ static void pmem_vma_open(struct vm_area_struct *vma)
 		current->parent->pid, file, file_count(file));
 	/* this should never be called as we don't support copying pmem
 	 * ranges via fork */
-	down_read(&data->sem);
+	down_write(&data->sem);
 	BUG_ON(!has_allocation(file));
+	/* a second mapping (fork, split or mremap) is not tracked, so the
+	 * allocation can't be moved any more */
+	data->flags &= ~PMEM_FLAGS_MOVABLE;
 	/* remap the garbage pages, forkers don't get access to the data */
 	pmem_unmap_pfn_range(id, vma, data, 0, vma->vm_start - vma->vm_end);
-	up_read(&data->sem);
+	up_write(&data->sem);
 }
 
 static void pmem_vma_close(struct vm_area_struct *vma)
@@ -1643,6 +2094,11 @@ static void pmem_vma_close(struct vm_area_struct *vma)
 		    (data->flags & PMEM_FLAGS_SUBMAP))
 			data->flags |= PMEM_FLAGS_UNSUBMAP;
 	}
+	if (data->movable_vma == vma) {
+		data->movable_vma = NULL;
+		mmdrop(data->movable_mm);
+		data->movable_mm = NULL;
+	}
 	/* the kernel is going to free this vma now anyway */
 	up_write(&data->sem);
 }
@@ -1759,6 +2215,16 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 		}
 		data->flags |= PMEM_FLAGS_MASTERMAP;
 		data->pid = current->pid;
+		/* remember the mapping so defragmentation can move it */
+		if (data->flags & PMEM_FLAGS_MOVABLE) {
+			if (data->movable_vma) {
+				data->flags &= ~PMEM_FLAGS_MOVABLE;
+			} else {
+				data->movable_vma = vma;
+				data->movable_mm = vma->vm_mm;
+				atomic_inc(&vma->vm_mm->mm_count);
+			}
+		}
 	}
 	vma->vm_ops = &vm_ops;
 error:
@@ -1818,11 +2284,9 @@ int get_pmem_addr(struct file *file, unsigned long *start,
 			*vstart = (unsigned long)
 				pmem_start_vaddr(id, data);
 			up_read(&data->sem);
-#if PMEM_DEBUG
 			down_write(&data->sem);
 			data->ref++;
 			up_write(&data->sem);
-#endif
 			DLOG("returning start %#lx len %lu "
 				"vstart %#lx\n",
 				*start, *len, *vstart);
@@ -1882,19 +2346,19 @@ void put_pmem_file(struct file *file)
 		get_task_comm(currtask_name, current), file,
 		file_count(file), get_name(file), get_id(file));
 	if (is_pmem_file(file)) {
-#if PMEM_DEBUG
 		struct pmem_data *data = file->private_data;
 
 		down_write(&data->sem);
 		if (!data->ref--) {
 			data->ref++;
+#if PMEM_DEBUG
 			pr_alert("pmem: pmem_put > pmem_get %s "
 				"(pid %d)\n",
 			       pmem[get_id(file)].dev.name, data->pid);
 			BUG();
+#endif
 		}
 		up_write(&data->sem);
-#endif
 		fput(file);
 	}
 }
@@ -2158,6 +2622,13 @@ static int pmem_kapi_free_index_bitmap(const int32_t physaddr, int id)
 		bit_from_paddr(id, physaddr) : -1;
 }
 
+static int pmem_kapi_free_index_extent(const int32_t physaddr, int id)
+{
+	return (physaddr >= pmem[id].base &&
+		physaddr < (pmem[id].base + pmem[id].size)) ?
+		bit_from_paddr(id, physaddr) : -1;
+}
+
 static int pmem_kapi_free_index_system(const int32_t physaddr, int id)
 {
 	return 0;
@@ -2239,10 +2710,10 @@ static int pmem_connect(unsigned long connect, struct file *file)
 			goto put_src_file;
 		}
 
-		down_read(&src_data->sem);
+		down_write(&src_data->sem);
 
 		if (unlikely(!has_allocation(src_file))) {
-			up_read(&src_data->sem);
+			up_write(&src_data->sem);
 			pr_err("pmem: %s: src file has no allocation!\n",
 				__func__);
 			ret = -EINVAL;
@@ -2250,7 +2721,9 @@ static int pmem_connect(unsigned long connect, struct file *file)
 			struct pmem_data *data;
 			int src_index = src_data->index;
 
-			up_read(&src_data->sem);
+			/* connected files share the index, pin it */
+			src_data->flags &= ~PMEM_FLAGS_MOVABLE;
+			up_write(&src_data->sem);
 
 			data = file->private_data;
 			if (!data) {
@@ -2501,6 +2974,156 @@ static void pmem_revoke(struct file *file, struct pmem_data *data)
 	pmem_unlock_data_and_mm(data, mm);
 }
 
+static void pmem_flush_kernel_range(int id, void *vaddr, unsigned long len)
+{
+	if (!pmem[id].cached)
+		return;
+	dmac_flush_range(vaddr, vaddr + len);
+#ifdef CONFIG_OUTER_CACHE
+	outer_flush_range((unsigned long)vaddr -
+			(unsigned long)pmem[id].vbase + pmem[id].base,
+		(unsigned long)vaddr - (unsigned long)pmem[id].vbase +
+			pmem[id].base + len);
+#endif
+}
+
+/*
+ * Moves a movable allocation to the lowest free extent below it that fits,
+ * copying the contents and remapping its master mapping. The mapping is
+ * zapped while we copy and holding mmap_sem keeps its users waiting in the
+ * fault path until it points at the new copy. Returns 0 if moved or there
+ * is nowhere to move it, -EBUSY if it can't be moved right now.
+ */
+static int pmem_move(int id, struct file *file)
+{
+	struct pmem_data *data = file->private_data;
+	struct mm_struct *mm = NULL;
+	struct vm_area_struct *vma;
+	unsigned long len;
+	void *src, *dst;
+	int old, new, ret = 0;
+
+	down_read(&data->sem);
+	if (data->movable_mm) {
+		mm = data->movable_mm;
+		/* the task is exiting, its mapping is going away */
+		if (!atomic_inc_not_zero(&mm->mm_users)) {
+			up_read(&data->sem);
+			return -EBUSY;
+		}
+	}
+	up_read(&data->sem);
+
+	if (mm)
+		down_write(&mm->mmap_sem);
+	down_write(&data->sem);
+
+	if (!(data->flags & PMEM_FLAGS_MOVABLE) || !has_allocation(file))
+		goto out;
+	if (data->ref || data->movable_mm != mm) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	old = data->index;
+	len = pmem[id].len(id, data);
+	mutex_lock(&pmem[id].arena_mutex);
+	new = pmem_extent_alloc_below(id, old, len / pmem[id].quantum);
+	mutex_unlock(&pmem[id].arena_mutex);
+	if (new < 0)
+		goto out;
+
+	vma = data->movable_vma;
+	if (vma)
+		zap_page_range(vma, vma->vm_start, vma->vm_end - vma->vm_start,
+			       NULL);
+
+	src = pmem_start_vaddr(id, data);
+	dst = (void *)pmem[id].vbase + new * pmem[id].quantum;
+	pmem_flush_kernel_range(id, src, len);
+	memcpy(dst, src, len);
+	pmem_flush_kernel_range(id, dst, len);
+	data->index = new;
+
+	if (vma && pmem_map_pfn_range(id, vma, data, 0,
+				      vma->vm_end - vma->vm_start)) {
+		/* put it back where it was, the old copy is intact */
+		data->index = old;
+		old = new;
+		if (pmem_map_pfn_range(id, vma, data, 0,
+				       vma->vm_end - vma->vm_start))
+			pmem_map_garbage(id, vma, data, 0,
+					 vma->vm_end - vma->vm_start);
+		ret = -EBUSY;
+	}
+
+	mutex_lock(&pmem[id].arena_mutex);
+	pmem[id].free(id, old);
+	mutex_unlock(&pmem[id].arena_mutex);
+
+	if (!ret) {
+		DLOG("moved %lu bytes from %d to %d on %s\n", len, old, new,
+			pmem[id].name);
+		pmem[id].defrag_moved++;
+		pmem[id].defrag_bytes_moved += len;
+	}
+out:
+	up_write(&data->sem);
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+	return ret;
+}
+
+/*
+ * One pass over the region's files, moving each movable allocation as low
+ * as it will go. data_list_mutex is only held to pick the next file, on
+ * which we take a reference, so that moving can take the mm and data locks
+ * in the usual order.
+ */
+static void pmem_defrag(int id)
+{
+	struct pmem_data *data;
+	struct file *file;
+	unsigned int gen;
+
+	if (pmem[id].allocator_type != PMEM_ALLOCATORTYPE_EXTENT)
+		return;
+
+	mutex_lock(&pmem[id].defrag_mutex);
+	gen = ++pmem[id].defrag_gen;
+	for (;;) {
+		file = NULL;
+		mutex_lock(&pmem[id].data_list_mutex);
+		list_for_each_entry(data, &pmem[id].data_list, list) {
+			if (data->defrag_gen == gen)
+				continue;
+			data->defrag_gen = gen;
+			/* checked again under the data's sem */
+			if (!(data->flags & PMEM_FLAGS_MOVABLE))
+				continue;
+			if (atomic_long_inc_not_zero(&data->file->f_count)) {
+				file = data->file;
+				break;
+			}
+		}
+		mutex_unlock(&pmem[id].data_list_mutex);
+		if (!file)
+			break;
+		if (pmem_move(id, file))
+			pmem[id].defrag_busy++;
+		fput(file);
+	}
+	pmem[id].defrag_runs++;
+	mutex_unlock(&pmem[id].defrag_mutex);
+}
+
+static void pmem_defrag_work(struct work_struct *work)
+{
+	pmem_defrag(container_of(work, struct pmem_info, defrag_work)->id);
+}
+
 static void pmem_get_size(struct pmem_region *region, struct file *file)
 {
 	/* called via ioctl file op, so file guaranteed to be not NULL */
@@ -2542,15 +3165,17 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			struct pmem_region region;
 
 			DLOG("get_phys\n");
-			down_read(&data->sem);
+			down_write(&data->sem);
 			if (!has_allocation(file)) {
 				region.offset = 0;
 				region.len = 0;
 			} else {
+				/* user space may hand this to hardware */
+				data->flags &= ~PMEM_FLAGS_MOVABLE;
 				region.offset = pmem[id].start_addr(id, data);
 				region.len = pmem[id].len(id, data);
 			}
-			up_read(&data->sem);
+			up_write(&data->sem);
 
 			if (copy_to_user((void __user *)arg, &region,
 						sizeof(struct pmem_region)))
@@ -2625,6 +3250,7 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	}
 
 	case PMEM_ALLOCATE:
+	case PMEM_ALLOCATE_MOVABLE:
 		{
 			int ret = 0;
 			DLOG("allocate, id %d\n", id);
@@ -2643,6 +3269,12 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			mutex_unlock(&pmem[id].arena_mutex);
 			ret = data->index == -1 ? -ENOMEM :
 				data->index;
+			/* only the extent allocator can move allocations,
+			 * elsewhere this is a plain allocation */
+			if (ret >= 0 && cmd == PMEM_ALLOCATE_MOVABLE &&
+					pmem[id].allocator_type ==
+						PMEM_ALLOCATORTYPE_EXTENT)
+				data->flags |= PMEM_FLAGS_MOVABLE;
 			up_write(&data->sem);
 			return ret;
 		}
@@ -2670,9 +3302,12 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 			if (alloc.align != SZ_4K &&
 					(pmem[id].allocator_type !=
-						PMEM_ALLOCATORTYPE_BITMAP)) {
+						PMEM_ALLOCATORTYPE_BITMAP &&
+					pmem[id].allocator_type !=
+						PMEM_ALLOCATORTYPE_EXTENT)) {
 				pr_err("pmem: Non 4k alignment requires bitmap"
-					" allocator on %s\n", pmem[id].name);
+					" or extent allocator on %s\n",
+					pmem[id].name);
 				return -EINVAL;
 			}
 
@@ -3152,6 +3787,47 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 			id, pdata->name, pmem[id].size);
 		break;
 
+	case PMEM_ALLOCATORTYPE_EXTENT:
+	{
+		struct pmem_extent *e = kmalloc(sizeof(*e), GFP_KERNEL);
+
+		if (!e) {
+			pr_alert("pmem: %s: Unable to register pmem "
+				"driver %s - can't allocate extent!\n",
+				__func__, pdata->name);
+			goto err_reset_pmem_info;
+		}
+
+		pmem[id].allocator.extent.free_by_addr = RB_ROOT;
+		pmem[id].allocator.extent.free_by_size = RB_ROOT;
+		pmem[id].allocator.extent.allocated = RB_ROOT;
+		pmem[id].allocator.extent.nr_free = 0;
+		pmem[id].allocator.extent.nr_allocated = 0;
+		pmem[id].allocator.extent.free_quanta = pmem[id].num_entries;
+		e->start = 0;
+		e->quanta = pmem[id].num_entries;
+		pmem_extent_add_free(id, e);
+
+		if (kobject_init_and_add(&pmem[id].kobj,
+				&pmem_extent_ktype, NULL,
+				"%s", pdata->name))
+			goto out_put_kobj;
+
+		pmem[id].allocate = pmem_allocator_extent;
+		pmem[id].free = pmem_free_extent;
+		pmem[id].free_space = pmem_free_space_extent;
+		pmem[id].kapi_free_index = pmem_kapi_free_index_extent;
+		pmem[id].len = pmem_len_extent;
+		pmem[id].start_addr = pmem_start_addr_extent;
+		INIT_WORK(&pmem[id].defrag_work, pmem_defrag_work);
+
+		DLOG("extent allocator id %d (%s), num_entries %lu, raw size "
+			"%lu, quanta size %u\n",
+			id, pdata->name, pmem[id].num_entries,
+			pmem[id].size, pmem[id].quantum);
+		break;
+	}
+
 	default:
 		pr_alert("Invalid allocator type (%d) for pmem driver\n",
 			pdata->allocator_type);
@@ -3162,6 +3838,7 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	pmem[id].release = release;
 	mutex_init(&pmem[id].arena_mutex);
 	mutex_init(&pmem[id].data_list_mutex);
+	mutex_init(&pmem[id].defrag_mutex);
 	INIT_LIST_HEAD(&pmem[id].data_list);
 
 	pmem[id].dev.name = pdata->name;
@@ -3221,6 +3898,17 @@ out_put_kobj:
 	else if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_BITMAP) {
 		kfree(pmem[id].allocator.bitmap.bitmap);
 		kfree(pmem[id].allocator.bitmap.bitm_alloc);
+	} else if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_EXTENT) {
+		struct rb_node *n =
+			rb_first(&pmem[id].allocator.extent.free_by_addr);
+
+		if (n) {
+			struct pmem_extent *e =
+				rb_entry(n, struct pmem_extent, addr_node);
+
+			pmem_extent_del_free(id, e);
+			kfree(e);
+		}
 	}
 err_reset_pmem_info:
 	pmem[id].allocate = 0;
@@ -27,6 +27,9 @@
 #include <linux/crc16.h>
 #include <linux/bitrev.h>
 #include <linux/pm_qos_params.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 
 #include <asm/dma.h>
 #include <asm/mach/flash.h>
@@ -793,36 +796,463 @@ uint32_t flash_onfi_probe(struct msm_nand_chip *chip)
 	return err;
 }
 
+/*
+ * Data mover queue and per controller transfer counters, shown in
+ * debugfs.  busy_ns is the time during which at least one command list
+ * was outstanding.
+ */
+static struct {
+	spinlock_t lock;
+	unsigned queued;
+	unsigned max_queued;
+	ktime_t busy_start;
+	u64 busy_ns;
+	u64 lists;
+	u64 errors;
+	u64 bytes;
+	u64 codewords[2];
+} msm_nand_stats = {
+	.lock = __SPIN_LOCK_UNLOCKED(msm_nand_stats.lock),
+};
+
+/*
+ * A command list handed to the data mover without waiting for it.
+ * 'bytes' and 'codewords' (per NAND controller) are filled in by the
+ * caller for the statistics.
+ */
+struct msm_nand_dmov_req {
+	struct msm_dmov_cmd dmov_cmd;
+	struct completion complete;
+	unsigned int result;
+	unsigned bytes;
+	unsigned codewords[2];
+};
+
+static void msm_nand_dmov_complete(struct msm_dmov_cmd *cmd,
+				   unsigned int result,
+				   struct msm_dmov_errdata *err)
+{
+	struct msm_nand_dmov_req *req =
+		container_of(cmd, struct msm_nand_dmov_req, dmov_cmd);
+
+	req->result = result;
+	complete(&req->complete);
+}
+
+/* Queues the list behind the pointer at dma address 'cmdptr' */
+static void msm_nand_dmov_submit(struct msm_nand_chip *chip,
+				 struct msm_nand_dmov_req *req,
+				 dma_addr_t cmdptr)
+{
+	req->dmov_cmd.cmdptr = DMOV_CMD_PTR_LIST | DMOV_CMD_ADDR(cmdptr);
+	req->dmov_cmd.crci_mask = crci_mask;
+	req->dmov_cmd.complete_func = msm_nand_dmov_complete;
+	req->dmov_cmd.exec_func = NULL;
+	init_completion(&req->complete);
+
+	spin_lock(&msm_nand_stats.lock);
+	if (!msm_nand_stats.queued++)
+		msm_nand_stats.busy_start = ktime_get();
+	if (msm_nand_stats.queued > msm_nand_stats.max_queued)
+		msm_nand_stats.max_queued = msm_nand_stats.queued;
+	spin_unlock(&msm_nand_stats.lock);
+
+	dsb();
+	msm_dmov_enqueue_cmd(chip->dma_channel, &req->dmov_cmd);
+}
+
+/* Waits for a list queued by msm_nand_dmov_submit() */
+static int msm_nand_dmov_wait(struct msm_nand_chip *chip,
+			      struct msm_nand_dmov_req *req)
+{
+	int ok;
+
+	wait_for_completion_io(&req->complete);
+	dsb();
+	ok = (req->result == 0x80000002);
+
+	spin_lock(&msm_nand_stats.lock);
+	if (!--msm_nand_stats.queued)
+		msm_nand_stats.busy_ns += ktime_to_ns(ktime_sub(ktime_get(),
+					msm_nand_stats.busy_start));
+	msm_nand_stats.lists++;
+	if (ok) {
+		msm_nand_stats.bytes += req->bytes;
+		msm_nand_stats.codewords[0] += req->codewords[0];
+		msm_nand_stats.codewords[1] += req->codewords[1];
+	} else
+		msm_nand_stats.errors++;
+	spin_unlock(&msm_nand_stats.lock);
+
+	if (!ok) {
+		pr_err("%s: data mover error, result %x\n",
+		       __func__, req->result);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* KB/s for 'bytes' moved in 'ns' */
+static u64 msm_nand_kbps(u64 bytes, u64 ns)
+{
+	u64 us = div64_u64(ns, NSEC_PER_USEC);
+
+	return us ? div64_u64((bytes * USEC_PER_SEC) >> 10, us) : 0;
+}
+
+static int msm_nand_stats_show(struct seq_file *m, void *unused)
+{
+	int i;
+
+	spin_lock(&msm_nand_stats.lock);
+	seq_printf(m, "queued: %u (max %u)\n", msm_nand_stats.queued,
+		   msm_nand_stats.max_queued);
+	seq_printf(m, "lists: %llu, errors: %llu\n", msm_nand_stats.lists,
+		   msm_nand_stats.errors);
+	seq_printf(m, "busy: %llu us\n",
+		   div64_u64(msm_nand_stats.busy_ns, NSEC_PER_USEC));
+	seq_printf(m, "bytes: %llu (%llu KB/s)\n", msm_nand_stats.bytes,
+		   msm_nand_kbps(msm_nand_stats.bytes,
+				 msm_nand_stats.busy_ns));
+	for (i = 0; i < ARRAY_SIZE(msm_nand_stats.codewords); i++)
+		seq_printf(m, "nandc%d: %llu codewords (%llu KB/s)\n", i,
+			   msm_nand_stats.codewords[i],
+			   msm_nand_kbps(msm_nand_stats.codewords[i] * 512,
+					 msm_nand_stats.busy_ns));
+	spin_unlock(&msm_nand_stats.lock);
+
+	return 0;
+}
+
+static struct dentry *msm_nand_debugfs;
+
+static int msm_nand_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, msm_nand_stats_show, NULL);
+}
+
+static const struct file_operations msm_nand_stats_fops = {
+	.open		= msm_nand_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * msm_nand_read_oob() chains this many pages into one data mover command
+ * list and keeps two such lists queued, so that the controller goes
+ * straight on with the next pages while the CPU checks the previous ones.
+ */
+#define MSM_NAND_READ_CHAIN 2
+
+struct msm_nand_read_data {
+	uint32_t cmd;
+	uint32_t addr0;
+	uint32_t addr1;
+	uint32_t chipsel;
+	uint32_t cfg0;
+	uint32_t cfg1;
+	uint32_t exec;
+	uint32_t ecccfg;
+	struct {
+		uint32_t flash_status;
+		uint32_t buffer_status;
+	} result[8];
+};
+
+struct msm_nand_read_chain {
+	dmov_s cmd[MSM_NAND_READ_CHAIN * (8 * 5 + 2)];
+	unsigned cmdptr;
+	struct msm_nand_read_data data[MSM_NAND_READ_CHAIN];
+};
+
+/* A command list handed to the data mover */
+struct msm_nand_read_req {
+	struct msm_nand_dmov_req dmov;
+	struct msm_nand_read_chain *chain;
+	unsigned pages;
+	/* where each page's data and oob end in the caller's buffers */
+	dma_addr_t data_end[MSM_NAND_READ_CHAIN];
+	uint32_t oob_end[MSM_NAND_READ_CHAIN];
+};
+
+/*
+ * Appends the commands reading one page at 'cmd' and returns the next
+ * free command.  The data and oob addresses and the remaining oob length
+ * are advanced past what the page will transfer.
+ */
+static dmov_s *msm_nand_read_page_cmds(struct mtd_info *mtd,
+				       struct mtd_oob_ops *ops,
+				       struct msm_nand_read_data *data,
+				       dmov_s *cmd, unsigned page,
+				       uint32_t oob_col, unsigned start_sector,
+				       dma_addr_t *data_dma_addr_curr,
+				       dma_addr_t *oob_dma_addr_curr,
+				       uint32_t *oob_len)
+{
+	struct msm_nand_chip *chip = mtd->priv;
+	unsigned cwperpage = (mtd->writesize >> 9);
+	uint32_t sectordatasize;
+	uint32_t sectoroobsize;
+	unsigned n;
+
+	/* CMD / ADDR0 / ADDR1 / CHIPSEL program values */
+	if (ops->mode != MTD_OOB_RAW) {
+		data->cmd = MSM_NAND_CMD_PAGE_READ_ECC;
+		data->cfg0 = (chip->CFG0 & ~(7U << 6))
+			| (((cwperpage-1) - start_sector) << 6);
+		data->cfg1 = chip->CFG1;
+	} else {
+		data->cmd = MSM_NAND_CMD_PAGE_READ;
+		data->cfg0 = (MSM_NAND_CFG0_RAW
+				& ~(7U << 6)) | ((cwperpage-1) << 6);
+		data->cfg1 = MSM_NAND_CFG1_RAW |
+				(chip->CFG1 & CFG1_WIDE_FLASH);
+	}
+
+	data->addr0 = (page << 16) | oob_col;
+	/* qc example is (page >> 16) && 0xff !? */
+	data->addr1 = (page >> 16) & 0xff;
+	/* flash0 + undoc bit */
+	data->chipsel = 0 | 4;
+
+	/* GO bit for the EXEC register */
+	data->exec = 1;
+
+	BUILD_BUG_ON(8 != ARRAY_SIZE(data->result));
+
+	for (n = start_sector; n < cwperpage; n++) {
+		/* flash + buffer status return words */
+		data->result[n].flash_status = 0xeeeeeeee;
+		data->result[n].buffer_status = 0xeeeeeeee;
+
+		/* block on cmd ready, then
+		 * write CMD / ADDR0 / ADDR1 / CHIPSEL
+		 * regs in a burst
+		 */
+		cmd->cmd = DST_CRCI_NAND_CMD;
+		cmd->src = msm_virt_to_dma(chip, &data->cmd);
+		cmd->dst = MSM_NAND_FLASH_CMD;
+		if (n == start_sector)
+			cmd->len = 16;
+		else
+			cmd->len = 4;
+		cmd++;
+
+		if (n == start_sector) {
+			cmd->cmd = 0;
+			cmd->src = msm_virt_to_dma(chip, &data->cfg0);
+			cmd->dst = MSM_NAND_DEV0_CFG0;
+			cmd->len = 8;
+			cmd++;
+
+			data->ecccfg = chip->ecc_buf_cfg;
+			cmd->cmd = 0;
+			cmd->src = msm_virt_to_dma(chip, &data->ecccfg);
+			cmd->dst = MSM_NAND_EBI2_ECC_BUF_CFG;
+			cmd->len = 4;
+			cmd++;
+		}
+
+		/* kick the execute register */
+		cmd->cmd = 0;
+		cmd->src = msm_virt_to_dma(chip, &data->exec);
+		cmd->dst = MSM_NAND_EXEC_CMD;
+		cmd->len = 4;
+		cmd++;
+
+		/* block on data ready, then
+		 * read the status register
+		 */
+		cmd->cmd = SRC_CRCI_NAND_DATA;
+		cmd->src = MSM_NAND_FLASH_STATUS;
+		cmd->dst = msm_virt_to_dma(chip, &data->result[n]);
+		/* MSM_NAND_FLASH_STATUS + MSM_NAND_BUFFER_STATUS */
+		cmd->len = 8;
+		cmd++;
+
+		/* read data block
+		 * (only valid if status says success)
+		 */
+		if (ops->datbuf) {
+			if (ops->mode != MTD_OOB_RAW)
+				sectordatasize = (n < (cwperpage - 1))
+				? 516 : (512 - ((cwperpage - 1) << 2));
+			else
+				sectordatasize = 528;
+
+			cmd->cmd = 0;
+			cmd->src = MSM_NAND_FLASH_BUFFER;
+			cmd->dst = *data_dma_addr_curr;
+			*data_dma_addr_curr += sectordatasize;
+			cmd->len = sectordatasize;
+			cmd++;
+		}
+
+		if (ops->oobbuf && (n == (cwperpage - 1)
+		     || ops->mode != MTD_OOB_AUTO)) {
+			cmd->cmd = 0;
+			if (n == (cwperpage - 1)) {
+				cmd->src = MSM_NAND_FLASH_BUFFER +
+					(512 - ((cwperpage - 1) << 2));
+				sectoroobsize = (cwperpage << 2);
+				if (ops->mode != MTD_OOB_AUTO)
+					sectoroobsize += 10;
+			} else {
+				cmd->src = MSM_NAND_FLASH_BUFFER + 516;
+				sectoroobsize = 10;
+			}
+
+			cmd->dst = *oob_dma_addr_curr;
+			if (sectoroobsize < *oob_len)
+				cmd->len = sectoroobsize;
+			else
+				cmd->len = *oob_len;
+			*oob_dma_addr_curr += cmd->len;
+			*oob_len -= cmd->len;
+			if (cmd->len > 0)
+				cmd++;
+		}
+	}
+
+	return cmd;
+}
+
+/*
+ * Works out the result of a page read from its status words.  'datbuf'
+ * is the page's data, 'data_end' and 'oob_end' where its data and oob end
+ * in the caller's dma mapped buffers.
+ */
+static int msm_nand_read_page_status(struct mtd_info *mtd,
+				     struct mtd_oob_ops *ops,
+				     struct msm_nand_read_data *data,
+				     unsigned start_sector, uint8_t *datbuf,
+				     dma_addr_t data_end,
+				     dma_addr_t oob_dma_addr, uint32_t oob_end,
+				     uint32_t *total_ecc_errors)
+{
+	struct msm_nand_chip *chip = mtd->priv;
+	unsigned cwperpage = (mtd->writesize >> 9);
+	int pageerr, rawerr;
+	uint32_t ecc_errors;
+	unsigned n;
+
+	/* if any of the writes failed (0x10), or there
+	 * was a protection violation (0x100), we lose
+	 */
+	pageerr = rawerr = 0;
+	for (n = start_sector; n < cwperpage; n++) {
+		if (data->result[n].flash_status & 0x110) {
+			rawerr = -EIO;
+			break;
+		}
+	}
+	if (rawerr) {
+		if (ops->datbuf && ops->mode != MTD_OOB_RAW) {
+			dma_sync_single_for_cpu(chip->dev,
+				data_end - mtd->writesize,
+				mtd->writesize, DMA_BIDIRECTIONAL);
+
+			for (n = 0; n < mtd->writesize; n++) {
+				/* empty blocks read 0x54 at
+				 * these offsets
+				 */
+				if (n % 516 == 3 && datbuf[n] == 0x54)
+					datbuf[n] = 0xff;
+				if (datbuf[n] != 0xff) {
+					pageerr = rawerr;
+					break;
+				}
+			}
+
+			dma_sync_single_for_device(chip->dev,
+				data_end - mtd->writesize,
+				mtd->writesize, DMA_BIDIRECTIONAL);
+
+		}
+		if (ops->oobbuf) {
+			/* only the oob read so far, later pages
+			 * may still be on their way in
+			 */
+			dma_sync_single_for_cpu(chip->dev, oob_dma_addr,
+				oob_end, DMA_BIDIRECTIONAL);
+			for (n = 0; n < oob_end; n++) {
+				if (ops->oobbuf[n] != 0xff) {
+					pageerr = rawerr;
+					break;
+				}
+			}
+
+			dma_sync_single_for_device(chip->dev, oob_dma_addr,
+				oob_end, DMA_BIDIRECTIONAL);
+		}
+	}
+	if (pageerr) {
+		for (n = start_sector; n < cwperpage; n++) {
+			if (data->result[n].buffer_status & 0x8) {
+				/* not thread safe */
+				mtd->ecc_stats.failed++;
+				pageerr = -EBADMSG;
+				break;
+			}
+		}
+	}
+	if (!rawerr) { /* check for corretable errors */
+		for (n = start_sector; n < cwperpage; n++) {
+			ecc_errors = data->result[n].buffer_status & 0x7;
+			if (ecc_errors) {
+				*total_ecc_errors += ecc_errors;
+				/* not thread safe */
+				mtd->ecc_stats.corrected += ecc_errors;
+				if (ecc_errors > 1)
+					pageerr = -EUCLEAN;
+			}
+		}
+	}
+
+#if VERBOSE
+	if (rawerr && !pageerr) {
+		pr_err("msm_nand_read_oob %x %x empty page\n",
+		       ops->len, ops->ooblen);
+	} else {
+		pr_info("status: %x %x %x %x %x %x %x %x %x \
+				%x %x %x %x %x %x %x \n",
+			data->result[0].flash_status,
+			data->result[0].buffer_status,
+			data->result[1].flash_status,
+			data->result[1].buffer_status,
+			data->result[2].flash_status,
+			data->result[2].buffer_status,
+			data->result[3].flash_status,
+			data->result[3].buffer_status,
+			data->result[4].flash_status,
+			data->result[4].buffer_status,
+			data->result[5].flash_status,
+			data->result[5].buffer_status,
+			data->result[6].flash_status,
+			data->result[6].buffer_status,
+			data->result[7].flash_status,
+			data->result[7].buffer_status);
+	}
+#endif
+	return pageerr;
+}
+
 static int msm_nand_read_oob(struct mtd_info *mtd, loff_t from,
 			     struct mtd_oob_ops *ops)
 {
 	struct msm_nand_chip *chip = mtd->priv;
 
-	struct {
-		dmov_s cmd[8 * 5 + 2];
-		unsigned cmdptr;
-		struct {
-			uint32_t cmd;
-			uint32_t addr0;
-			uint32_t addr1;
-			uint32_t chipsel;
-			uint32_t cfg0;
-			uint32_t cfg1;
-			uint32_t exec;
-			uint32_t ecccfg;
-			struct {
-				uint32_t flash_status;
-				uint32_t buffer_status;
-			} result[8];
-		} data;
-	} *dma_buffer;
+	struct msm_nand_read_req req[2];
+	struct msm_nand_read_req *r;
+	struct msm_nand_read_chain *chain;
+	uint8_t *dma_buffer;
+	size_t chain_size;
 	dmov_s *cmd;
-	unsigned n;
 	unsigned page = 0;
 	uint32_t oob_len;
-	uint32_t sectordatasize;
-	uint32_t sectoroobsize;
-	int err, pageerr, rawerr;
+	uint32_t oob_read = 0;
+	int err, pageerr;
 	dma_addr_t data_dma_addr = 0;
 	dma_addr_t oob_dma_addr = 0;
 	dma_addr_t data_dma_addr_curr = 0;
@@ -830,10 +1260,13 @@ static int msm_nand_read_oob(struct mtd_info *mtd, loff_t from,
 	uint32_t oob_col = 0;
 	unsigned page_count;
 	unsigned pages_read = 0;
+	unsigned pages_queued = 0;
 	unsigned start_sector = 0;
-	uint32_t ecc_errors;
 	uint32_t total_ecc_errors = 0;
 	unsigned cwperpage;
+	unsigned head = 0, inflight = 0;
+	unsigned queued_bytes = 0;
+	unsigned i;
 
 	if (mtd->writesize == 2048)
 		page = from >> 11;
@@ -921,271 +1354,92 @@ static int msm_nand_read_oob(struct mtd_info *mtd, loff_t from,
 	}
 
 	pm_qos_update_requirement(PM_QOS_CPU_DMA_LATENCY, MODULE_NAME, PM_QOS_NO_ISAPC);
+	chain_size = ALIGN(sizeof(struct msm_nand_read_chain), 8);
 	wait_event(chip->wait_queue,
 		   (dma_buffer = msm_nand_get_dma_buffer(
-			    chip, sizeof(*dma_buffer))));
+			    chip, 2 * chain_size)));
+	req[0].chain = (struct msm_nand_read_chain *)dma_buffer;
+	req[1].chain = (struct msm_nand_read_chain *)(dma_buffer + chain_size);
 
 	oob_col = start_sector * 0x210;
 	if (chip->CFG1 & CFG1_WIDE_FLASH)
 		oob_col >>= 1;
 
 	err = 0;
-	while (page_count-- > 0) {
-		cmd = dma_buffer->cmd;
-
-		/* CMD / ADDR0 / ADDR1 / CHIPSEL program values */
-		if (ops->mode != MTD_OOB_RAW) {
-			dma_buffer->data.cmd = MSM_NAND_CMD_PAGE_READ_ECC;
-			dma_buffer->data.cfg0 =
-			(chip->CFG0 & ~(7U << 6))
-				| (((cwperpage-1) - start_sector) << 6);
-			dma_buffer->data.cfg1 = chip->CFG1;
-		} else {
-			dma_buffer->data.cmd = MSM_NAND_CMD_PAGE_READ;
-			dma_buffer->data.cfg0 = (MSM_NAND_CFG0_RAW
-					& ~(7U << 6)) | ((cwperpage-1) << 6);
-			dma_buffer->data.cfg1 = MSM_NAND_CFG1_RAW |
-					(chip->CFG1 & CFG1_WIDE_FLASH);
-		}
-
-		dma_buffer->data.addr0 = (page << 16) | oob_col;
-		/* qc example is (page >> 16) && 0xff !? */
-		dma_buffer->data.addr1 = (page >> 16) & 0xff;
-		/* flash0 + undoc bit */
-		dma_buffer->data.chipsel = 0 | 4;
-
-
-		/* GO bit for the EXEC register */
-		dma_buffer->data.exec = 1;
-
-
-		BUILD_BUG_ON(8 != ARRAY_SIZE(dma_buffer->data.result));
-
-		for (n = start_sector; n < cwperpage; n++) {
-			/* flash + buffer status return words */
-			dma_buffer->data.result[n].flash_status = 0xeeeeeeee;
-			dma_buffer->data.result[n].buffer_status = 0xeeeeeeee;
-
-			/* block on cmd ready, then
-			 * write CMD / ADDR0 / ADDR1 / CHIPSEL
-			 * regs in a burst
-			 */
-			cmd->cmd = DST_CRCI_NAND_CMD;
-			cmd->src = msm_virt_to_dma(chip, &dma_buffer->data.cmd);
-			cmd->dst = MSM_NAND_FLASH_CMD;
-			if (n == start_sector)
-				cmd->len = 16;
-			else
-				cmd->len = 4;
-			cmd++;
-
-			if (n == start_sector) {
-				cmd->cmd = 0;
-				cmd->src = msm_virt_to_dma(chip,
-							&dma_buffer->data.cfg0);
-				cmd->dst = MSM_NAND_DEV0_CFG0;
-				cmd->len = 8;
-				cmd++;
-
-				dma_buffer->data.ecccfg = chip->ecc_buf_cfg;
-				cmd->cmd = 0;
-				cmd->src = msm_virt_to_dma(chip,
-						&dma_buffer->data.ecccfg);
-				cmd->dst = MSM_NAND_EBI2_ECC_BUF_CFG;
-				cmd->len = 4;
-				cmd++;
+	while (pages_read < page_count) {
+		/* keep both command lists queued on the data mover */
+		while (inflight < 2 && pages_queued < page_count) {
+			r = &req[(head + inflight) % 2];
+			chain = r->chain;
+			cmd = chain->cmd;
+			for (r->pages = 0; r->pages < MSM_NAND_READ_CHAIN &&
+			     pages_queued < page_count; r->pages++) {
+				cmd = msm_nand_read_page_cmds(mtd, ops,
+					&chain->data[r->pages], cmd, page,
+					oob_col, start_sector,
+					&data_dma_addr_curr,
+					&oob_dma_addr_curr, &oob_len);
+				r->data_end[r->pages] = data_dma_addr_curr;
+				r->oob_end[r->pages] = ops->ooblen - oob_len;
+				pages_queued++;
+				page++;
 			}
 
-			/* kick the execute register */
-			cmd->cmd = 0;
-			cmd->src =
-				msm_virt_to_dma(chip, &dma_buffer->data.exec);
-			cmd->dst = MSM_NAND_EXEC_CMD;
-			cmd->len = 4;
-			cmd++;
-
-			/* block on data ready, then
-			 * read the status register
-			 */
-			cmd->cmd = SRC_CRCI_NAND_DATA;
-			cmd->src = MSM_NAND_FLASH_STATUS;
-			cmd->dst = msm_virt_to_dma(chip,
-						   &dma_buffer->data.result[n]);
-			/* MSM_NAND_FLASH_STATUS + MSM_NAND_BUFFER_STATUS */
-			cmd->len = 8;
-			cmd++;
-
-			/* read data block
-			 * (only valid if status says success)
-			 */
-			if (ops->datbuf) {
-				if (ops->mode != MTD_OOB_RAW)
-					sectordatasize = (n < (cwperpage - 1))
-					? 516 : (512 - ((cwperpage - 1) << 2));
-				else
-					sectordatasize = 528;
+			BUG_ON(cmd - chain->cmd > ARRAY_SIZE(chain->cmd));
+			chain->cmd[0].cmd |= CMD_OCB;
+			cmd[-1].cmd |= CMD_OCU | CMD_LC;
 
-				cmd->cmd = 0;
-				cmd->src = MSM_NAND_FLASH_BUFFER;
-				cmd->dst = data_dma_addr_curr;
-				data_dma_addr_curr += sectordatasize;
-				cmd->len = sectordatasize;
-				cmd++;
-			}
-
-			if (ops->oobbuf && (n == (cwperpage - 1)
-			     || ops->mode != MTD_OOB_AUTO)) {
-				cmd->cmd = 0;
-				if (n == (cwperpage - 1)) {
-					cmd->src = MSM_NAND_FLASH_BUFFER +
-						(512 - ((cwperpage - 1) << 2));
-					sectoroobsize = (cwperpage << 2);
-					if (ops->mode != MTD_OOB_AUTO)
-						sectoroobsize += 10;
-				} else {
-					cmd->src = MSM_NAND_FLASH_BUFFER + 516;
-					sectoroobsize = 10;
-				}
-
-				cmd->dst = oob_dma_addr_curr;
-				if (sectoroobsize < oob_len)
-					cmd->len = sectoroobsize;
-				else
-					cmd->len = oob_len;
-				oob_dma_addr_curr += cmd->len;
-				oob_len -= cmd->len;
-				if (cmd->len > 0)
-					cmd++;
-			}
-		}
-
-		BUILD_BUG_ON(8 * 5 + 2 != ARRAY_SIZE(dma_buffer->cmd));
-		BUG_ON(cmd - dma_buffer->cmd > ARRAY_SIZE(dma_buffer->cmd));
-		dma_buffer->cmd[0].cmd |= CMD_OCB;
-		cmd[-1].cmd |= CMD_OCU | CMD_LC;
-
-		dma_buffer->cmdptr =
-			(msm_virt_to_dma(chip, dma_buffer->cmd) >> 3)
-			| CMD_PTR_LP;
-
-		dsb();
-		msm_dmov_exec_cmd(chip->dma_channel, crci_mask,
-			DMOV_CMD_PTR_LIST | DMOV_CMD_ADDR(msm_virt_to_dma(chip,
-			&dma_buffer->cmdptr)));
-		dsb();
+			chain->cmdptr = (msm_virt_to_dma(chip, chain->cmd) >> 3)
+				| CMD_PTR_LP;
 
-		/* if any of the writes failed (0x10), or there
-		 * was a protection violation (0x100), we lose
-		 */
-		pageerr = rawerr = 0;
-		for (n = start_sector; n < cwperpage; n++) {
-			if (dma_buffer->data.result[n].flash_status & 0x110) {
-				rawerr = -EIO;
-				break;
-			}
+			r->dmov.bytes = (data_dma_addr_curr - data_dma_addr) +
+				(oob_dma_addr_curr - oob_dma_addr) -
+				queued_bytes;
+			queued_bytes += r->dmov.bytes;
+			r->dmov.codewords[0] = r->pages *
+				(cwperpage - start_sector);
+			r->dmov.codewords[1] = 0;
+			msm_nand_dmov_submit(chip, &r->dmov,
+				msm_virt_to_dma(chip, &chain->cmdptr));
+			inflight++;
 		}
-		if (rawerr) {
-			if (ops->datbuf && ops->mode != MTD_OOB_RAW) {
-				uint8_t *datbuf = ops->datbuf +
-					pages_read * mtd->writesize;
-
-				dma_sync_single_for_cpu(chip->dev,
-					data_dma_addr_curr-mtd->writesize,
-					mtd->writesize, DMA_BIDIRECTIONAL);
-
-				for (n = 0; n < mtd->writesize; n++) {
-					/* empty blocks read 0x54 at
-					 * these offsets
-					 */
-					if (n % 516 == 3 && datbuf[n] == 0x54)
-						datbuf[n] = 0xff;
-					if (datbuf[n] != 0xff) {
-						pageerr = rawerr;
-						break;
-					}
-				}
-
-				dma_sync_single_for_device(chip->dev,
-					data_dma_addr_curr-mtd->writesize,
-					mtd->writesize, DMA_BIDIRECTIONAL);
-
-			}
-			if (ops->oobbuf) {
-				dma_sync_single_for_cpu(chip->dev,
-				oob_dma_addr_curr - (ops->ooblen - oob_len),
-				ops->ooblen - oob_len, DMA_BIDIRECTIONAL);
-				for (n = 0; n < ops->ooblen; n++) {
-					if (ops->oobbuf[n] != 0xff) {
-						pageerr = rawerr;
-						break;
-					}
-				}
 
-				dma_sync_single_for_device(chip->dev,
-				oob_dma_addr_curr - (ops->ooblen - oob_len),
-				ops->ooblen - oob_len, DMA_BIDIRECTIONAL);
-			}
-		}
+		r = &req[head];
+		head ^= 1;
+		inflight--;
+		pageerr = msm_nand_dmov_wait(chip, &r->dmov);
 		if (pageerr) {
-			for (n = start_sector; n < cwperpage; n++) {
-				if (dma_buffer->data.result[n].buffer_status
-						& 0x8) {
-					/* not thread safe */
-					mtd->ecc_stats.failed++;
-					pageerr = -EBADMSG;
-					break;
-				}
-			}
-		}
-		if (!rawerr) { /* check for corretable errors */
-			for (n = start_sector; n < cwperpage; n++) {
-				ecc_errors = dma_buffer->data.
-					result[n].buffer_status & 0x7;
-				if (ecc_errors) {
-					total_ecc_errors += ecc_errors;
-					/* not thread safe */
-					mtd->ecc_stats.corrected += ecc_errors;
-					if (ecc_errors > 1)
-						pageerr = -EUCLEAN;
-				}
-			}
-		}
-		if (pageerr && (pageerr != -EUCLEAN || err == 0))
 			err = pageerr;
+			break;
+		}
 
-#if VERBOSE
-		if (rawerr && !pageerr) {
-			pr_err("msm_nand_read_oob %llx %x %x empty page\n",
-			       (loff_t)page * mtd->writesize, ops->len,
-			       ops->ooblen);
-		} else {
-			pr_info("status: %x %x %x %x %x %x %x %x %x \
-					%x %x %x %x %x %x %x \n",
-				dma_buffer->data.result[0].flash_status,
-				dma_buffer->data.result[0].buffer_status,
-				dma_buffer->data.result[1].flash_status,
-				dma_buffer->data.result[1].buffer_status,
-				dma_buffer->data.result[2].flash_status,
-				dma_buffer->data.result[2].buffer_status,
-				dma_buffer->data.result[3].flash_status,
-				dma_buffer->data.result[3].buffer_status,
-				dma_buffer->data.result[4].flash_status,
-				dma_buffer->data.result[4].buffer_status,
-				dma_buffer->data.result[5].flash_status,
-				dma_buffer->data.result[5].buffer_status,
-				dma_buffer->data.result[6].flash_status,
-				dma_buffer->data.result[6].buffer_status,
-				dma_buffer->data.result[7].flash_status,
-				dma_buffer->data.result[7].buffer_status);
+		for (i = 0; i < r->pages; i++) {
+			pageerr = msm_nand_read_page_status(mtd, ops,
+					&r->chain->data[i], start_sector,
+					ops->datbuf + pages_read *
+					mtd->writesize, r->data_end[i],
+					oob_dma_addr, r->oob_end[i],
+					&total_ecc_errors);
+			if (pageerr && (pageerr != -EUCLEAN || err == 0))
+				err = pageerr;
+			oob_read = r->oob_end[i];
+
+			if (err && err != -EUCLEAN && err != -EBADMSG)
+				break;
+			pages_read++;
 		}
-#endif
 		if (err && err != -EUCLEAN && err != -EBADMSG)
 			break;
-		pages_read++;
-		page++;
 	}
+
+	/* the buffers can't go away under a list still being executed */
+	while (inflight--) {
+		msm_nand_dmov_wait(chip, &req[head].dmov);
+		head ^= 1;
+	}
+
 	pm_qos_update_requirement(PM_QOS_CPU_DMA_LATENCY, MODULE_NAME, PM_QOS_DEFAULT_VALUE);
-	msm_nand_release_dma_buffer(chip, dma_buffer, sizeof(*dma_buffer));
+	msm_nand_release_dma_buffer(chip, dma_buffer, 2 * chain_size);
 
 	if (ops->oobbuf) {
 		dma_unmap_page(chip->dev, oob_dma_addr,
@@ -1202,7 +1456,7 @@ err_dma_map_oobbuf_failed:
 	else
 		ops->retlen = (mtd->writesize +  mtd->oobsize) *
 							pages_read;
-	ops->oobretlen = ops->ooblen - oob_len;
+	ops->oobretlen = oob_read;
 	if (err)
 		pr_err("msm_nand_read_oob %llx %x %x failed %d, corrected %d\n",
 		       from, ops->datbuf ? ops->len : 0, ops->ooblen, err,
@@ -1245,7 +1499,9 @@ static int msm_nand_read_oob_dualnandc(struct mtd_info *mtd, loff_t from,
 				uint32_t buffer_status;
 			} result[16];
 		} data;
-	} *dma_buffer;
+	} *dma_buffer, *bufs[2];
+	size_t buf_size;
+	struct msm_nand_dmov_req req[2];
 	dmov_s *cmd;
 	unsigned n;
 	unsigned page = 0;
@@ -1260,6 +1516,11 @@ static int msm_nand_read_oob_dualnandc(struct mtd_info *mtd, loff_t from,
 	uint32_t oob_col = 0;
 	unsigned page_count;
 	unsigned pages_read = 0;
+	unsigned pages_queued = 0, inflight = 0, slot;
+	dma_addr_t data_end[2];
+	uint32_t oob_end[2];
+	uint32_t oob_read = 0;
+	unsigned queued_bytes = 0;
 	unsigned start_sector = 0;
 	uint32_t ecc_errors;
 	uint32_t total_ecc_errors = 0;
@@ -1347,16 +1608,23 @@ static int msm_nand_read_oob_dualnandc(struct mtd_info *mtd, loff_t from,
 	}
 
 	pm_qos_update_requirement(PM_QOS_CPU_DMA_LATENCY, MODULE_NAME, PM_QOS_NO_ISAPC);
+	/* two lists, so that the next page is queued behind the current */
+	buf_size = ALIGN(sizeof(*dma_buffer), 8);
 	wait_event(chip->wait_queue,
-		   (dma_buffer = msm_nand_get_dma_buffer(
-			    chip, sizeof(*dma_buffer))));
+		   (bufs[0] = msm_nand_get_dma_buffer(chip, 2 * buf_size)));
+	bufs[1] = (void *)((uint8_t *)bufs[0] + buf_size);
 
 	oob_col = start_sector * 0x210;
 	if (chip->CFG1 & CFG1_WIDE_FLASH)
 		oob_col >>= 1;
 
 	err = 0;
-	while (page_count-- > 0) {
+	while (pages_read < page_count) {
+		if (pages_queued == page_count)
+			goto wait_page;
+
+		slot = pages_queued & 1;
+		dma_buffer = bufs[slot];
 		cmd = dma_buffer->cmd;
 
 		if (ops->mode != MTD_OOB_RAW) {
@@ -1840,11 +2108,33 @@ static int msm_nand_read_oob_dualnandc(struct mtd_info *mtd, loff_t from,
 			(msm_virt_to_dma(chip, dma_buffer->cmd) >> 3)
 			| CMD_PTR_LP;
 
-		dsb();
-		msm_dmov_exec_cmd(chip->dma_channel, crci_mask,
-			DMOV_CMD_PTR_LIST | DMOV_CMD_ADDR(msm_virt_to_dma(chip,
-			&dma_buffer->cmdptr)));
-		dsb();
+		/* even codewords go through NC01, odd ones through NC10 */
+		req[slot].bytes = (data_dma_addr_curr - data_dma_addr) +
+			(oob_dma_addr_curr - oob_dma_addr) - queued_bytes;
+		queued_bytes += req[slot].bytes;
+		req[slot].codewords[0] = (cwperpage - start_sector +
+					  !(start_sector & 1)) / 2;
+		req[slot].codewords[1] = cwperpage - start_sector -
+					 req[slot].codewords[0];
+		msm_nand_dmov_submit(chip, &req[slot], msm_virt_to_dma(chip,
+				     &dma_buffer->cmdptr));
+		data_end[slot] = data_dma_addr_curr;
+		oob_end[slot] = ops->ooblen - oob_len;
+		pages_queued++;
+		page++;
+		inflight++;
+
+		if (inflight < 2 && pages_queued < page_count)
+			continue;
+wait_page:
+		slot = pages_read & 1;
+		dma_buffer = bufs[slot];
+		inflight--;
+		pageerr = msm_nand_dmov_wait(chip, &req[slot]);
+		if (pageerr) {
+			err = pageerr;
+			break;
+		}
 
 		/* if any of the writes failed (0x10), or there
 		 * was a protection violation (0x100), we lose
@@ -1862,7 +2152,7 @@ static int msm_nand_read_oob_dualnandc(struct mtd_info *mtd, loff_t from,
 					pages_read * mtd->writesize;
 
 				dma_sync_single_for_cpu(chip->dev,
-					data_dma_addr_curr-mtd->writesize,
+					data_end[slot] - mtd->writesize,
 					mtd->writesize, DMA_BIDIRECTIONAL);
 
 				for (n = 0; n < mtd->writesize; n++) {
@@ -1878,15 +2168,15 @@ static int msm_nand_read_oob_dualnandc(struct mtd_info *mtd, loff_t from,
 				}
 
 				dma_sync_single_for_device(chip->dev,
-					data_dma_addr_curr-mtd->writesize,
+					data_end[slot] - mtd->writesize,
 					mtd->writesize, DMA_BIDIRECTIONAL);
 
 			}
 			if (ops->oobbuf) {
 				dma_sync_single_for_cpu(chip->dev,
-				oob_dma_addr_curr - (ops->ooblen - oob_len),
-				ops->ooblen - oob_len, DMA_BIDIRECTIONAL);
-				for (n = 0; n < ops->ooblen; n++) {
+				oob_dma_addr, oob_end[slot],
+				DMA_BIDIRECTIONAL);
+				for (n = 0; n < oob_end[slot]; n++) {
 					if (ops->oobbuf[n] != 0xff) {
 						pageerr = rawerr;
 						break;
@@ -1894,8 +2184,8 @@ static int msm_nand_read_oob_dualnandc(struct mtd_info *mtd, loff_t from,
 				}
 
 				dma_sync_single_for_device(chip->dev,
-				oob_dma_addr_curr - (ops->ooblen - oob_len),
-				ops->ooblen - oob_len, DMA_BIDIRECTIONAL);
+				oob_dma_addr, oob_end[slot],
+				DMA_BIDIRECTIONAL);
 			}
 		}
 		if (pageerr) {
@@ -1925,12 +2215,14 @@ static int msm_nand_read_oob_dualnandc(struct mtd_info *mtd, loff_t from,
 		}
 		if (pageerr && (pageerr != -EUCLEAN || err == 0))
 			err = pageerr;
+		oob_read = oob_end[slot];
 
 #if VERBOSE
 		if (rawerr && !pageerr) {
 			pr_err("msm_nand_read_oob_dualnandc "
 				"%llx %x %x empty page\n",
-			       (loff_t)page * mtd->writesize, ops->len,
+			       from + (loff_t)pages_read * mtd->writesize,
+			       ops->len,
 			       ops->ooblen);
 		} else if (!interleave_enable) {
 			pr_info("status: %x %x %x %x %x %x %x %x %x \
@@ -1994,11 +2286,14 @@ static int msm_nand_read_oob_dualnandc(struct mtd_info *mtd, loff_t from,
 		if (err && err != -EUCLEAN && err != -EBADMSG)
 			break;
 		pages_read++;
-		page++;
 	}
 
+	/* the buffers can't go away under a list still being executed */
+	for (; inflight; inflight--)
+		msm_nand_dmov_wait(chip, &req[(pages_queued - inflight) & 1]);
+
 	pm_qos_update_requirement(PM_QOS_CPU_DMA_LATENCY, MODULE_NAME, PM_QOS_DEFAULT_VALUE);
-	msm_nand_release_dma_buffer(chip, dma_buffer, sizeof(*dma_buffer));
+	msm_nand_release_dma_buffer(chip, bufs[0], 2 * buf_size);
 
 	if (ops->oobbuf) {
 		dma_unmap_page(chip->dev, oob_dma_addr,
@@ -2015,7 +2310,7 @@ err_dma_map_oobbuf_failed:
 	else
 		ops->retlen = (mtd->writesize +  mtd->oobsize) *
 							pages_read;
-	ops->oobretlen = ops->ooblen - oob_len;
+	ops->oobretlen = oob_read;
 	if (err)
 		pr_err("msm_nand_read_oob_dualnandc "
 			"%llx %x %x failed %d, corrected %d\n",
@@ -2402,7 +2697,9 @@ msm_nand_write_oob_dualnandc(struct mtd_info *mtd, loff_t to,
 			uint32_t clrfstatus;
 			uint32_t clrrstatus;
 		} data;
-	} *dma_buffer;
+	} *dma_buffer, *bufs[2];
+	size_t buf_size;
+	struct msm_nand_dmov_req req[2];
 	dmov_s *cmd;
 	unsigned n;
 	unsigned page = 0;
@@ -2415,6 +2712,10 @@ msm_nand_write_oob_dualnandc(struct mtd_info *mtd, loff_t to,
 	dma_addr_t oob_dma_addr_curr = 0;
 	unsigned page_count;
 	unsigned pages_written = 0;
+	unsigned pages_queued = 0, inflight = 0, slot;
+	uint32_t oob_end[2];
+	uint32_t oob_written = 0;
+	unsigned queued_bytes = 0;
 	unsigned cwperpage;
 
 	if (mtd->writesize == 2048)
@@ -2499,24 +2800,35 @@ msm_nand_write_oob_dualnandc(struct mtd_info *mtd, loff_t to,
 		page_count = ops->len / (mtd->writesize + mtd->oobsize);
 
 	pm_qos_update_requirement(PM_QOS_CPU_DMA_LATENCY, MODULE_NAME, PM_QOS_NO_ISAPC);
-	wait_event(chip->wait_queue, (dma_buffer =
-			msm_nand_get_dma_buffer(chip, sizeof(*dma_buffer))));
+	/* two lists, so that the next page is queued behind the current */
+	buf_size = ALIGN(sizeof(*dma_buffer), 8);
+	wait_event(chip->wait_queue,
+		   (bufs[0] = msm_nand_get_dma_buffer(chip, 2 * buf_size)));
+	bufs[1] = (void *)((uint8_t *)bufs[0] + buf_size);
 
-	dma_buffer->data.ebi2_chip_select_cfg0 = 0x00000805;
-	dma_buffer->data.adm_mux_data_ack_req_nc01 = 0x00000A3C;
-	dma_buffer->data.adm_mux_cmd_ack_req_nc01  = 0x0000053C;
-	dma_buffer->data.adm_mux_data_ack_req_nc10 = 0x00000F28;
-	dma_buffer->data.adm_mux_cmd_ack_req_nc10  = 0x00000F14;
-	dma_buffer->data.adm_default_mux = 0x00000FC0;
-	dma_buffer->data.default_ebi2_chip_select_cfg0 = 0x00000801;
-	dma_buffer->data.nc01_flash_dev_cmd_vld = 0x9;
-	dma_buffer->data.nc10_flash_dev_cmd0 = 0x1085D060;
-	dma_buffer->data.nc01_flash_dev_cmd_vld_default = 0x1D;
-	dma_buffer->data.nc10_flash_dev_cmd0_default = 0x1080D060;
-	dma_buffer->data.clrfstatus = 0x00000020;
-	dma_buffer->data.clrrstatus = 0x000000C0;
+	for (slot = 0; slot < 2; slot++) {
+		dma_buffer = bufs[slot];
+		dma_buffer->data.ebi2_chip_select_cfg0 = 0x00000805;
+		dma_buffer->data.adm_mux_data_ack_req_nc01 = 0x00000A3C;
+		dma_buffer->data.adm_mux_cmd_ack_req_nc01  = 0x0000053C;
+		dma_buffer->data.adm_mux_data_ack_req_nc10 = 0x00000F28;
+		dma_buffer->data.adm_mux_cmd_ack_req_nc10  = 0x00000F14;
+		dma_buffer->data.adm_default_mux = 0x00000FC0;
+		dma_buffer->data.default_ebi2_chip_select_cfg0 = 0x00000801;
+		dma_buffer->data.nc01_flash_dev_cmd_vld = 0x9;
+		dma_buffer->data.nc10_flash_dev_cmd0 = 0x1085D060;
+		dma_buffer->data.nc01_flash_dev_cmd_vld_default = 0x1D;
+		dma_buffer->data.nc10_flash_dev_cmd0_default = 0x1080D060;
+		dma_buffer->data.clrfstatus = 0x00000020;
+		dma_buffer->data.clrrstatus = 0x000000C0;
+	}
 
-	while (page_count-- > 0) {
+	while (pages_written < page_count) {
+		if (pages_queued == page_count)
+			goto wait_page;
+
+		slot = pages_queued & 1;
+		dma_buffer = bufs[slot];
 		cmd = dma_buffer->cmd;
 
 		if (ops->mode != MTD_OOB_RAW) {
@@ -2897,11 +3209,29 @@ msm_nand_write_oob_dualnandc(struct mtd_info *mtd, loff_t to,
 		dma_buffer->cmdptr =
 		((msm_virt_to_dma(chip, dma_buffer->cmd) >> 3) | CMD_PTR_LP);
 
-		dsb();
-		msm_dmov_exec_cmd(chip->dma_channel, crci_mask,
-			DMOV_CMD_PTR_LIST | DMOV_CMD_ADDR(
-				msm_virt_to_dma(chip, &dma_buffer->cmdptr)));
-		dsb();
+		/* codewords alternate between NC01 and NC10 */
+		req[slot].bytes = (data_dma_addr_curr - data_dma_addr) +
+			(oob_dma_addr_curr - oob_dma_addr) - queued_bytes;
+		queued_bytes += req[slot].bytes;
+		req[slot].codewords[0] = cwperpage / 2;
+		req[slot].codewords[1] = cwperpage - cwperpage / 2;
+		msm_nand_dmov_submit(chip, &req[slot], msm_virt_to_dma(chip,
+				     &dma_buffer->cmdptr));
+		oob_end[slot] = ops->ooblen - oob_len;
+		pages_queued++;
+		page++;
+		inflight++;
+
+		if (inflight < 2 && pages_queued < page_count)
+			continue;
+wait_page:
+		slot = pages_written & 1;
+		dma_buffer = bufs[slot];
+		inflight--;
+		err = msm_nand_dmov_wait(chip, &req[slot]);
+		if (err)
+			break;
+		oob_written = oob_end[slot];
 
 		/* if any of the writes failed (0x10), or there was a
 		 * protection violation (0x100), or the program success
@@ -2960,17 +3290,21 @@ msm_nand_write_oob_dualnandc(struct mtd_info *mtd, loff_t to,
 		if (err)
 			break;
 		pages_written++;
-		page++;
 	}
+
+	/* the buffers can't go away under a list still being executed */
+	for (; inflight; inflight--)
+		msm_nand_dmov_wait(chip, &req[(pages_queued - inflight) & 1]);
+
 	if (ops->mode != MTD_OOB_RAW)
 		ops->retlen = mtd->writesize * pages_written;
 	else
 		ops->retlen = (mtd->writesize + mtd->oobsize) * pages_written;
 
-	ops->oobretlen = ops->ooblen - oob_len;
+	ops->oobretlen = oob_written;
 
 	pm_qos_update_requirement(PM_QOS_CPU_DMA_LATENCY, MODULE_NAME, PM_QOS_DEFAULT_VALUE);
-	msm_nand_release_dma_buffer(chip, dma_buffer, sizeof(*dma_buffer));
+	msm_nand_release_dma_buffer(chip, bufs[0], 2 * buf_size);
 
 	if (ops->oobbuf)
 		dma_unmap_page(chip->dev, oob_dma_addr,
@@ -7032,6 +7366,11 @@ no_dual_nand_ctlr_support:
 	setup_mtd_device(pdev, info);
 	dev_set_drvdata(&pdev->dev, info);
 
+	msm_nand_debugfs = debugfs_create_dir(MODULE_NAME, NULL);
+	if (msm_nand_debugfs)
+		debugfs_create_file("stats", S_IRUGO, msm_nand_debugfs, NULL,
+				    &msm_nand_stats_fops);
+
 	return 0;
 
 out_free_dma_buffer:
@@ -7049,6 +7388,7 @@ static int __devexit msm_nand_remove(struct platform_device *pdev)
 	struct msm_nand_info *info = dev_get_drvdata(&pdev->dev);
 
 	dev_set_drvdata(&pdev->dev, NULL);
+	debugfs_remove_recursive(msm_nand_debugfs);
 
 	if (info) {
 #ifdef CONFIG_MTD_PARTITIONS
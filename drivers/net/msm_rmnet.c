@@ -47,6 +47,10 @@
 
 #define HEADROOM_FOR_QOS    8
 
+/* Interrupt the modem about freed rx space at most this often */
+#define RMNET_RX_COALESCE_PKTS	16
+#define RMNET_RX_COALESCE_BYTES	8192
+
 static const char *ch_name[8] = {
 	"DATA5",
 	"DATA6",
@@ -86,6 +90,12 @@ static uint msm_rmnet_modem_wait;
 module_param_named(modem_wait, msm_rmnet_modem_wait,
 		   uint, S_IRUGO | S_IWUSR | S_IWGRP);
 
+/* Packets per poll when receiving in polled mode; 0 takes an interrupt
+ * for every modem notification instead. Applies from the next open. */
+static int msm_rmnet_poll_weight = 64;
+module_param_named(poll_weight, msm_rmnet_poll_weight,
+		   int, S_IRUGO | S_IWUSR | S_IWGRP);
+
 /* Forward declaration */
 static int rmnet_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd);
 
@@ -237,18 +247,18 @@ static __be16 rmnet_ip_type_trans(struct sk_buff *skb, struct net_device *dev)
 	return protocol;
 }
 
-/* Called in soft-irq context */
-static void smd_net_data_handler(unsigned long arg)
+/* Called in soft-irq context, returns the number of packets taken */
+static int smd_net_rx(struct net_device *dev, int budget)
 {
-	struct net_device *dev = (struct net_device *) arg;
 	struct rmnet_private *p = netdev_priv(dev);
 	struct sk_buff *skb;
 	void *ptr = 0;
 	int sz;
 	u32 opmode = p->operation_mode;
 	unsigned long flags;
+	int work;
 
-	for (;;) {
+	for (work = 0; work < budget; work++) {
 		sz = smd_cur_packet_size(p->ch);
 		if (sz == 0) break;
 		if (smd_read_avail(p->ch) < sz) break;
@@ -304,6 +314,15 @@ static void smd_net_data_handler(unsigned long arg)
 		if (smd_read(p->ch, ptr, sz) != sz)
 			pr_err("rmnet_recv() smd lied about avail?!");
 	}
+
+	/* tell the modem about the space freed by this batch */
+	smd_read_flush(p->ch);
+	return work;
+}
+
+static void smd_net_data_handler(unsigned long arg)
+{
+	smd_net_rx((struct net_device *) arg, INT_MAX);
 }
 
 static DECLARE_TASKLET(smd_net_data_tasklet, smd_net_data_handler, 0);
@@ -424,6 +443,26 @@ static void smd_net_notify(void *_dev, unsigned event)
 	}
 }
 
+/* Polled receive, see msm_rmnet_poll_weight */
+static int smd_net_poll(void *_dev, int budget)
+{
+	struct net_device *dev = _dev;
+	struct rmnet_private *p = netdev_priv(dev);
+	unsigned long flags;
+	int work;
+
+	spin_lock_irqsave(&p->lock, flags);
+	if (p->skb && (smd_write_avail(p->ch) >= p->skb->len))
+		tasklet_hi_schedule(&p->tsklt);
+	spin_unlock_irqrestore(&p->lock, flags);
+
+	work = smd_net_rx(dev, budget);
+	if (work < budget)
+		smd_poll_complete(p->ch);
+
+	return work;
+}
+
 static int __rmnet_open(struct net_device *dev)
 {
 	int r;
@@ -446,6 +485,11 @@ static int __rmnet_open(struct net_device *dev)
 
 		if (r < 0)
 			return -ENODEV;
+		smd_set_coalesce(p->ch, 0, 0, RMNET_RX_COALESCE_PKTS,
+				 RMNET_RX_COALESCE_BYTES);
+		if (msm_rmnet_poll_weight > 0)
+			smd_poll_enable(p->ch, smd_net_poll,
+					msm_rmnet_poll_weight);
 	}
 
 	return 0;
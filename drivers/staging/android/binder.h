@@ -32,11 +32,23 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
+/*
+ * The low byte of the flags of a BINDER_TYPE_BINDER object is the minimum
+ * priority calls into the node are handled at: a nice value for
+ * SCHED_NORMAL and SCHED_BATCH, an rt priority for SCHED_FIFO and
+ * SCHED_RR. FLAT_BINDER_FLAG_INHERIT_RT lets a real-time caller hand its
+ * own policy and priority to the thread handling a synchronous call.
+ */
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT = 9,
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK =
+		3U << FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT,
+	FLAT_BINDER_FLAG_INHERIT_RT = 0x800,
 };
 
 /*
@@ -61,6 +73,28 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+/*
+ * A BINDER_TYPE_PTR object describes a buffer in the sender's address
+ * space. The driver copies it straight into the extra buffer space of
+ * the transaction (see BC_TRANSACTION_SG) and rewrites 'buffer' to point
+ * at the copy in the receiver, so large payloads need not be flattened
+ * into the parcel first. With BINDER_BUFFER_FLAG_HAS_PARENT set, the
+ * pointer at 'parent_offset' in the buffer of the object at index
+ * 'parent' of the offsets array is rewritten to the copy as well.
+ */
+enum {
+	BINDER_BUFFER_FLAG_HAS_PARENT = 0x01,
+};
+
+struct binder_buffer_object {
+	unsigned long		type;
+	unsigned long		flags;
+	void			*buffer;
+	size_t			length;
+	size_t			parent;
+	size_t			parent_offset;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -147,6 +181,12 @@ struct binder_transaction_data {
 	} data;
 };
 
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	/* space for BINDER_TYPE_PTR buffers, each aligned to a pointer */
+	size_t		buffers_size;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +364,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with room for the
+	 * BINDER_TYPE_PTR buffers it refers to.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
@@ -25,16 +25,39 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * struct logger_ring - one CPU's share of a log in per-cpu mode
+ *
+ * Only tasks running on the owning CPU write to a ring, and they do so with
+ * preemption disabled, so writers need no lock. 'head' and 'tail' count the
+ * bytes ever written and are only reduced modulo the ring size to index the
+ * buffer; the entries between them are valid. A writer moves 'tail' past
+ * the entries it is about to overwrite before it writes, so a reader that
+ * finds 'tail' beyond an entry it just copied knows the copy may be torn.
+ */
+struct logger_ring {
+	unsigned char		*buffer;
+	unsigned long		head;	/* end of the newest entry */
+	unsigned long		tail;	/* start of the oldest entry */
+	unsigned long		start;	/* new readers start here */
+	struct logger_mmap_ring	*ctl;	/* this ring in the control page */
+};
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * mutex 'mutex', except in per-cpu mode where writers only touch their own
+ * ring and the mutex only serializes readers.
  */
 struct logger_log {
 	unsigned char		*buffer;/* the ring buffer itself */
@@ -45,6 +68,9 @@ struct logger_log {
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_ring	*rings;	/* per-cpu mode: one ring per cpu */
+	size_t			ring_size; /* size of each ring */
+	struct logger_mmap_ctl	*ctl;	/* control page for mmap readers */
 };
 
 /*
@@ -59,8 +85,23 @@ struct logger_reader {
 	size_t			r_off;	/* current read head offset */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
+	unsigned long		*r_pos;	/* per-cpu mode: offset in each ring */
+	struct logger_entry	*scratch; /* per-cpu mode: entry being read */
+	bool			mapped;	/* reader has mmapped the log */
+	__u32			polled;	/* heads seen by the last poll */
 };
 
+/* writers log into per-cpu rings instead of one buffer under log->mutex */
+static bool logger_percpu;
+module_param_named(percpu, logger_percpu, bool, S_IRUGO);
+
+/* the largest entry a log must be able to hold */
+#define LOGGER_ENTRY_MAX_LEN \
+	(sizeof(struct logger_entry) + LOGGER_ENTRY_MAX_PAYLOAD)
+
+/* payloads up to this size are copied in on the writer's stack */
+#define LOGGER_STACK_PAYLOAD	256
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 size_t logger_offset(struct logger_log *log, size_t n)
 {
@@ -251,6 +292,10 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
  */
+static ssize_t logger_read_percpu(struct logger_reader *reader,
+				  char __user *buf, size_t count);
+static bool logger_percpu_empty(struct logger_reader *reader);
+
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
 {
@@ -265,7 +310,10 @@ start:
 
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
+		if (log->rings)
+			ret = logger_percpu_empty(reader);
+		else
+			ret = (log->w_off == reader->r_off);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -289,6 +337,14 @@ start:
 
 	mutex_lock(&log->mutex);
 
+	if (log->rings) {
+		ret = logger_read_percpu(reader, buf, count);
+		mutex_unlock(&log->mutex);
+		if (!ret)
+			goto start;
+		return ret;
+	}
+
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
@@ -438,6 +494,339 @@ static ssize_t do_write_log_from_user(struct logger_log *log,
 	return count;
 }
 
+/*
+ * logger_ctl_drop - tells mmap readers that the oldest 'dropped' entries of
+ * a ring are gone and it now starts at 'tail'. Returns with the update
+ * ordered before any following overwrite of the dropped entries.
+ */
+static void logger_ctl_drop(struct logger_mmap_ring *ctl, __u32 tail,
+			    unsigned int dropped)
+{
+	ctl->seq++;
+	smp_wmb();
+	ctl->tail = tail;
+	ctl->dropped += dropped;
+	smp_wmb();
+	ctl->seq++;
+}
+
+/*
+ * logger_ctl_append - tells mmap readers that an entry of 'len' bytes was
+ * appended to a ring
+ */
+static void logger_ctl_append(struct logger_mmap_ring *ctl, size_t len)
+{
+	/* the entry must be visible before the new head */
+	smp_wmb();
+	ctl->head += len;
+	ctl->written++;
+}
+
+/*
+ * logger_ctl_reserve - in the default mode, drops the oldest entries from
+ * the view of mmap readers until 'len' more bytes fit in the log. Like the
+ * buffer itself, the view is never completely full.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void logger_ctl_reserve(struct logger_log *log, size_t len)
+{
+	struct logger_mmap_ring *ctl = &log->ctl->ring[0];
+	__u32 tail = ctl->tail;
+	unsigned int dropped = 0;
+
+	while ((__u32)(ctl->head + len - tail) >= log->size) {
+		tail += sizeof(struct logger_entry) +
+			get_entry_msg_len(log, logger_offset(log, tail));
+		dropped++;
+	}
+	if (dropped)
+		logger_ctl_drop(ctl, tail, dropped);
+}
+
+/*
+ * logger_ring_copy_in - copies 'count' bytes from 'buf' into 'ring' at
+ * position 'pos', wrapping around the end of the ring
+ */
+static void logger_ring_copy_in(struct logger_log *log,
+				struct logger_ring *ring, unsigned long pos,
+				const void *buf, size_t count)
+{
+	size_t off = pos & (log->ring_size - 1);
+	size_t len = min(count, log->ring_size - off);
+
+	memcpy(ring->buffer + off, buf, len);
+	if (count != len)
+		memcpy(ring->buffer, buf + len, count - len);
+}
+
+/*
+ * logger_ring_copy_out - copies 'count' bytes at position 'pos' in 'ring'
+ * into 'buf', wrapping around the end of the ring
+ */
+static void logger_ring_copy_out(struct logger_log *log,
+				 struct logger_ring *ring, unsigned long pos,
+				 void *buf, size_t count)
+{
+	size_t off = pos & (log->ring_size - 1);
+	size_t len = min(count, log->ring_size - off);
+
+	memcpy(buf, ring->buffer + off, len);
+	if (count != len)
+		memcpy(buf + len, ring->buffer, count - len);
+}
+
+/* Is position 'a' in a ring before position 'b'? */
+static inline bool logger_ring_before(unsigned long a, unsigned long b)
+{
+	return (long)(a - b) < 0;
+}
+
+/*
+ * logger_ring_write - appends 'header' and its payload to the ring of the
+ * current CPU, dropping the oldest entries to make room.
+ *
+ * The caller must have preemption disabled.
+ */
+static void logger_ring_write(struct logger_log *log, struct logger_ring *ring,
+			      struct logger_entry *header, const void *payload)
+{
+	size_t len = sizeof(struct logger_entry) + header->len;
+	unsigned long tail = ring->tail;
+	unsigned int dropped = 0;
+
+	while (ring->head + len - tail > log->ring_size) {
+		struct logger_entry old;
+
+		logger_ring_copy_out(log, ring, tail, &old, sizeof(old));
+		tail += sizeof(struct logger_entry) + old.len;
+		dropped++;
+	}
+	if (dropped) {
+		/* readers must see the new tail before the data changes */
+		ring->tail = tail;
+		logger_ctl_drop(ring->ctl, tail, dropped);
+	}
+
+	logger_ring_copy_in(log, ring, ring->head, header,
+			    sizeof(struct logger_entry));
+	logger_ring_copy_in(log, ring, ring->head + sizeof(struct logger_entry),
+			    payload, header->len);
+
+	/* and the data before the new head */
+	smp_wmb();
+	ring->head += len;
+	logger_ctl_append(ring->ctl, len);
+}
+
+/*
+ * logger_write_percpu - the write path in per-cpu mode
+ *
+ * The payload is copied in from userspace first, where faults may sleep;
+ * the entry is then stamped and appended to this CPU's ring without taking
+ * any lock.
+ */
+static ssize_t logger_write_percpu(struct logger_log *log,
+				   struct logger_entry *header,
+				   const struct iovec *iov,
+				   unsigned long nr_segs)
+{
+	unsigned char stack_payload[LOGGER_STACK_PAYLOAD];
+	unsigned char *payload = stack_payload;
+	struct timespec now;
+	size_t copied = 0;
+	ssize_t ret;
+	int cpu;
+
+	if (header->len > sizeof(stack_payload)) {
+		payload = kmalloc(header->len, GFP_KERNEL);
+		if (!payload)
+			return -ENOMEM;
+	}
+
+	while (nr_segs-- > 0 && copied < header->len) {
+		size_t len = min_t(size_t, iov->iov_len, header->len - copied);
+
+		if (copy_from_user(payload + copied, iov->iov_base, len)) {
+			ret = -EFAULT;
+			goto out;
+		}
+		copied += len;
+		iov++;
+	}
+	header->len = copied;
+
+	cpu = get_cpu();
+	/* stamp here so that each ring is in timestamp order */
+	getnstimeofday(&now);
+	header->sec = now.tv_sec;
+	header->nsec = now.tv_nsec;
+	logger_ring_write(log, per_cpu_ptr(log->rings, cpu), header, payload);
+	put_cpu();
+
+	wake_up_interruptible(&log->wq);
+	ret = copied;
+out:
+	if (payload != stack_payload)
+		kfree(payload);
+	return ret;
+}
+
+/*
+ * logger_ring_next - copies the header of the next entry in 'cpu's ring
+ * that 'reader' may read into 'entry'. Entries that are not the reader's
+ * to see are skipped. Returns false if there is none.
+ *
+ * Caller must hold log->mutex.
+ */
+static bool logger_ring_next(struct logger_reader *reader, int cpu,
+			     struct logger_entry *entry)
+{
+	struct logger_log *log = reader->log;
+	struct logger_ring *ring = per_cpu_ptr(log->rings, cpu);
+	uid_t euid = current_euid();
+	unsigned long head, tail, pos;
+
+	while (1) {
+		head = ACCESS_ONCE(ring->head);
+		smp_rmb();
+		tail = ACCESS_ONCE(ring->tail);
+		pos = reader->r_pos[cpu];
+		if (logger_ring_before(pos, tail))
+			pos = tail;
+		reader->r_pos[cpu] = pos;
+		if (pos == head)
+			return false;
+
+		logger_ring_copy_out(log, ring, pos, entry, sizeof(*entry));
+		smp_rmb();
+		if (logger_ring_before(pos, ACCESS_ONCE(ring->tail)))
+			continue;	/* lapped by the writer */
+
+		if (reader->r_all || entry->euid == euid)
+			return true;
+		reader->r_pos[cpu] = pos + sizeof(*entry) + entry->len;
+	}
+}
+
+/*
+ * logger_percpu_next - finds the oldest entry across all rings that
+ * 'reader' may read and copies its header into 'entry'. Returns the CPU
+ * whose ring holds it, or -1 if there is none.
+ *
+ * Caller must hold log->mutex.
+ */
+static int logger_percpu_next(struct logger_reader *reader,
+			      struct logger_entry *entry)
+{
+	struct logger_entry next;
+	int cpu, found = -1;
+
+	for_each_possible_cpu(cpu) {
+		if (!logger_ring_next(reader, cpu, &next))
+			continue;
+		if (found < 0 || next.sec < entry->sec ||
+		    (next.sec == entry->sec && next.nsec < entry->nsec)) {
+			*entry = next;
+			found = cpu;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * logger_percpu_empty - does any ring hold entries past 'reader'?
+ *
+ * Like the single buffer check, this does not look at which entries the
+ * reader may see.
+ */
+static bool logger_percpu_empty(struct logger_reader *reader)
+{
+	struct logger_log *log = reader->log;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct logger_ring *ring = per_cpu_ptr(log->rings, cpu);
+
+		if (ACCESS_ONCE(ring->head) != reader->r_pos[cpu])
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * logger_read_percpu - reads exactly one entry, the oldest one across all
+ * rings, into 'buf'. The entry is copied to reader->scratch first so that
+ * a writer cannot change it while it is copied to userspace. Returns 0 if
+ * there is nothing to read.
+ *
+ * Caller must hold log->mutex.
+ */
+static ssize_t logger_read_percpu(struct logger_reader *reader,
+				  char __user *buf, size_t count)
+{
+	struct logger_log *log = reader->log;
+	struct logger_entry *entry = reader->scratch;
+	struct logger_ring *ring;
+	struct logger_entry next;
+	size_t hdr_len = get_user_hdr_len(reader->r_ver);
+	unsigned long pos;
+	int cpu;
+
+	while (1) {
+		cpu = logger_percpu_next(reader, &next);
+		if (cpu < 0)
+			return 0;
+		if (count < hdr_len + next.len)
+			return -EINVAL;
+
+		ring = per_cpu_ptr(log->rings, cpu);
+		pos = reader->r_pos[cpu];
+		logger_ring_copy_out(log, ring, pos, entry,
+				     sizeof(*entry) + next.len);
+		smp_rmb();
+		if (!logger_ring_before(pos, ACCESS_ONCE(ring->tail)))
+			break;
+	}
+
+	if (copy_header_to_user(reader->r_ver, entry, buf))
+		return -EFAULT;
+	if (copy_to_user(buf + hdr_len, entry->msg, entry->len))
+		return -EFAULT;
+
+	reader->r_pos[cpu] = pos + sizeof(*entry) + entry->len;
+
+	return hdr_len + entry->len;
+}
+
+/*
+ * logger_percpu_len - the number of bytes in the rings past 'reader'
+ *
+ * Caller must hold log->mutex.
+ */
+static size_t logger_percpu_len(struct logger_reader *reader)
+{
+	struct logger_log *log = reader->log;
+	size_t len = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct logger_ring *ring = per_cpu_ptr(log->rings, cpu);
+		unsigned long head = ACCESS_ONCE(ring->head);
+		unsigned long pos = reader->r_pos[cpu];
+
+		smp_rmb();
+		if (logger_ring_before(pos, ACCESS_ONCE(ring->tail)))
+			pos = ring->tail;
+		if (logger_ring_before(pos, head))
+			len += head - pos;
+	}
+
+	return len;
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -447,7 +836,7 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	size_t orig;
 	struct logger_entry header;
 	struct timespec now;
 	ssize_t ret = 0;
@@ -466,7 +855,11 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
+	if (log->rings)
+		return logger_write_percpu(log, &header, iov, nr_segs);
+
 	mutex_lock(&log->mutex);
+	orig = log->w_off;
 
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
@@ -475,6 +868,7 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	 * entries that encroach on readable buffer.
 	 */
 	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	logger_ctl_reserve(log, sizeof(struct logger_entry) + header.len);
 
 	do_write_log(log, &header, sizeof(struct logger_entry));
 
@@ -497,6 +891,8 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		ret += nr;
 	}
 
+	logger_ctl_append(&log->ctl->ring[0],
+			  sizeof(struct logger_entry) + header.len);
 	mutex_unlock(&log->mutex);
 
 	/* wake up any blocked readers */
@@ -528,10 +924,24 @@ static int logger_open(struct inode *inode, struct file *file)
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader;
 
-		reader = kmalloc(sizeof(struct logger_reader), GFP_KERNEL);
+		reader = kzalloc(sizeof(struct logger_reader), GFP_KERNEL);
 		if (!reader)
 			return -ENOMEM;
 
+		if (log->rings) {
+			reader->r_pos = kcalloc(nr_cpu_ids,
+						sizeof(*reader->r_pos),
+						GFP_KERNEL);
+			reader->scratch = kmalloc(LOGGER_ENTRY_MAX_LEN,
+						  GFP_KERNEL);
+			if (!reader->r_pos || !reader->scratch) {
+				kfree(reader->r_pos);
+				kfree(reader->scratch);
+				kfree(reader);
+				return -ENOMEM;
+			}
+		}
+
 		reader->log = log;
 		reader->r_ver = 1;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
@@ -541,6 +951,13 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		mutex_lock(&log->mutex);
 		reader->r_off = log->head;
+		if (log->rings) {
+			int cpu;
+
+			for_each_possible_cpu(cpu)
+				reader->r_pos[cpu] =
+					per_cpu_ptr(log->rings, cpu)->start;
+		}
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -566,12 +983,29 @@ static int logger_release(struct inode *ignored, struct file *file)
 		list_del(&reader->list);
 		mutex_unlock(&log->mutex);
 
+		kfree(reader->r_pos);
+		kfree(reader->scratch);
 		kfree(reader);
 	}
 
 	return 0;
 }
 
+/*
+ * logger_ctl_heads - sums the heads of all rings, which changes whenever
+ * anything is written to the log
+ */
+static __u32 logger_ctl_heads(struct logger_log *log)
+{
+	__u32 heads = 0;
+	unsigned int i;
+
+	for (i = 0; i < log->ctl->nr_rings; i++)
+		heads += ACCESS_ONCE(log->ctl->ring[i].head);
+
+	return heads;
+}
+
 /*
  * logger_poll - the log's poll file operation, for poll/select/epoll
  *
@@ -596,6 +1030,26 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
+	if (reader->mapped) {
+		__u32 heads = logger_ctl_heads(log);
+
+		if (heads != reader->polled) {
+			reader->polled = heads;
+			ret |= POLLIN | POLLRDNORM;
+		}
+		mutex_unlock(&log->mutex);
+		return ret;
+	}
+
+	if (log->rings) {
+		struct logger_entry entry;
+
+		if (logger_percpu_next(reader, &entry) >= 0)
+			ret |= POLLIN | POLLRDNORM;
+		mutex_unlock(&log->mutex);
+		return ret;
+	}
+
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
@@ -607,6 +1061,69 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the control page and the ring buffers read-only; see struct
+ * logger_mmap_ctl. As the mapping shows every entry, only readers that
+ * may read all entries can map the log.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	unsigned long addr = vma->vm_start;
+	unsigned int i;
+	int cpu, ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	reader = file->private_data;
+	log = reader->log;
+	if (!reader->r_all || (vma->vm_flags & VM_WRITE))
+		return -EPERM;
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > PAGE_SIZE + log->ctl->nr_rings *
+					  log->ctl->ring[0].size)
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_RESERVED;
+
+	ret = vm_insert_page(vma, addr, virt_to_page(log->ctl));
+	addr += PAGE_SIZE;
+
+	i = 0;
+	for_each_possible_cpu(cpu) {
+		unsigned char *buffer;
+		size_t off;
+
+		if (log->rings)
+			buffer = per_cpu_ptr(log->rings, cpu)->buffer;
+		else if (i == 0)
+			buffer = log->buffer;
+		else
+			break;
+
+		for (off = 0; off < log->ctl->ring[i].size && !ret &&
+			      addr < vma->vm_end; off += PAGE_SIZE) {
+			ret = vm_insert_page(vma, addr,
+					     vmalloc_to_page(buffer + off));
+			addr += PAGE_SIZE;
+		}
+		i++;
+	}
+	if (ret)
+		return ret;
+
+	mutex_lock(&log->mutex);
+	reader->mapped = true;
+	reader->polled = logger_ctl_heads(log);
+	mutex_unlock(&log->mutex);
+
+	return 0;
+}
+
 static long logger_set_version(struct logger_reader *reader, void __user *arg)
 {
 	int version;
@@ -620,6 +1137,27 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+/*
+ * logger_percpu_flush - moves all readers, and where new readers start, to
+ * the current head of each ring. The data itself stays for the writers to
+ * overwrite.
+ *
+ * Caller must hold log->mutex.
+ */
+static void logger_percpu_flush(struct logger_log *log)
+{
+	struct logger_reader *reader;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct logger_ring *ring = per_cpu_ptr(log->rings, cpu);
+
+		ring->start = ACCESS_ONCE(ring->head);
+		list_for_each_entry(reader, &log->readers, list)
+			reader->r_pos[cpu] = ring->start;
+	}
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
@@ -631,7 +1169,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
-		ret = log->size;
+		if (log->rings)
+			ret = log->ring_size * num_possible_cpus();
+		else
+			ret = log->size;
 		break;
 	case LOGGER_GET_LOG_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -639,7 +1180,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
+		if (log->rings)
+			ret = logger_percpu_len(reader);
+		else if (log->w_off >= reader->r_off)
 			ret = log->w_off - reader->r_off;
 		else
 			ret = (log->size - reader->r_off) + log->w_off;
@@ -651,6 +1194,17 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
+		if (log->rings) {
+			struct logger_entry entry;
+
+			if (logger_percpu_next(reader, &entry) >= 0)
+				ret = get_user_hdr_len(reader->r_ver) +
+					entry.len;
+			else
+				ret = 0;
+			break;
+		}
+
 		if (!reader->r_all)
 			reader->r_off = get_next_entry_by_uid(log,
 				reader->r_off, current_euid());
@@ -666,6 +1220,11 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
+		if (log->rings) {
+			logger_percpu_flush(log);
+			ret = 0;
+			break;
+		}
 		list_for_each_entry(reader, &log->readers, list)
 			reader->r_off = log->w_off;
 		log->head = log->w_off;
@@ -699,6 +1258,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -706,14 +1266,28 @@ static const struct file_operations logger_fops = {
 };
 
 /*
- * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * logger_set_size - parses a log size given at boot, such as
+ * "logger.log_main_size=256K". The size is rounded up to a power of two
+ * and must hold at least one entry of the maximum size.
+ */
+static int logger_set_size(const char *val, struct kernel_param *kp)
+{
+	unsigned long long size = memparse(val, NULL);
+
+	if (size < LOGGER_ENTRY_MAX_LEN || size > (16 << 20))
+		return -EINVAL;
+	*(size_t *)kp->arg = roundup_pow_of_two(size);
+	return 0;
+}
+
+/*
+ * Defines a log structure with name 'NAME' and a default size of 'SIZE'
+ * bytes, which must be a power of two, and greater than
+ * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)). The size can
+ * be changed at boot with the 'VAR'_size parameter.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -726,7 +1300,9 @@ static struct logger_log VAR = { \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
-};
+}; \
+module_param_call(VAR ## _size, logger_set_size, param_get_ulong, \
+		  &VAR.size, S_IRUGO);
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 32*1024)
 DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 16*1024)
@@ -746,10 +1322,98 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+/*
+ * init_log_percpu - splits the log's size among the possible CPUs, giving
+ * each ring room for at least two entries of the maximum size
+ */
+static int __init init_log_percpu(struct logger_log *log)
+{
+	int cpu;
+
+	log->ring_size = max_t(size_t,
+			       rounddown_pow_of_two(log->size /
+						    num_possible_cpus()),
+			       roundup_pow_of_two(2 * LOGGER_ENTRY_MAX_LEN));
+
+	log->rings = alloc_percpu(struct logger_ring);
+	if (!log->rings)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct logger_ring *ring = per_cpu_ptr(log->rings, cpu);
+
+		ring->buffer = vmalloc_user(log->ring_size);
+		if (!ring->buffer)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	for_each_possible_cpu(cpu)
+		vfree(per_cpu_ptr(log->rings, cpu)->buffer);
+	free_percpu(log->rings);
+	log->rings = NULL;
+	return -ENOMEM;
+}
+
+/*
+ * init_log_ctl - sets up the control page that describes the log's rings
+ * to mmap readers. Buffers are allocated zeroed so that a mapping shows
+ * nothing but log entries.
+ */
+static int __init init_log_ctl(struct logger_log *log)
+{
+	unsigned int nr_rings = log->rings ? num_possible_cpus() : 1;
+	unsigned int i = 0;
+	int cpu;
+
+	if (sizeof(struct logger_mmap_ctl) +
+	    nr_rings * sizeof(struct logger_mmap_ring) > PAGE_SIZE)
+		return -EINVAL;
+
+	log->ctl = (struct logger_mmap_ctl *)get_zeroed_page(GFP_KERNEL);
+	if (!log->ctl)
+		return -ENOMEM;
+	log->ctl->version = LOGGER_MMAP_VERSION;
+	log->ctl->nr_rings = nr_rings;
+
+	if (!log->rings) {
+		log->ctl->ring[0].offset = PAGE_SIZE;
+		log->ctl->ring[0].size = log->size;
+		return 0;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct logger_ring *ring = per_cpu_ptr(log->rings, cpu);
+
+		ring->ctl = &log->ctl->ring[i];
+		ring->ctl->offset = PAGE_SIZE + i * log->ring_size;
+		ring->ctl->size = log->ring_size;
+		i++;
+	}
+
+	return 0;
+}
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	if (logger_percpu) {
+		ret = init_log_percpu(log);
+	} else {
+		log->buffer = vmalloc_user(log->size);
+		ret = log->buffer ? 0 : -ENOMEM;
+	}
+	if (!ret)
+		ret = init_log_ctl(log);
+	if (unlikely(ret)) {
+		printk(KERN_ERR "logger: failed to allocate buffer "
+		       "for log '%s'!\n", log->misc.name);
+		return ret;
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
@@ -757,8 +1421,13 @@ static int __init init_log(struct logger_log *log)
 		return ret;
 	}
 
-	printk(KERN_INFO "logger: created %luK log '%s'\n",
-	       (unsigned long) log->size >> 10, log->misc.name);
+	if (log->rings)
+		printk(KERN_INFO "logger: created %d x %luK log '%s'\n",
+		       num_possible_cpus(),
+		       (unsigned long) log->ring_size >> 10, log->misc.name);
+	else
+		printk(KERN_INFO "logger: created %luK log '%s'\n",
+		       (unsigned long) log->size >> 10, log->misc.name);
 
 	return 0;
 }
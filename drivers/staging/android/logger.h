@@ -51,6 +51,39 @@ struct logger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * mmap() of a log opened for reading maps, read-only, a control page
+ * followed by the log's ring buffers: one in the default mode, one per
+ * CPU in per-cpu mode. Each ring holds struct logger_entry headers, each
+ * followed by its payload, and wraps at its size. Its positions count the
+ * bytes ever written and are taken modulo the size to index the ring.
+ *
+ * A consumer parses entries from its position up to 'head'. If its
+ * position is before 'tail', the writer has lapped it and 'dropped' tells
+ * how many entries were lost. 'tail' and 'dropped' are consistent when
+ * 'seq' is even and unchanged across reading them. An entry that was
+ * parsed must be discarded if 'tail' has since moved past it. poll()
+ * reports POLLIN when a ring's head moved since the last poll().
+ */
+struct logger_mmap_ring {
+	__u32		seq;		/* odd while tail is being moved */
+	__u32		offset;		/* of the ring in the mapping */
+	__u32		size;		/* of the ring, a power of two */
+	__u32		head;		/* end of the newest entry */
+	__u32		tail;		/* start of the oldest entry */
+	__u32		written;	/* entries ever written */
+	__u32		dropped;	/* entries ever overwritten */
+	__u32		__pad;
+};
+
+struct logger_mmap_ctl {
+	__u32		version;	/* LOGGER_MMAP_VERSION */
+	__u32		nr_rings;
+	struct logger_mmap_ring	ring[0];
+};
+
+#define LOGGER_MMAP_VERSION	1
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
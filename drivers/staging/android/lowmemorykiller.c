@@ -16,6 +16,12 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Alternatively, with /sys/module/lowmemorykiller/parameters/pressure_kill
+ * set, processes are killed when page reclaim stops making progress, i.e.
+ * when the share of scanned pages it fails to reclaim in a zone reaches
+ * pressure_critical percent. Events at or above pressure_notify percent
+ * are reported to userspace through /dev/lowmem_pressure.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -31,11 +37,19 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
 #include <linux/mm.h>
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/vmpressure.h>
+#include <linux/wait.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -56,12 +70,102 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * Thread group leaders bucketed by oom_adj, so that victim selection
+ * only has to look at the highest non-empty bucket instead of walking
+ * every process. Protected by tasklist_lock. Tasks forked after init
+ * are added by lowmem_adj_index_add(); lowmem_adj_index_init() adds
+ * every process that already exists.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct list_head lowmem_adj_index[LOWMEM_ADJ_BUCKETS];
+static int lowmem_adj_index_ready;
+
+/* Victim selection cost, exported in debugfs */
+static u64 lowmem_scan_count;
+static u64 lowmem_scan_tasks;
+static u64 lowmem_scan_time_ns;
+static u64 lowmem_scan_max_ns;
+
+/*
+ * Pressure mode: kill on collapsing reclaim efficiency (see
+ * mm/vmpressure.c) rather than on the minfree thresholds.
+ */
+static int lowmem_pressure_kill;
+static unsigned long lowmem_pressure_notify = 60;
+static unsigned long lowmem_pressure_critical = 95;
+
+/* Last event reported to the pressure device */
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static unsigned long lowmem_pressure_seq;
+static unsigned long lowmem_pressure_last;
+static const char *lowmem_pressure_zone = "";
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			printk(x);			\
 	} while (0)
 
+static struct list_head *lowmem_adj_bucket(struct task_struct *p)
+{
+	int oom_adj = clamp_t(int, p->signal->oom_adj,
+			      OOM_DISABLE, OOM_ADJUST_MAX);
+
+	return &lowmem_adj_index[oom_adj - OOM_DISABLE];
+}
+
+void lowmem_adj_index_add(struct task_struct *p)
+{
+	if (!lowmem_adj_index_ready) {
+		INIT_LIST_HEAD(&p->lowmem_adj_node);
+		return;
+	}
+	list_add_tail(&p->lowmem_adj_node, lowmem_adj_bucket(p));
+}
+
+void lowmem_adj_index_del(struct task_struct *p)
+{
+	list_del_init(&p->lowmem_adj_node);
+}
+
+/* A non-leader thread exec()ed and took over from @old */
+void lowmem_adj_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	lowmem_adj_index_del(old);
+	lowmem_adj_index_add(new);
+}
+
+/* Called after the oom_adj of @p's thread group has been changed */
+void lowmem_adj_index_update(struct task_struct *p)
+{
+	struct task_struct *leader;
+
+	write_lock_irq(&tasklist_lock);
+	leader = p->group_leader;
+	/* Unlinked leaders are exiting */
+	if (!list_empty(&leader->lowmem_adj_node))
+		list_move_tail(&leader->lowmem_adj_node,
+			       lowmem_adj_bucket(leader));
+	write_unlock_irq(&tasklist_lock);
+}
+
+static void __init lowmem_adj_index_init(void)
+{
+	int i;
+	struct task_struct *p;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_adj_index[i]);
+
+	write_lock_irq(&tasklist_lock);
+	for_each_process(p)
+		list_add_tail(&p->lowmem_adj_node, lowmem_adj_bucket(p));
+	lowmem_adj_index_ready = 1;
+	write_unlock_irq(&tasklist_lock);
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -80,17 +184,109 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+/* Returns the lowest oom_adj that may be killed at the current free memory */
+static int lowmem_min_adj(int other_free, int other_file)
+{
+	int i;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		if (other_free < lowmem_minfree[i] &&
+				other_file < lowmem_minfree[i])
+			return lowmem_adj[i];
+	}
+	return OOM_ADJUST_MAX + 1;
+}
+
+/*
+ * Kills the largest task in the highest populated oom_adj bucket at or
+ * above @min_adj. Returns the number of pages it is expected to free.
+ */
+static int lowmem_kill(int min_adj)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
-	int rem = 0;
 	int tasksize;
-	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
+	int adj;
+	int scanned = 0;
+	u64 scan_ns;
+	ktime_t scan_start;
 	int selected_tasksize = 0;
-	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
+	int selected_oom_adj = min_adj;
+
+	rcu_read_lock();
+	read_lock(&tasklist_lock);
+	scan_start = ktime_get();
+	/*
+	 * Only the highest bucket holding a task with memory needs to be
+	 * looked at; within it, pick the largest task.
+	 */
+	for (adj = OOM_ADJUST_MAX; adj >= max(min_adj, OOM_DISABLE) &&
+	     !selected; adj--) {
+		list_for_each_entry(p, &lowmem_adj_index[adj - OOM_DISABLE],
+				    lowmem_adj_node) {
+			struct mm_struct *mm;
+			struct signal_struct *sig;
+			int oom_adj;
+
+			scanned++;
+			task_lock(p);
+			mm = p->mm;
+			sig = p->signal;
+			if (!mm || !sig) {
+				task_unlock(p);
+				continue;
+			}
+			oom_adj = sig->oom_adj;
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			if (tasksize <= 0)
+				continue;
+			if (selected && tasksize <= selected_tasksize)
+				continue;
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
+		}
+	}
+	scan_ns = ktime_to_ns(ktime_sub(ktime_get(), scan_start));
+	lowmem_scan_count++;
+	lowmem_scan_tasks += scanned;
+	lowmem_scan_time_ns += scan_ns;
+	if (scan_ns > lowmem_scan_max_ns)
+		lowmem_scan_max_ns = scan_ns;
+	read_unlock(&tasklist_lock);
+
+	if (!selected) {
+		rcu_read_unlock();
+		return 0;
+	}
+	if (fatal_signal_pending(selected)) {
+		pr_warning("process %d is suffering a slow death\n",
+			   selected->pid);
+		rcu_read_unlock();
+		return 0;
+	}
+	lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+		     selected->pid, selected->comm,
+		     selected_oom_adj, selected_tasksize);
+	lowmem_deathpending = selected;
+	lowmem_deathpending_timeout = jiffies + HZ;
+	send_sig(SIGKILL, selected, 0);
+	rcu_read_unlock();
+	return selected_tasksize;
+}
+
+static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	int rem = 0;
+	int min_adj;
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
@@ -106,17 +302,11 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	    time_before_eq(jiffies, lowmem_deathpending_timeout))
 		return 0;
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-				other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
-			break;
-		}
-	}
+	/* In pressure mode kills are driven by lowmem_vmpressure() only */
+	if (lowmem_pressure_kill)
+		min_adj = OOM_ADJUST_MAX + 1;
+	else
+		min_adj = lowmem_min_adj(other_free, other_file);
 	if (nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
@@ -130,78 +320,165 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	rcu_read_lock();
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
-		if (fatal_signal_pending(selected)) {
-			pr_warning("process %d is suffering a slow death\n",
-			     selected->pid);
-			rcu_read_unlock();
-			return rem;	
-		   }
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		send_sig(SIGKILL, selected, 0);
-		rem -= selected_tasksize;
-	}
+	rem -= lowmem_kill(min_adj);
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	rcu_read_unlock();
 	return rem;
 }
 
+/*
+ * Reclaim efficiency events from page reclaim. Userspace is told about
+ * anything at or above lowmem_pressure_notify through the pressure
+ * device so that it can trim caches itself; in pressure mode a task is
+ * killed once reclaim efficiency falls to lowmem_pressure_critical. The
+ * minfree table still picks which oom_adj levels may go, but with free
+ * memory above every threshold the most expendable level is used
+ * instead of nothing.
+ */
+static int lowmem_vmpressure(struct notifier_block *self,
+			     unsigned long pressure, void *data)
+{
+	struct zone *zone = data;
+	int min_adj;
+	int array_size = min(lowmem_adj_size, (int)ARRAY_SIZE(lowmem_adj));
+
+	if (pressure >= lowmem_pressure_notify) {
+		spin_lock(&lowmem_pressure_lock);
+		lowmem_pressure_last = pressure;
+		lowmem_pressure_zone = zone->name;
+		lowmem_pressure_seq++;
+		spin_unlock(&lowmem_pressure_lock);
+		wake_up_interruptible(&lowmem_pressure_wait);
+	}
+
+	if (!lowmem_pressure_kill || pressure < lowmem_pressure_critical ||
+	    array_size <= 0)
+		return NOTIFY_OK;
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+		return NOTIFY_OK;
+
+	min_adj = lowmem_min_adj(global_page_state(NR_FREE_PAGES),
+				 global_page_state(NR_FILE_PAGES) -
+				 global_page_state(NR_SHMEM));
+	if (min_adj == OOM_ADJUST_MAX + 1)
+		min_adj = lowmem_adj[array_size - 1];
+	lowmem_print(3, "lowmem_vmpressure %lu on %s, ma %d\n",
+		     pressure, zone->name, min_adj);
+	lowmem_kill(min_adj);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call	= lowmem_vmpressure,
+};
+
+/*
+ * Each open file of the pressure device remembers the last event it
+ * has read; poll() reports POLLIN once a newer one is available and
+ * read() returns it as "<pressure> <zone>\n".
+ */
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	spin_lock(&lowmem_pressure_lock);
+	file->private_data = (void *)lowmem_pressure_seq;
+	spin_unlock(&lowmem_pressure_lock);
+	return nonseekable_open(inode, file);
+}
+
+static int lowmem_pressure_pending(struct file *file)
+{
+	return (unsigned long)file->private_data != lowmem_pressure_seq;
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *pos)
+{
+	char line[32];
+	int len;
+	int ret;
+
+	if (!lowmem_pressure_pending(file)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(lowmem_pressure_wait,
+					       lowmem_pressure_pending(file));
+		if (ret)
+			return ret;
+	}
+
+	spin_lock(&lowmem_pressure_lock);
+	len = snprintf(line, sizeof(line), "%lu %s\n",
+		       lowmem_pressure_last, lowmem_pressure_zone);
+	file->private_data = (void *)lowmem_pressure_seq;
+	spin_unlock(&lowmem_pressure_lock);
+
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, line, len))
+		return -EFAULT;
+	return len;
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_pressure_wait, wait);
+	if (lowmem_pressure_pending(file))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.read = lowmem_pressure_read,
+	.poll = lowmem_pressure_poll,
+};
+
+static struct miscdevice lowmem_pressure_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_pressure",
+	.fops = &lowmem_pressure_fops,
+};
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static void __init lowmem_debugfs_init(void)
+{
+	struct dentry *root;
+
+	root = debugfs_create_dir("lowmemorykiller", NULL);
+	if (!root)
+		return;
+
+	debugfs_create_u64("scan_count", S_IRUGO, root, &lowmem_scan_count);
+	debugfs_create_u64("scan_tasks", S_IRUGO, root, &lowmem_scan_tasks);
+	debugfs_create_u64("scan_time_ns", S_IRUGO, root,
+			   &lowmem_scan_time_ns);
+	debugfs_create_u64("scan_max_ns", S_IRUGO | S_IWUSR, root,
+			   &lowmem_scan_max_ns);
+}
+
 static int __init lowmem_init(void)
 {
+	lowmem_adj_index_init();
+	lowmem_debugfs_init();
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
+	register_vmpressure_notifier(&lowmem_vmpressure_nb);
+	if (misc_register(&lowmem_pressure_dev))
+		pr_err("lowmemorykiller: failed to register pressure device\n");
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	misc_deregister(&lowmem_pressure_dev);
+	unregister_vmpressure_notifier(&lowmem_vmpressure_nb);
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
 }
@@ -212,6 +489,12 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_kill, lowmem_pressure_kill, bool,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_notify, lowmem_pressure_notify, ulong,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, ulong,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
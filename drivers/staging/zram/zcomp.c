@@ -0,0 +1,372 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/cpu.h>
+#include <linux/sched.h>
+
+#include "zcomp.h"
+
+#if !defined(CONFIG_ZRAM_LZO) && !defined(CONFIG_ZRAM_SNAPPY) && \
+	!defined(CONFIG_ZRAM_LZ4)
+#error at least one of CONFIG_ZRAM_{LZO,SNAPPY,LZ4} must be defined
+#endif
+
+#ifdef CONFIG_ZRAM_LZO
+#include <linux/lzo.h>
+
+static void *zcomp_lzo_create(gfp_t flags)
+{
+	return kzalloc(LZO1X_MEM_COMPRESS, flags);
+}
+
+static void zcomp_lzo_destroy(void *private)
+{
+	kfree(private);
+}
+
+static int zcomp_lzo_compress(const unsigned char *src, unsigned char *dst,
+			      size_t *dst_len, void *private)
+{
+	int ret = lzo1x_1_compress(src, PAGE_SIZE, dst, dst_len, private);
+
+	return ret == LZO_E_OK ? 0 : ret;
+}
+
+static int zcomp_lzo_decompress(const unsigned char *src, size_t src_len,
+				unsigned char *dst)
+{
+	size_t dst_len = PAGE_SIZE;
+	int ret = lzo1x_decompress_safe(src, src_len, dst, &dst_len);
+
+	return ret == LZO_E_OK ? 0 : ret;
+}
+
+static const struct zcomp_backend zcomp_lzo = {
+	.compress = zcomp_lzo_compress,
+	.decompress = zcomp_lzo_decompress,
+	.create = zcomp_lzo_create,
+	.destroy = zcomp_lzo_destroy,
+	.name = "lzo",
+};
+#endif
+
+#ifdef CONFIG_ZRAM_SNAPPY
+#include "../snappy/csnappy.h" /* if built in drivers/staging */
+#define SNAPPY_WMSIZE_ORDER	((PAGE_SHIFT > 14) ? (15) : (PAGE_SHIFT+1))
+#define SNAPPY_WMSIZE		(1 << SNAPPY_WMSIZE_ORDER)
+
+static void *zcomp_snappy_create(gfp_t flags)
+{
+	return kzalloc(SNAPPY_WMSIZE, flags);
+}
+
+static void zcomp_snappy_destroy(void *private)
+{
+	kfree(private);
+}
+
+static int zcomp_snappy_compress(const unsigned char *src, unsigned char *dst,
+				 size_t *dst_len, void *private)
+{
+	const char *end = csnappy_compress_fragment((const char *)src,
+				PAGE_SIZE, (char *)dst, private,
+				SNAPPY_WMSIZE_ORDER);
+
+	*dst_len = end - (char *)dst;
+	return 0;
+}
+
+static int zcomp_snappy_decompress(const unsigned char *src, size_t src_len,
+				   unsigned char *dst)
+{
+	uint32_t dst_len = PAGE_SIZE;
+
+	return csnappy_decompress_noheader((const char *)src, src_len,
+				(char *)dst, &dst_len);
+}
+
+static const struct zcomp_backend zcomp_snappy = {
+	.compress = zcomp_snappy_compress,
+	.decompress = zcomp_snappy_decompress,
+	.create = zcomp_snappy_create,
+	.destroy = zcomp_snappy_destroy,
+	.name = "snappy",
+};
+#endif
+
+#ifdef CONFIG_ZRAM_LZ4
+#include <linux/lz4.h>
+
+static void *zcomp_lz4_create(gfp_t flags)
+{
+	return kzalloc(LZ4_MEM_COMPRESS, flags);
+}
+
+static void zcomp_lz4_destroy(void *private)
+{
+	kfree(private);
+}
+
+static int zcomp_lz4_compress(const unsigned char *src, unsigned char *dst,
+			      size_t *dst_len, void *private)
+{
+	return lz4_compress((const char *)src, PAGE_SIZE, (char *)dst,
+			dst_len, private);
+}
+
+static int zcomp_lz4_decompress(const unsigned char *src, size_t src_len,
+				unsigned char *dst)
+{
+	size_t dst_len = PAGE_SIZE;
+
+	return lz4_decompress((const char *)src, src_len, (char *)dst,
+			&dst_len);
+}
+
+static const struct zcomp_backend zcomp_lz4 = {
+	.compress = zcomp_lz4_compress,
+	.decompress = zcomp_lz4_decompress,
+	.create = zcomp_lz4_create,
+	.destroy = zcomp_lz4_destroy,
+	.name = "lz4",
+};
+#endif
+
+static const struct zcomp_backend *backends[] = {
+#ifdef CONFIG_ZRAM_LZO
+	&zcomp_lzo,
+#endif
+#ifdef CONFIG_ZRAM_SNAPPY
+	&zcomp_snappy,
+#endif
+#ifdef CONFIG_ZRAM_LZ4
+	&zcomp_lz4,
+#endif
+	NULL
+};
+
+const char *zcomp_default_name = CONFIG_ZRAM_DEFAULT_COMP;
+
+const struct zcomp_backend *zcomp_find_backend(const char *name)
+{
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (sysfs_streq(name, backends[i]->name))
+			return backends[i];
+	}
+
+	return NULL;
+}
+
+/* Lists compiled-in backends, with the current one in brackets */
+ssize_t zcomp_available_show(const struct zcomp_backend *cur, char *buf)
+{
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (backends[i] == cur)
+			sz += sprintf(buf + sz, "[%s] ", backends[i]->name);
+		else
+			sz += sprintf(buf + sz, "%s ", backends[i]->name);
+	}
+	sz += sprintf(buf + sz, "\n");
+
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	if (zstrm->private)
+		comp->backend->destroy(zstrm->private);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+/*
+ * Allocates a new stream. Besides the backend scratch memory, every
+ * stream needs a two page buffer since some data can expand during
+ * compression.
+ */
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp, gfp_t flags)
+{
+	struct zcomp_strm *zstrm = kmalloc(sizeof(*zstrm), flags);
+
+	if (!zstrm)
+		return NULL;
+
+	zstrm->private = comp->backend->create(flags);
+	zstrm->buffer = (void *)__get_free_pages(flags | __GFP_ZERO, 1);
+	if (!zstrm->private || !zstrm->buffer) {
+		zcomp_strm_free(comp, zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+static int zcomp_strm_available(struct zcomp *comp)
+{
+	return !list_empty(&comp->idle_strm) ||
+		comp->avail_strm < comp->max_strm;
+}
+
+/*
+ * Gets an idle stream, allocating a new one if fewer than max_strm
+ * exist, or sleeps until another writer releases one.
+ */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_entry(comp->idle_strm.next,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+
+		/* All streams are busy: wait for one to be released */
+		if (comp->avail_strm >= comp->max_strm) {
+			spin_unlock(&comp->strm_lock);
+			wait_event(comp->strm_wait,
+				zcomp_strm_available(comp));
+			continue;
+		}
+
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		zstrm = zcomp_strm_alloc(comp, GFP_NOIO);
+		if (zstrm)
+			return zstrm;
+
+		/* Allocation failed: fall back to waiting for an idle one */
+		spin_lock(&comp->strm_lock);
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm <= comp->max_strm) {
+		list_add(&zstrm->list, &comp->idle_strm);
+		spin_unlock(&comp->strm_lock);
+		wake_up(&comp->strm_wait);
+		return;
+	}
+
+	/* A CPU went away while this stream was busy */
+	comp->avail_strm--;
+	spin_unlock(&comp->strm_lock);
+	zcomp_strm_free(comp, zstrm);
+}
+
+/* Shrinks the pool down to max_strm, freeing surplus idle streams */
+static void zcomp_strm_trim(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm, *tmp;
+	LIST_HEAD(surplus);
+
+	spin_lock(&comp->strm_lock);
+	list_for_each_entry_safe(zstrm, tmp, &comp->idle_strm, list) {
+		if (comp->avail_strm <= comp->max_strm)
+			break;
+		list_move(&zstrm->list, &surplus);
+		comp->avail_strm--;
+	}
+	spin_unlock(&comp->strm_lock);
+
+	list_for_each_entry_safe(zstrm, tmp, &surplus, list) {
+		list_del(&zstrm->list);
+		zcomp_strm_free(comp, zstrm);
+	}
+}
+
+static int zcomp_cpu_notify(struct notifier_block *nb, unsigned long action,
+			    void *pcpu)
+{
+	struct zcomp *comp = container_of(nb, struct zcomp, cpu_nb);
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_ONLINE:
+	case CPU_DEAD:
+		spin_lock(&comp->strm_lock);
+		comp->max_strm = max_t(int, num_online_cpus(), 1);
+		spin_unlock(&comp->strm_lock);
+		zcomp_strm_trim(comp);
+		/* Writers waiting for a stream may now allocate one */
+		wake_up_all(&comp->strm_wait);
+		break;
+	}
+
+	return NOTIFY_OK;
+}
+
+struct zcomp *zcomp_create(const struct zcomp_backend *backend)
+{
+	struct zcomp *comp;
+	struct zcomp_strm *zstrm;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	comp->backend = backend;
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+
+	/* Always keep one stream so that writers can make progress */
+	zstrm = zcomp_strm_alloc(comp, GFP_KERNEL);
+	if (!zstrm) {
+		kfree(comp);
+		return NULL;
+	}
+	list_add(&zstrm->list, &comp->idle_strm);
+	comp->avail_strm = 1;
+
+	comp->cpu_nb.notifier_call = zcomp_cpu_notify;
+	register_cpu_notifier(&comp->cpu_nb);
+
+	spin_lock(&comp->strm_lock);
+	comp->max_strm = max_t(int, num_online_cpus(), 1);
+	spin_unlock(&comp->strm_lock);
+
+	return comp;
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm, *tmp;
+
+	unregister_cpu_notifier(&comp->cpu_nb);
+
+	list_for_each_entry_safe(zstrm, tmp, &comp->idle_strm, list) {
+		list_del(&zstrm->list);
+		zcomp_strm_free(comp, zstrm);
+	}
+	kfree(comp);
+}
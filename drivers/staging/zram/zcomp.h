@@ -0,0 +1,84 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/notifier.h>
+
+/*
+ * A compression backend. Each zram device picks one through its
+ * 'comp_algorithm' sysfs node before it is initialized.
+ */
+struct zcomp_backend {
+	/*
+	 * Compress one page from 'src' into 'dst' (which is at least
+	 * two pages long), using 'private' as scratch memory.
+	 */
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private);
+
+	/* Decompress 'src_len' bytes from 'src' into one page at 'dst' */
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst);
+
+	/* Allocate/free the per-stream scratch memory */
+	void *(*create)(gfp_t flags);
+	void (*destroy)(void *private);
+
+	const char *name;
+};
+
+/*
+ * A compression stream: the scratch memory and output buffer one
+ * compress() call needs. Writers hold a stream for the duration of a
+ * single page compression.
+ */
+struct zcomp_strm {
+	void *buffer;		/* compressed output, two pages */
+	void *private;		/* backend scratch memory */
+	struct list_head list;
+};
+
+/*
+ * Pool of compression streams, sized to the number of online CPUs so
+ * that concurrent writers do not serialize on a single buffer. Streams
+ * are allocated lazily up to max_strm and trimmed on CPU unplug.
+ */
+struct zcomp {
+	const struct zcomp_backend *backend;
+	spinlock_t strm_lock;		/* protects the fields below */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;			/* no. of allocated streams */
+	int max_strm;
+	struct notifier_block cpu_nb;
+};
+
+extern const char *zcomp_default_name;
+
+const struct zcomp_backend *zcomp_find_backend(const char *name);
+ssize_t zcomp_available_show(const struct zcomp_backend *cur, char *buf);
+
+struct zcomp *zcomp_create(const struct zcomp_backend *backend);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+#endif /* _ZCOMP_H_ */
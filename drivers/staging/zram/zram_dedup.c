@@ -0,0 +1,167 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/kernel.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/* One hash bucket for every this many pages of disksize */
+#define ZRAM_DEDUP_PAGES_PER_BUCKET	4
+
+u32 zram_dedup_checksum(const unsigned char *mem)
+{
+	return jhash2((const u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	size_t i, nr_buckets;
+
+	nr_buckets = max_t(size_t, num_pages / ZRAM_DEDUP_PAGES_PER_BUCKET, 1);
+	zram->hash_bits = ilog2(nr_buckets);
+	nr_buckets = 1UL << zram->hash_bits;
+
+	zram->hash = vmalloc(nr_buckets * sizeof(*zram->hash));
+	if (!zram->hash)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_buckets; i++)
+		INIT_HLIST_HEAD(&zram->hash[i]);
+
+	return 0;
+}
+
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->hash);
+	zram->hash = NULL;
+}
+
+static struct hlist_head *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[hash_32(checksum, zram->hash_bits)];
+}
+
+void zram_dedup_free(struct zram *zram, struct zram_entry *entry)
+{
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+}
+
+/*
+ * Looks for a stored object whose content matches the page at @mem.
+ * A checksum match is confirmed by decompressing the candidate into
+ * @buf (PAGE_SIZE bytes). The candidate is pinned so that it stays
+ * around while it is compared without hash_lock held; only the first
+ * candidate with a matching checksum is tried since collisions are rare.
+ *
+ * If the candidate lost its last page meanwhile, it is returned in
+ * @stale for the caller to zram_dedup_free(). zs_free() maps KM_USER0,
+ * which the caller still holds for @mem.
+ *
+ * Returns the entry with a reference taken for the caller, or NULL.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, const unsigned char *mem,
+				   u32 checksum, unsigned char *buf,
+				   struct zram_entry **stale)
+{
+	int ret, match, free;
+	struct hlist_node *pos;
+	struct zram_entry *entry, *found = NULL;
+	unsigned char *cmem;
+
+	spin_lock(&zram->hash_lock);
+	hlist_for_each_entry(entry, pos, zram_dedup_bucket(zram, checksum),
+			     node) {
+		if (entry->checksum == checksum) {
+			entry->pins++;
+			found = entry;
+			break;
+		}
+	}
+	spin_unlock(&zram->hash_lock);
+
+	if (!found)
+		return NULL;
+
+	cmem = zs_map_object(zram->mem_pool, found->handle, ZS_MM_RO);
+	ret = zram->comp->backend->decompress(cmem, found->len, buf);
+	zs_unmap_object(zram->mem_pool, found->handle);
+	match = !ret && !memcmp(mem, buf, PAGE_SIZE);
+
+	spin_lock(&zram->hash_lock);
+	found->pins--;
+	/* The last page using the object may have gone meanwhile */
+	if (match && found->refcount)
+		found->refcount++;
+	else
+		match = 0;
+	free = !found->refcount && !found->pins;
+	spin_unlock(&zram->hash_lock);
+
+	if (free)
+		*stale = found;
+
+	return match ? found : NULL;
+}
+
+/* Makes a newly stored object visible to zram_dedup_find() */
+void zram_dedup_insert(struct zram *zram, struct zram_entry *entry,
+		       unsigned long handle, u16 len, u32 checksum)
+{
+	entry->handle = handle;
+	entry->len = len;
+	entry->checksum = checksum;
+	entry->pins = 0;
+	entry->refcount = 1;
+
+	spin_lock(&zram->hash_lock);
+	hlist_add_head(&entry->node, zram_dedup_bucket(zram, checksum));
+	spin_unlock(&zram->hash_lock);
+}
+
+/*
+ * Drops a page's reference to @entry. Returns 1 once the last page is
+ * gone, in which case the object and the entry are freed, or left to
+ * the zram_dedup_find() still comparing against them.
+ */
+int zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	u32 refcount;
+	int free;
+
+	spin_lock(&zram->hash_lock);
+	refcount = --entry->refcount;
+	if (!refcount)
+		hlist_del(&entry->node);
+	free = !refcount && !entry->pins;
+	spin_unlock(&zram->hash_lock);
+
+	if (refcount)
+		return 0;
+
+	if (free)
+		zram_dedup_free(zram, entry);
+	return 1;
+}
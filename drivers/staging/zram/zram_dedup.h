@@ -0,0 +1,47 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/types.h>
+#include <linux/list.h>
+
+struct zram;
+
+/*
+ * A compressed object shared by all pages with identical content.
+ * Pages point to it with the ZRAM_DEDUP flag set.
+ */
+struct zram_entry {
+	struct hlist_node node;	/* in zram->hash */
+	unsigned long handle;	/* zsmalloc object */
+	u32 checksum;		/* of the uncompressed page */
+	u16 len;		/* compressed size */
+	u16 pins;		/* no. of zram_dedup_find() comparing */
+	u32 refcount;		/* no. of pages using this object */
+};
+
+u32 zram_dedup_checksum(const unsigned char *mem);
+int zram_dedup_init(struct zram *zram, size_t num_pages);
+void zram_dedup_fini(struct zram *zram);
+struct zram_entry *zram_dedup_find(struct zram *zram, const unsigned char *mem,
+				   u32 checksum, unsigned char *buf,
+				   struct zram_entry **stale);
+void zram_dedup_free(struct zram *zram, struct zram_entry *entry);
+void zram_dedup_insert(struct zram *zram, struct zram_entry *entry,
+		       unsigned long handle, u16 len, u32 checksum);
+int zram_dedup_put(struct zram *zram, struct zram_entry *entry);
+
+#endif
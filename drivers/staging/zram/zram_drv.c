@@ -25,58 +25,17 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/ktime.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
-#if defined(CONFIG_ZRAM_LZO)
-#include <linux/lzo.h>
-#define WMSIZE		LZO1X_MEM_COMPRESS
-#define COMPRESS(s, sl, d, dl, wm)	\
-	lzo1x_1_compress(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	lzo1x_decompress_safe(s, sl, d, dl)
-#elif defined(CONFIG_ZRAM_SNAPPY)
-#include "../snappy/csnappy.h" /* if built in drivers/staging */
-#define WMSIZE_ORDER	((PAGE_SHIFT > 14) ? (15) : (PAGE_SHIFT+1))
-#define WMSIZE		(1 << WMSIZE_ORDER)
-static int
-snappy_compress_(
-	const unsigned char *src,
-	size_t src_len,
-	unsigned char *dst,
-	size_t *dst_len,
-	void *workmem)
-{
-	const unsigned char *end = csnappy_compress_fragment(
-		src, (uint32_t)src_len, dst, workmem, WMSIZE_ORDER);
-	*dst_len = end - dst;
-	return 0;
-}
-static int
-snappy_decompress_(
-	const unsigned char *src,
-	size_t src_len,
-	unsigned char *dst,
-	size_t *dst_len)
-{
-	uint32_t dst_len_ = (uint32_t)*dst_len;
-	int ret = csnappy_decompress_noheader(src, src_len, dst, &dst_len_);
-	*dst_len = (size_t)dst_len_;
-	return ret;
-}
-#define COMPRESS(s, sl, d, dl, wm)	\
-	snappy_compress_(s, sl, d, dl, wm)
-#define DECOMPRESS(s, sl, d, dl)	\
-	snappy_decompress_(s, sl, d, dl)
-#else
-#error either CONFIG_ZRAM_LZO or CONFIG_ZRAM_SNAPPY must be defined
-#endif
-
 
 /* Globals */
 static int zram_major;
@@ -132,21 +91,62 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned int len, unsigned long element)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	page = (unsigned long *)ptr;
+
+	for (pos = 0; pos != len / sizeof(*page); pos++)
+		page[pos] = element;
+}
+
+static int zram_compress(struct zram *zram, struct zcomp_strm *zstrm,
+			 const unsigned char *src, size_t *dst_len)
+{
+	int ret;
+	ktime_t start = ktime_get();
+
+	ret = zram->comp->backend->compress(src, zstrm->buffer, dst_len,
+			zstrm->private);
+
+	zram_stat64_add(zram, &zram->stats.compress_time,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+	zram_stat64_inc(zram, &zram->stats.num_compress);
+	return ret;
+}
+
+static int zram_decompress(struct zram *zram, const unsigned char *src,
+			   size_t src_len, unsigned char *dst)
+{
+	int ret;
+	ktime_t start = ktime_get();
+
+	ret = zram->comp->backend->decompress(src, src_len, dst);
+
+	zram_stat64_add(zram, &zram->stats.decompress_time,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+	zram_stat64_inc(zram, &zram->stats.num_decompress);
+	return ret;
+}
+
 static u64 zram_default_disksize_bytes(void)
 {
 #if 0
@@ -162,15 +162,112 @@ static void zram_set_disksize(struct zram *zram, u64 size_bytes)
 	set_capacity(zram->disk, size_bytes >> SECTOR_SHIFT);
 }
 
+static unsigned long zram_get_handle(struct zram *zram, u32 index)
+{
+	if (zram_test_flag(zram, index, ZRAM_DEDUP))
+		return zram->table[index].entry->handle;
+
+	return zram->table[index].handle;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static u32 zram_now(void)
+{
+	struct timespec ts;
+
+	ktime_get_ts(&ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Reads call this with zram->lock only held for reading. ac_time is a
+ * whole word of its own, so racing readers just store the same second;
+ * it is only looked at by zram_writeback() with the lock held for
+ * writing.
+ */
+static void zram_touch(struct zram *zram, u32 index)
+{
+	ACCESS_ONCE(zram->table[index].ac_time) = zram_now();
+}
+
+static unsigned long zram_alloc_bdev_block(struct zram *zram)
+{
+	unsigned long blk_idx;
+
+retry:
+	/* Block 0 is never used so that a valid blk_idx is never 0 */
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->bdev_pages, 1);
+	if (blk_idx >= zram->bdev_pages)
+		return 0;
+
+	if (test_and_set_bit(blk_idx, zram->bitmap))
+		goto retry;
+
+	return blk_idx;
+}
+
+/* A read from the backing device in flight, on zram->bd_reads */
+struct zram_bd_read {
+	struct list_head node;
+	struct zram *zram;
+	struct zram_bio_ctx *ctx;
+	unsigned long blk_idx;
+	int stale;		/* the block was freed meanwhile */
+};
+
+/*
+ * zram->lock is dropped once a read is submitted, not when it completes,
+ * so the page may be freed while its block is still being read. Such a
+ * block stays allocated and is freed when the last read of it is done.
+ */
+static void zram_free_bdev_block(struct zram *zram, unsigned long blk_idx)
+{
+	int busy = 0;
+	unsigned long flags;
+	struct zram_bd_read *rd;
+
+	spin_lock_irqsave(&zram->bd_read_lock, flags);
+	list_for_each_entry(rd, &zram->bd_reads, node) {
+		if (rd->blk_idx == blk_idx) {
+			rd->stale = 1;
+			busy = 1;
+		}
+	}
+	spin_unlock_irqrestore(&zram->bd_read_lock, flags);
+
+	if (!busy)
+		WARN_ON(!test_and_clear_bit(blk_idx, zram->bitmap));
+}
+#else
+static inline void zram_touch(struct zram *zram, u32 index) { }
+#endif
+
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
+
+	/* Tells a pending writeback that the page has changed */
+	zram_clear_flag(zram, index, ZRAM_WB_PENDING);
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_free_bdev_block(zram, zram->table[index].blk_idx);
+		zram_stat_dec(&zram->stats.bd_count);
+		zram->table[index].blk_idx = 0;
+		return;
+	}
+#endif
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
+		return;
+	}
 
-	if (unlikely(!page)) {
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -184,17 +281,24 @@ static void zram_free_page(struct zram *zram, size_t index)
 
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(zram->table[index].page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram->table[index].size;
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		if (!zram_dedup_put(zram, zram->table[index].entry)) {
+			/* Other pages still use the object */
+			zram_stat_dec(&zram->stats.pages_dup);
+			zram_stat_dec(&zram->stats.pages_stored);
+			goto out_clear;
+		}
+	} else {
+		zs_free(zram->mem_pool, handle);
+	}
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -202,8 +306,9 @@ out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+out_clear:
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
 static void handle_zero_page(struct bio_vec *bvec)
@@ -218,6 +323,18 @@ static void handle_zero_page(struct bio_vec *bvec)
 	flush_dcache_page(page);
 }
 
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
+{
+	struct page *page = bvec->bv_page;
+	void *user_mem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	flush_dcache_page(page);
+}
+
 static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
 				     u32 index, int offset)
 {
@@ -239,13 +356,201 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
+/*
+ * Reads from the backing device complete asynchronously; the original
+ * bio is ended once all of them are done.
+ */
+struct zram_bio_ctx {
+	struct bio *bio;
+	atomic_t pending;
+	int error;
+};
+
+static void zram_bio_ctx_put(struct zram_bio_ctx *ctx)
+{
+	if (!atomic_dec_and_test(&ctx->pending))
+		return;
+
+	if (ctx->error) {
+		bio_io_error(ctx->bio);
+	} else {
+		set_bit(BIO_UPTODATE, &ctx->bio->bi_flags);
+		bio_endio(ctx->bio, 0);
+	}
+	kfree(ctx);
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static void zram_bdev_read_end_io(struct bio *bio, int err)
+{
+	struct zram_bd_read *other, *rd = bio->bi_private;
+	struct zram *zram = rd->zram;
+	unsigned long flags;
+	int free;
+
+	if (err || !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		rd->ctx->error = -EIO;
+	else
+		flush_dcache_page(bio->bi_io_vec[0].bv_page);
+
+	spin_lock_irqsave(&zram->bd_read_lock, flags);
+	list_del(&rd->node);
+	free = rd->stale;
+	list_for_each_entry(other, &zram->bd_reads, node) {
+		if (other->blk_idx == rd->blk_idx)
+			free = 0;
+	}
+	spin_unlock_irqrestore(&zram->bd_read_lock, flags);
+
+	if (free)
+		WARN_ON(!test_and_clear_bit(rd->blk_idx, zram->bitmap));
+
+	bio_put(bio);
+	zram_bio_ctx_put(rd->ctx);
+	kfree(rd);
+}
+
+/*
+ * We are called from within generic_make_request(), which only submits
+ * the bios we issue after we return, so the read must not be waited
+ * for here.
+ */
+static int zram_read_from_bdev_async(struct zram *zram, struct bio_vec *bvec,
+				     u32 index, int offset, struct bio *parent,
+				     struct zram_bio_ctx **ctxp)
+{
+	struct bio *bio;
+	struct zram_bd_read *rd;
+	unsigned long flags;
+	struct zram_bio_ctx *ctx = *ctxp;
+
+	if (!ctx) {
+		ctx = kmalloc(sizeof(*ctx), GFP_NOIO);
+		if (!ctx)
+			return -ENOMEM;
+		ctx->bio = parent;
+		atomic_set(&ctx->pending, 1);
+		ctx->error = 0;
+		*ctxp = ctx;
+	}
+
+	rd = kmalloc(sizeof(*rd), GFP_NOIO);
+	if (!rd)
+		return -ENOMEM;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio) {
+		kfree(rd);
+		return -ENOMEM;
+	}
+
+	rd->zram = zram;
+	rd->ctx = ctx;
+	rd->blk_idx = zram->table[index].blk_idx;
+	rd->stale = 0;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = rd->blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_sector += offset >> SECTOR_SHIFT;
+	bio_add_page(bio, bvec->bv_page, bvec->bv_len, bvec->bv_offset);
+	bio->bi_end_io = zram_bdev_read_end_io;
+	bio->bi_private = rd;
+
+	/* Pins the block, see zram_free_bdev_block() */
+	spin_lock_irqsave(&zram->bd_read_lock, flags);
+	list_add(&rd->node, &zram->bd_reads);
+	spin_unlock_irqrestore(&zram->bd_read_lock, flags);
+
+	atomic_inc(&ctx->pending);
+	submit_bio(READ, bio);
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+	return 0;
+}
+
+static void zram_bdev_sync_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int zram_bdev_rw_sync(struct zram *zram, struct page *page,
+			     unsigned long blk_idx, int rw)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+	bio->bi_end_io = zram_bdev_sync_end_io;
+	bio->bi_private = &done;
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_read_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int ret;
+};
+
+static void zram_read_work_fn(struct work_struct *work)
+{
+	struct zram_read_work *rw;
+
+	rw = container_of(work, struct zram_read_work, work);
+	rw->ret = zram_bdev_rw_sync(rw->zram, rw->page, rw->blk_idx, READ);
+}
+
+/*
+ * Partial writes need the old page contents right away. Waiting for
+ * our own bio would deadlock in generic_make_request(), so have a
+ * worker do the read. It has a queue of its own: we hold zram->lock
+ * here, and free_work, which waits for that lock, runs on keventd.
+ */
+static int zram_read_from_bdev_sync(struct zram *zram, char *mem, u32 index)
+{
+	struct zram_read_work rw;
+
+	rw.page = alloc_page(GFP_NOIO);
+	if (!rw.page)
+		return -ENOMEM;
+
+	rw.zram = zram;
+	rw.blk_idx = zram->table[index].blk_idx;
+	INIT_WORK(&rw.work, zram_read_work_fn);
+	queue_work(zram->bd_read_wq, &rw.work);
+	flush_work(&rw.work);
+
+	if (!rw.ret)
+		memcpy(mem, page_address(rw.page), PAGE_SIZE);
+	__free_page(rw.page);
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+	return rw.ret;
+}
+#endif
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
-			  u32 index, int offset, struct bio *bio)
+			  u32 index, int offset, struct bio *bio,
+			  struct zram_bio_ctx **ctx)
 {
 	int ret;
-	size_t clen;
+	unsigned long handle;
 	struct page *page;
-	struct zobj_header *zheader;
 	unsigned char *user_mem, *cmem, *uncmem = NULL;
 
 	page = bvec->bv_page;
@@ -255,14 +560,27 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		return 0;
 	}
 
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		handle_same_page(bvec, zram->table[index].element);
+		return 0;
+	}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram_test_flag(zram, index, ZRAM_WB))
+		return zram_read_from_bdev_async(zram, bvec, index, offset,
+						 bio, ctx);
+#endif
+
 	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
+	if (unlikely(!zram->table[index].handle)) {
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
 		handle_zero_page(bvec);
 		return 0;
 	}
 
+	zram_touch(zram, index);
+
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		handle_uncompressed_page(zram, bvec, index, offset);
@@ -281,15 +599,11 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	handle = zram_get_handle(zram, index);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 
-	ret = DECOMPRESS(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			uncmem, &clen);
+	ret = zram_decompress(zram, cmem, zram->table[index].size, uncmem);
 
 	if (is_partial_io(bvec)) {
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
@@ -297,7 +611,7 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		kfree(uncmem);
 	}
 
-	kunmap_atomic(cmem, KM_USER1);
+	zs_unmap_object(zram->mem_pool, handle);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	/* Should NEVER happen. Return bio error if it does. */
@@ -315,30 +629,38 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 {
 	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
+	unsigned long handle;
 	unsigned char *cmem;
 
 	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
+	    !zram->table[index].handle) {
 		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_fill_page(mem, PAGE_SIZE, zram->table[index].element);
+		return 0;
+	}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram_test_flag(zram, index, ZRAM_WB))
+		return zram_read_from_bdev_sync(zram, mem, index);
+#endif
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic(zram->table[index].page, KM_USER0);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem, KM_USER0);
 		return 0;
 	}
 
-	ret = DECOMPRESS(cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
+	handle = zram_get_handle(zram, index);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	ret = zram_decompress(zram, cmem, zram->table[index].size,
+			(unsigned char *)mem);
+	zs_unmap_object(zram->mem_pool, handle);
 
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret)) {
@@ -350,18 +672,66 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 	return 0;
 }
 
+/*
+ * Carries out the frees queued by zram_slot_free_notify(). Called with
+ * zram->lock held for writing before a page is stored, so a queued free
+ * never hits a slot that swap has already reused.
+ */
+static void zram_free_pending(struct zram *zram)
+{
+	struct zram_slot_free *free_rq;
+
+	spin_lock(&zram->slot_free_lock);
+	while (zram->slot_free_rq) {
+		free_rq = zram->slot_free_rq;
+		zram->slot_free_rq = free_rq->next;
+		zram_free_page(zram, free_rq->index);
+		kfree(free_rq);
+	}
+	spin_unlock(&zram->slot_free_lock);
+}
+
+static void zram_free_work_fn(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, free_work);
+
+	down_write(&zram->lock);
+	zram_free_pending(zram);
+	up_write(&zram->lock);
+}
+
+/*
+ * zram->lock is taken for writing to store the page and held until
+ * zram_bvec_write() returns. A partial write is a read-modify-write of
+ * the stored page, so it takes the lock before reading the old contents;
+ * otherwise of two concurrent partial writes to one page, one could be
+ * lost. The compression stream is always taken first, as writers holding
+ * a stream wait for the lock.
+ */
+static void zram_store_lock(struct zram *zram, int *locked)
+{
+	if (!*locked) {
+		down_write(&zram->lock);
+		zram_free_pending(zram);
+		*locked = 1;
+	}
+}
+
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
+	int locked = 0;
 	size_t clen;
-	struct zobj_header *zheader;
+	u32 checksum = 0;
+	unsigned long handle, element;
+	struct zcomp_strm *zstrm = NULL;
+	struct zram_entry *entry = NULL;
+	struct zram_entry *stale = NULL;
 	struct page *page, *page_store;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -374,6 +744,17 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			ret = -ENOMEM;
 			goto out;
 		}
+	}
+
+	/*
+	 * Compression only needs a stream of its own, so writers to
+	 * different pages run in parallel up to the number of CPUs.
+	 */
+	zstrm = zcomp_strm_find(zram->comp);
+	src = zstrm->buffer;
+
+	if (is_partial_io(bvec)) {
+		zram_store_lock(zram, &locked);
 		ret = zram_read_before_write(zram, uncmem, index);
 		if (ret) {
 			kfree(uncmem);
@@ -381,14 +762,6 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
 	user_mem = kmap_atomic(page, KM_USER0);
 
 	if (is_partial_io(bvec))
@@ -397,29 +770,93 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	else
 		uncmem = user_mem;
 
-	if (page_zero_filled(uncmem)) {
+	/*
+	 * Pages filled with one repeating word (zeroes, or e.g. 0xffffffff
+	 * fills from Java heaps) need neither compression nor an object.
+	 */
+	if (page_same_filled(uncmem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
 		if (is_partial_io(bvec))
 			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
+
+		zram_store_lock(zram, &locked);
+		if (zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_ZERO))
+			zram_free_page(zram, index);
+		if (!element) {
+			zram_stat_inc(&zram->stats.pages_zero);
+			zram_set_flag(zram, index, ZRAM_ZERO);
+		} else {
+			zram_stat_inc(&zram->stats.pages_same);
+			zram_set_flag(zram, index, ZRAM_SAME);
+			zram->table[index].element = element;
+		}
 		ret = 0;
 		goto out;
 	}
 
-	COMPRESS(uncmem, PAGE_SIZE, src, &clen,
-		zram->compress_workmem);
-	ret = 0;
+	/*
+	 * With dedup on, a page identical to one already stored just
+	 * takes another reference to its object. The stream buffer is
+	 * free at this point and serves to verify the match.
+	 */
+	if (zram->hash) {
+		checksum = zram_dedup_checksum(uncmem);
+		entry = zram_dedup_find(zram, uncmem, checksum, src, &stale);
+		if (entry) {
+			kunmap_atomic(user_mem, KM_USER0);
+			if (is_partial_io(bvec))
+				kfree(uncmem);
+
+			zram_store_lock(zram, &locked);
+			if (zram->table[index].handle ||
+			    zram_test_flag(zram, index, ZRAM_ZERO))
+				zram_free_page(zram, index);
+			zram_set_flag(zram, index, ZRAM_DEDUP);
+			zram->table[index].entry = entry;
+			zram->table[index].size = entry->len;
+			zram_stat_inc(&zram->stats.pages_stored);
+			zram_stat_inc(&zram->stats.pages_dup);
+			zram_touch(zram, index);
+			ret = 0;
+			goto out;
+		}
+	}
+
+	ret = zram_compress(zram, zstrm, uncmem, &clen);
+
+	/*
+	 * Keep a copy of incompressible pages in the stream buffer so
+	 * that the page can be stored after dropping the atomic mapping.
+	 */
+	if (!ret && unlikely(clen > max_zpage_size))
+		memcpy(src, uncmem, PAGE_SIZE);
 
 	kunmap_atomic(user_mem, KM_USER0);
 	if (is_partial_io(bvec))
 			kfree(uncmem);
+	if (stale)
+		zram_dedup_free(zram, stale);
 
 	if (unlikely(ret != 0)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
 
+	/* Dedup is best effort; store the page unshared if this fails */
+	if (zram->hash && clen <= max_zpage_size)
+		entry = kmalloc(sizeof(*entry), GFP_NOIO);
+
+	zram_store_lock(zram, &locked);
+
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	if (zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_ZERO))
+		zram_free_page(zram, index);
+
 	/*
 	 * Page is incompressible. Store it as-is (uncompressed)
 	 * since we do not want to return too many disk write
@@ -435,43 +872,39 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 
-		store_offset = 0;
 		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_inc(&zram->stats.pages_expand);
 		zram->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
+
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, src, clen);
+		kunmap_atomic(cmem, KM_USER1);
 		goto memstore;
 	}
 
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
+	handle = zs_malloc(zram->mem_pool, clen, GFP_NOIO | __GFP_HIGHMEM);
+	if (unlikely(!handle)) {
 		pr_info("Error allocating memory for compressed "
 			"page: %u, size=%zu\n", index, clen);
+		kfree(entry);
 		ret = -ENOMEM;
 		goto out;
 	}
 
-memstore:
-	zram->table[index].offset = store_offset;
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+	memcpy(cmem, src, clen);
+	zs_unmap_object(zram->mem_pool, handle);
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
+	if (entry) {
+		zram_dedup_insert(zram, entry, handle, clen, checksum);
+		zram_set_flag(zram, index, ZRAM_DEDUP);
+		zram->table[index].entry = entry;
+	} else {
+		zram->table[index].handle = handle;
 	}
-#endif
 
-	memcpy(cmem, src, clen);
-
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+memstore:
+	zram->table[index].size = clen;
 
 	/* Update stats */
 	zram_stat64_add(zram, &zram->stats.compr_size, clen);
@@ -479,27 +912,139 @@ memstore:
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
 
+	zram_touch(zram, index);
+	up_write(&zram->lock);
+	zcomp_strm_release(zram->comp, zstrm);
+
 	return 0;
 
 out:
+	if (locked)
+		up_write(&zram->lock);
+	if (zstrm)
+		zcomp_strm_release(zram->comp, zstrm);
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
 	return ret;
 }
 
+/*
+ * Moves objects around to free zsmalloc pages.
+ * Called with init_lock held for reading.
+ */
+void zram_compact(struct zram *zram)
+{
+	zram_stat64_add(zram, &zram->stats.pages_compacted,
+			zs_compact(zram->mem_pool));
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static int zram_wb_eligible(struct zram *zram, u32 index,
+			    enum zram_wb_mode mode, u32 now)
+{
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_ZERO) ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_WB_PENDING))
+		return 0;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	return now - zram->table[index].ac_time >= zram->idle_age;
+}
+
+/*
+ * Moves pages selected by @mode to the backing device and frees their
+ * memory. The write is done without zram->lock held; the page is
+ * flagged ZRAM_WB_PENDING meanwhile and zram_free_page() clears the
+ * flag, so a page that was overwritten or discarded is left alone.
+ *
+ * Returns the number of pages written, or an error if none could be.
+ * Called with init_lock held for reading.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int ret = 0, nr_written = 0;
+	u32 now = zram_now();
+	size_t index, num_pages;
+	unsigned long blk_idx;
+	struct page *page;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	num_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < num_pages; index++) {
+		down_write(&zram->lock);
+		zram_free_pending(zram);
+		if (!zram_wb_eligible(zram, index, mode, now)) {
+			up_write(&zram->lock);
+			continue;
+		}
+
+		blk_idx = zram_alloc_bdev_block(zram);
+		if (!blk_idx) {
+			up_write(&zram->lock);
+			ret = -ENOSPC;
+			break;
+		}
+
+		ret = zram_read_before_write(zram, page_address(page), index);
+		if (ret) {
+			up_write(&zram->lock);
+			zram_free_bdev_block(zram, blk_idx);
+			break;
+		}
+		zram_set_flag(zram, index, ZRAM_WB_PENDING);
+		up_write(&zram->lock);
+
+		ret = zram_bdev_rw_sync(zram, page, blk_idx, WRITE);
+
+		down_write(&zram->lock);
+		if (ret || !zram_test_flag(zram, index, ZRAM_WB_PENDING)) {
+			zram_clear_flag(zram, index, ZRAM_WB_PENDING);
+			up_write(&zram->lock);
+			zram_free_bdev_block(zram, blk_idx);
+			if (ret)
+				break;
+			continue;
+		}
+
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram->table[index].blk_idx = blk_idx;
+		zram_stat_inc(&zram->stats.bd_count);
+		up_write(&zram->lock);
+
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+		nr_written++;
+		cond_resched();
+	}
+
+	__free_page(page);
+
+	return nr_written ? nr_written : ret;
+}
+#endif
+
 static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
-			int offset, struct bio *bio, int rw)
+			int offset, struct bio *bio, int rw,
+			struct zram_bio_ctx **ctx)
 {
 	int ret;
 
 	if (rw == READ) {
 		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
+		ret = zram_bvec_read(zram, bvec, index, offset, bio, ctx);
 		up_read(&zram->lock);
 	} else {
-		down_write(&zram->lock);
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
 	}
 
 	return ret;
@@ -517,6 +1062,7 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 	int i, offset;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_bio_ctx *ctx = NULL;
 
 	switch (rw) {
 	case READ:
@@ -544,26 +1090,39 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 			bv.bv_len = max_transfer_size;
 			bv.bv_offset = bvec->bv_offset;
 
-			if (zram_bvec_rw(zram, &bv, index, offset, bio, rw) < 0)
+			if (zram_bvec_rw(zram, &bv, index, offset, bio, rw,
+					 &ctx) < 0)
 				goto out;
 
 			bv.bv_len = bvec->bv_len - max_transfer_size;
 			bv.bv_offset += max_transfer_size;
-			if (zram_bvec_rw(zram, &bv, index+1, 0, bio, rw) < 0)
+			if (zram_bvec_rw(zram, &bv, index+1, 0, bio, rw,
+					 &ctx) < 0)
 				goto out;
 		} else
-			if (zram_bvec_rw(zram, bvec, index, offset, bio, rw)
-			    < 0)
+			if (zram_bvec_rw(zram, bvec, index, offset, bio, rw,
+					 &ctx) < 0)
 				goto out;
 
 		update_position(&index, &offset, bvec);
 	}
 
+	/* Some pages are still being read from the backing device */
+	if (ctx) {
+		zram_bio_ctx_put(ctx);
+		return;
+	}
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return;
 
 out:
+	if (ctx) {
+		ctx->error = -EIO;
+		zram_bio_ctx_put(ctx);
+		return;
+	}
 	bio_io_error(bio);
 }
 
@@ -614,40 +1173,123 @@ error:
 	return 0;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Opens the block device at @name as backing device. Called with
+ * init_lock held for writing, before the device is initialized.
+ */
+int zram_set_bdev(struct zram *zram, const char *name)
+{
+	int ret;
+	char *bdev_name;
+	unsigned long nr_pages, *bitmap;
+	struct block_device *bdev;
+
+	bdev_name = kstrdup(name, GFP_KERNEL);
+	if (!bdev_name)
+		return -ENOMEM;
+
+	bdev = open_bdev_exclusive(bdev_name, FMODE_READ | FMODE_WRITE, zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out_free_name;
+	}
+
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		ret = -EINVAL;
+		goto out_close;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto out_close;
+	}
+
+	zram_reset_bdev(zram);
+	zram->bdev = bdev;
+	zram->bdev_name = bdev_name;
+	zram->bdev_pages = nr_pages;
+	zram->bitmap = bitmap;
+
+	pr_info("Using %s (%lu pages) as backing device\n",
+		bdev_name, nr_pages);
+	return 0;
+
+out_close:
+	close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+out_free_name:
+	kfree(bdev_name);
+	return ret;
+}
+
+void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	close_bdev_exclusive(zram->bdev, FMODE_READ | FMODE_WRITE);
+	vfree(zram->bitmap);
+	kfree(zram->bdev_name);
+
+	zram->bdev = NULL;
+	zram->bdev_name = NULL;
+	zram->bdev_pages = 0;
+	zram->bitmap = NULL;
+}
+#endif
+
 void __zram_reset_device(struct zram *zram)
 {
 	size_t index;
 
-	zram->init_done = 0;
+	/* Queued frees would otherwise run against the freed table */
+	flush_work(&zram->free_work);
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	zram->init_done = 0;
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free the compression streams */
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+		unsigned long handle = zram->table[index].handle;
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
+		if (!handle || zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page(zram->table[index].page);
+		else if (zram_test_flag(zram, index, ZRAM_DEDUP))
+			zram_dedup_put(zram, zram->table[index].entry);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zs_free(zram->mem_pool, handle);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram->bd_read_wq)
+		destroy_workqueue(zram->bd_read_wq);
+	zram->bd_read_wq = NULL;
+#endif
+
+	zram_dedup_fini(zram);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* The backing device stays attached, but all its blocks are free */
+	if (zram->bitmap)
+		memset(zram->bitmap, 0,
+		       BITS_TO_LONGS(zram->bdev_pages) * sizeof(long));
+#endif
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -675,17 +1317,9 @@ int zram_init_device(struct zram *zram)
 		return 0;
 	}
 
-	zram->compress_workmem = kzalloc(WMSIZE, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zcomp_create(zram->comp_backend);
+	if (!zram->comp) {
+		pr_err("Error allocating compression streams!\n");
 		ret = -ENOMEM;
 		goto fail_no_table;
 	}
@@ -698,16 +1332,33 @@ int zram_init_device(struct zram *zram)
 		goto fail_no_table;
 	}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram->bd_read_wq = create_singlethread_workqueue("zram_bd_read");
+	if (!zram->bd_read_wq) {
+		pr_err("Error creating backing device read workqueue\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+#endif
+
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
+	if (zram->use_dedup) {
+		ret = zram_dedup_init(zram, num_pages);
+		if (ret) {
+			pr_err("Error allocating dedup hash table\n");
+			goto fail;
+		}
+	}
+
 	zram->init_done = 1;
 	up_write(&zram->init_lock);
 
@@ -725,14 +1376,32 @@ fail:
 	return ret;
 }
 
+/*
+ * Swap calls this with swap_lock held, so zram->lock cannot be taken
+ * here. The free is queued for zram_free_pending() instead, which runs
+ * with the lock held from free_work or from the next write.
+ */
 static void zram_slot_free_notify(struct block_device *bdev,
 				unsigned long index)
 {
 	struct zram *zram;
+	struct zram_slot_free *free_rq;
 
 	zram = bdev->bd_disk->private_data;
-	zram_free_page(zram, index);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
+
+	/* If this fails, the page stays until swap reuses the slot */
+	free_rq = kmalloc(sizeof(*free_rq), GFP_ATOMIC | __GFP_NOWARN);
+	if (!free_rq)
+		return;
+
+	free_rq->index = index;
+	spin_lock(&zram->slot_free_lock);
+	free_rq->next = zram->slot_free_rq;
+	zram->slot_free_rq = free_rq;
+	spin_unlock(&zram->slot_free_lock);
+
+	schedule_work(&zram->free_work);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -747,6 +1416,21 @@ static int create_device(struct zram *zram, int device_id)
 	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->hash_lock);
+	spin_lock_init(&zram->slot_free_lock);
+	INIT_WORK(&zram->free_work, zram_free_work_fn);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram->idle_age = default_idle_age;
+	spin_lock_init(&zram->bd_read_lock);
+	INIT_LIST_HEAD(&zram->bd_reads);
+#endif
+
+	zram->comp_backend = zcomp_find_backend(zcomp_default_name);
+	if (!zram->comp_backend) {
+		pr_err("Unknown default compressor: %s\n", zcomp_default_name);
+		ret = -EINVAL;
+		goto out;
+	}
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -886,6 +1570,9 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+		zram_reset_bdev(zram);
+#endif
 	}
 
 	unregister_blkdev(zram_major, "zram");
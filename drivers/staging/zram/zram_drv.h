@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/workqueue.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
+#include "zcomp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +29,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -49,10 +40,15 @@ static const unsigned default_disksize_perc_ram = CONFIG_ZRAM_DEFAULT_PERCENTAGE
  */
 static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Pages not accessed for this long (secs) are written back by "idle" */
+static const unsigned default_idle_age = 3600;
+#endif
+
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -74,6 +70,18 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is one machine word repeated; only the word is kept */
+	ZRAM_SAME,
+
+	/* Page shares a compressed object with identical pages */
+	ZRAM_DEDUP,
+
+	/* Page lives on the backing device */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_WB_PENDING,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -81,10 +89,19 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		unsigned long handle;	/* zsmalloc object */
+		struct page *page;	/* ZRAM_UNCOMPRESSED pages */
+		unsigned long element;	/* ZRAM_SAME pages */
+		struct zram_entry *entry; /* ZRAM_DEDUP pages */
+		unsigned long blk_idx;	/* ZRAM_WB pages */
+	};
+	u16 size;	/* object size (excluding header) */
 	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
+	u8 flags;	/* changed only with zram->lock held for writing */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	u32 ac_time;	/* last access, in seconds since boot */
+#endif
 } __attribute__((aligned(4)));
 
 struct zram_stats {
@@ -95,31 +112,72 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 pages_compacted;	/* no. of pages freed by compaction */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of other same-filled pages */
+	u32 pages_dup;		/* no. of pages sharing another's object */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	/* per-backend cost, to compare compression algorithms */
+	u64 num_compress;	/* no. of compress calls */
+	u64 num_decompress;	/* no. of decompress calls */
+	u64 compress_time;	/* total time spent compressing (ns) */
+	u64 decompress_time;	/* total time spent decompressing (ns) */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	u32 bd_count;		/* no. of pages on the backing device */
+	u64 bd_reads;		/* no. of pages read from it */
+	u64 bd_writes;		/* no. of pages written to it */
+#endif
+};
+
+/* A swap slot free, deferred until zram->lock can be taken */
+struct zram_slot_free {
+	unsigned long index;
+	struct zram_slot_free *next;
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	const struct zcomp_backend *comp_backend; /* selected via sysfs */
+	struct zcomp *comp;	/* compression streams, set up on init */
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	struct rw_semaphore lock; /* protect mem_pool and table against
+				   * concurrent read and writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
 	/* Prevent concurrent execution of device init and reset */
 	struct rw_semaphore init_lock;
+	/* Frees queued by zram_slot_free_notify(), done by free_work */
+	spinlock_t slot_free_lock;
+	struct zram_slot_free *slot_free_rq;
+	struct work_struct free_work;
 	/*
 	 * This is the limit on amount of *uncompressed* worth of data
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
 
+	/* Content-hash dedup of compressed pages, see zram_dedup.c */
+	int use_dedup;		/* set via sysfs before init */
+	struct hlist_head *hash;
+	unsigned int hash_bits;
+	spinlock_t hash_lock;	/* protects hash, entry refcounts and pins */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Second tier for incompressible and idle pages, set via sysfs */
+	struct block_device *bdev;
+	char *bdev_name;
+	unsigned long bdev_pages;	/* size of bdev in pages */
+	unsigned long *bitmap;		/* blocks in use; block 0 is unused */
+	unsigned int idle_age;		/* secs, see default_idle_age */
+	spinlock_t bd_read_lock;	/* protects bd_reads */
+	/* Reads for partial writes, see zram_read_from_bdev_sync() */
+	struct workqueue_struct *bd_read_wq;
+	struct list_head bd_reads;	/* see zram_free_bdev_block() */
+#endif
+
 	struct zram_stats stats;
 };
 
@@ -131,5 +189,17 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
+extern void zram_compact(struct zram *zram);
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+enum zram_wb_mode {
+	ZRAM_WB_HUGE,	/* incompressible pages */
+	ZRAM_WB_IDLE,	/* pages not accessed for idle_age seconds */
+};
+
+extern int zram_set_bdev(struct zram *zram, const char *name);
+extern void zram_reset_bdev(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+#endif
 
 #endif
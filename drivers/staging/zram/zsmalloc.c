@@ -0,0 +1,701 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/* Handles of all pools come from one cache */
+static struct kmem_cache *zs_handle_cachep;
+static int zs_handle_cache_users;
+static DEFINE_MUTEX(zs_handle_cache_mutex);
+
+static int zs_handle_cache_get(void)
+{
+	int ret = 0;
+
+	mutex_lock(&zs_handle_cache_mutex);
+	if (!zs_handle_cache_users) {
+		zs_handle_cachep = kmem_cache_create("zs_handle",
+					ZS_HANDLE_SIZE, 0, 0, NULL);
+		if (!zs_handle_cachep)
+			ret = -ENOMEM;
+	}
+	if (!ret)
+		zs_handle_cache_users++;
+	mutex_unlock(&zs_handle_cache_mutex);
+
+	return ret;
+}
+
+static void zs_handle_cache_put(void)
+{
+	mutex_lock(&zs_handle_cache_mutex);
+	if (!--zs_handle_cache_users) {
+		kmem_cache_destroy(zs_handle_cachep);
+		zs_handle_cachep = NULL;
+	}
+	mutex_unlock(&zs_handle_cache_mutex);
+}
+
+static int get_size_class_index(size_t size)
+{
+	int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return idx;
+}
+
+/*
+ * Returns the number of pages per zspage that leaves the least unused
+ * space at the end of the zspage for objects of the given size.
+ */
+static int get_pages_per_zspage(int class_size)
+{
+	int i, max_usedpc = 0;
+	int max_usedpc_pages = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size = i * PAGE_SIZE;
+		int waste = zspage_size % class_size;
+		int usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_pages = i;
+		}
+	}
+
+	return max_usedpc_pages;
+}
+
+static unsigned long obj_location(struct zspage *zspage, unsigned int idx)
+{
+	return (page_to_pfn(zspage->pages[0]) << OBJ_INDEX_BITS) | idx;
+}
+
+static struct zspage *location_to_zspage(unsigned long obj, unsigned int *idx)
+{
+	struct page *page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+
+	*idx = obj & OBJ_INDEX_MASK;
+	return (struct zspage *)page_private(page);
+}
+
+/* Returns the page holding byte 'off' of a zspage, and the offset in it */
+static struct page *zspage_page(struct zspage *zspage, unsigned long off,
+				unsigned long *page_off)
+{
+	*page_off = off & ~PAGE_MASK;
+	return zspage->pages[off >> PAGE_SHIFT];
+}
+
+/*
+ * Object headers never straddle pages (see ZS_SIZE_CLASS_DELTA), so
+ * a single mapping is enough to access them.
+ */
+static unsigned long read_obj_header(struct zspage *zspage, unsigned int idx)
+{
+	unsigned long off, val;
+	struct page *page;
+	void *addr;
+
+	page = zspage_page(zspage, (unsigned long)idx * zspage->class->size,
+			&off);
+	addr = kmap_atomic(page, KM_USER0);
+	val = *(unsigned long *)(addr + off);
+	kunmap_atomic(addr, KM_USER0);
+
+	return val;
+}
+
+static void write_obj_header(struct zspage *zspage, unsigned int idx,
+			     unsigned long val)
+{
+	unsigned long off;
+	struct page *page;
+	void *addr;
+
+	page = zspage_page(zspage, (unsigned long)idx * zspage->class->size,
+			&off);
+	addr = kmap_atomic(page, KM_USER0);
+	*(unsigned long *)(addr + off) = val;
+	kunmap_atomic(addr, KM_USER0);
+}
+
+static enum fullness_group get_fullness_group(struct zspage *zspage)
+{
+	u32 inuse = zspage->inuse;
+	u32 max_objects = zspage->class->objs_per_zspage;
+
+	if (inuse == 0)
+		return ZS_EMPTY;
+	if (inuse == max_objects)
+		return ZS_FULL;
+	if (inuse > max_objects * 3 / 4)
+		return ZS_ALMOST_FULL;
+
+	return ZS_ALMOST_EMPTY;
+}
+
+/*
+ * Moves the zspage to the list matching its current fullness. Empty
+ * zspages are taken off all lists; the caller frees them.
+ * Called with class->lock held.
+ */
+static enum fullness_group fix_fullness_group(struct zspage *zspage)
+{
+	enum fullness_group newfg = get_fullness_group(zspage);
+
+	if (newfg == zspage->fullness)
+		return newfg;
+
+	list_del_init(&zspage->list);
+	if (newfg != ZS_EMPTY)
+		list_add(&zspage->list,
+			&zspage->class->fullness_list[newfg]);
+	zspage->fullness = newfg;
+
+	return newfg;
+}
+
+static void free_zspage(struct zspage *zspage)
+{
+	int i;
+
+	for (i = 0; i < ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		struct page *page = zspage->pages[i];
+
+		if (!page)
+			break;
+		set_page_private(page, 0);
+		__free_page(page);
+	}
+	kfree(zspage);
+}
+
+static struct zspage *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	int i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class = class;
+	zspage->fullness = ZS_EMPTY;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		struct page *page = alloc_page(flags);
+
+		if (!page) {
+			free_zspage(zspage);
+			return NULL;
+		}
+		set_page_private(page, (unsigned long)zspage);
+		zspage->pages[i] = page;
+	}
+
+	/* Link all objects into the free list */
+	for (i = 0; i < class->objs_per_zspage; i++) {
+		unsigned long next = 0;
+
+		if (i + 1 < class->objs_per_zspage)
+			next = i + 2;
+		write_obj_header(zspage, i, next << OBJ_TAG_BITS);
+	}
+	zspage->freeobj = 1;
+
+	return zspage;
+}
+
+/* Called with class->lock held */
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	int i;
+
+	for (i = 0; i <= ZS_ALMOST_EMPTY; i++) {
+		struct list_head *head = &class->fullness_list[i];
+
+		if (!list_empty(head))
+			return list_first_entry(head, struct zspage, list);
+	}
+
+	return NULL;
+}
+
+/*
+ * Takes the first free object of the zspage for the given handle.
+ * Called with class->lock held.
+ */
+static unsigned int obj_alloc(struct zspage *zspage, unsigned long *handle)
+{
+	unsigned int idx = zspage->freeobj - 1;
+
+	zspage->freeobj = read_obj_header(zspage, idx) >> OBJ_TAG_BITS;
+	write_obj_header(zspage, idx,
+			(unsigned long)handle | OBJ_ALLOCATED_TAG);
+	zspage->inuse++;
+	*handle = obj_location(zspage, idx);
+
+	return idx;
+}
+
+/* Called with class->lock held */
+static void obj_free(struct zspage *zspage, unsigned int idx)
+{
+	write_obj_header(zspage, idx,
+			(unsigned long)zspage->freeobj << OBJ_TAG_BITS);
+	zspage->freeobj = idx + 1;
+	zspage->inuse--;
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ *
+ * This function must be called before anything when using
+ * the zsmalloc allocator.
+ *
+ * On success, a pointer to the newly created pool is returned,
+ * otherwise NULL.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int j;
+		struct size_class *class = &pool->size_class[i];
+		u32 size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+
+		if (size > ZS_MAX_ALLOC_SIZE)
+			size = ZS_MAX_ALLOC_SIZE;
+
+		spin_lock_init(&class->lock);
+		for (j = 0; j < _ZS_NR_FULLNESS_GROUPS; j++)
+			INIT_LIST_HEAD(&class->fullness_list[j]);
+		class->size = size;
+		class->pages_per_zspage = get_pages_per_zspage(size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					PAGE_SIZE / size;
+	}
+
+	rwlock_init(&pool->migrate_lock);
+	atomic_set(&pool->pages_allocated, 0);
+
+	if (zs_handle_cache_get()) {
+		kfree(pool);
+		return NULL;
+	}
+
+	pool->area = alloc_percpu(struct zs_map_area);
+	if (!pool->area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, cpu;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int fg;
+		struct size_class *class = &pool->size_class[i];
+
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++) {
+			struct zspage *zspage, *tmp;
+
+			list_for_each_entry_safe(zspage, tmp,
+					&class->fullness_list[fg], list) {
+				pr_info("zsmalloc: freeing non-empty zspage "
+					"(class %u)\n", class->size);
+				list_del(&zspage->list);
+				free_zspage(zspage);
+			}
+		}
+	}
+
+	if (pool->area) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->area, cpu)->buf);
+		free_percpu(pool->area);
+	}
+
+	zs_handle_cache_put();
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ * @flags: flags for page allocation
+ *
+ * Returns a handle to the allocated object, or 0 on failure. The
+ * handle stays valid across zs_compact(); use zs_map_object() to get
+ * at the object.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	unsigned long *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	size += ZS_HANDLE_SIZE;
+	if (unlikely(size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = kmem_cache_alloc(zs_handle_cachep, flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	class = &pool->size_class[get_size_class_index(size)];
+
+	read_lock(&pool->migrate_lock);
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		read_unlock(&pool->migrate_lock);
+
+		zspage = alloc_zspage(class, flags);
+		if (!zspage) {
+			kmem_cache_free(zs_handle_cachep, handle);
+			return 0;
+		}
+		atomic_add(class->pages_per_zspage, &pool->pages_allocated);
+
+		read_lock(&pool->migrate_lock);
+		spin_lock(&class->lock);
+		class->zspages++;
+	}
+
+	obj_alloc(zspage, handle);
+	fix_fullness_group(zspage);
+	spin_unlock(&class->lock);
+	read_unlock(&pool->migrate_lock);
+
+	return (unsigned long)handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	unsigned int idx;
+	struct zspage *zspage;
+	struct size_class *class;
+	enum fullness_group fg;
+
+	if (unlikely(!handle))
+		return;
+
+	read_lock(&pool->migrate_lock);
+	zspage = location_to_zspage(*(unsigned long *)handle, &idx);
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	obj_free(zspage, idx);
+	fg = fix_fullness_group(zspage);
+	if (fg == ZS_EMPTY)
+		class->zspages--;
+	spin_unlock(&class->lock);
+	read_unlock(&pool->migrate_lock);
+
+	if (fg == ZS_EMPTY) {
+		atomic_sub(class->pages_per_zspage, &pool->pages_allocated);
+		free_zspage(zspage);
+	}
+
+	kmem_cache_free(zs_handle_cachep, (void *)handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/* Copies a straddling object between its two pages and area->buf */
+static void zs_copy_span(struct zs_map_area *area, int to_pages)
+{
+	u32 sizes[2];
+	void *addr;
+
+	sizes[0] = PAGE_SIZE - area->off;
+	sizes[1] = area->size - sizes[0];
+
+	addr = kmap_atomic(area->pages[0], KM_USER1);
+	if (to_pages)
+		memcpy(addr + area->off, area->buf, sizes[0]);
+	else
+		memcpy(area->buf, addr + area->off, sizes[0]);
+	kunmap_atomic(addr, KM_USER1);
+
+	addr = kmap_atomic(area->pages[1], KM_USER1);
+	if (to_pages)
+		memcpy(addr, area->buf + sizes[0], sizes[1]);
+	else
+		memcpy(area->buf + sizes[0], addr, sizes[1]);
+	kunmap_atomic(addr, KM_USER1);
+}
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: whether the object is read, written or both
+ *
+ * Objects contained within a single page are mapped directly. Objects
+ * that straddle two pages are copied into a per-cpu buffer, and copied
+ * back by zs_unmap_object() unless mapped ZS_MM_RO.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	unsigned int idx;
+	unsigned long off;
+	struct zspage *zspage;
+	struct zs_map_area *area;
+
+	BUG_ON(!handle);
+
+	read_lock(&pool->migrate_lock);
+	zspage = location_to_zspage(*(unsigned long *)handle, &idx);
+	off = (unsigned long)idx * zspage->class->size;
+
+	area = per_cpu_ptr(pool->area, get_cpu());
+	area->mm = mm;
+	area->size = zspage->class->size;
+	area->pages[0] = zspage_page(zspage, off, &off);
+	area->off = off;
+
+	if (off + area->size <= PAGE_SIZE) {
+		area->spanning = 0;
+		area->vaddr = kmap_atomic(area->pages[0], KM_USER1) + off;
+	} else {
+		area->spanning = 1;
+		area->pages[1] = zspage->pages[(idx * zspage->class->size
+						>> PAGE_SHIFT) + 1];
+		zs_copy_span(area, 0);
+		area->vaddr = area->buf;
+	}
+
+	return area->vaddr + ZS_HANDLE_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_map_area *area;
+
+	area = per_cpu_ptr(pool->area, smp_processor_id());
+	if (!area->spanning)
+		kunmap_atomic(area->vaddr - area->off, KM_USER1);
+	else if (area->mm != ZS_MM_RO)
+		zs_copy_span(area, 1);
+
+	put_cpu();
+	read_unlock(&pool->migrate_lock);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+/* Copies a whole object, which may straddle pages on either side */
+static void copy_object(struct zspage *dst, unsigned int didx,
+			struct zspage *src, unsigned int sidx)
+{
+	u32 size = src->class->size;
+	unsigned long s_off = (unsigned long)sidx * size;
+	unsigned long d_off = (unsigned long)didx * size;
+
+	while (size) {
+		unsigned long s_poff, d_poff;
+		struct page *s_page = zspage_page(src, s_off, &s_poff);
+		struct page *d_page = zspage_page(dst, d_off, &d_poff);
+		u32 len = min_t(u32, size, PAGE_SIZE - s_poff);
+		void *s_addr, *d_addr;
+
+		len = min_t(u32, len, PAGE_SIZE - d_poff);
+
+		s_addr = kmap_atomic(s_page, KM_USER0);
+		d_addr = kmap_atomic(d_page, KM_USER1);
+		memcpy(d_addr + d_poff, s_addr + s_poff, len);
+		kunmap_atomic(d_addr, KM_USER1);
+		kunmap_atomic(s_addr, KM_USER0);
+
+		s_off += len;
+		d_off += len;
+		size -= len;
+	}
+}
+
+/*
+ * Picks the least used zspage as migration source, provided the other
+ * non-full zspages of the class have room for all of its objects.
+ * Called with class->lock held.
+ */
+static struct zspage *find_source_zspage(struct size_class *class)
+{
+	int fg;
+	u32 free_objs = 0;
+	struct zspage *zspage, *src = NULL;
+
+	for (fg = 0; fg <= ZS_ALMOST_EMPTY; fg++) {
+		list_for_each_entry(zspage, &class->fullness_list[fg], list) {
+			free_objs += class->objs_per_zspage - zspage->inuse;
+			if (!src || zspage->inuse < src->inuse)
+				src = zspage;
+		}
+	}
+
+	if (!src)
+		return NULL;
+
+	free_objs -= class->objs_per_zspage - src->inuse;
+	if (free_objs < src->inuse)
+		return NULL;
+
+	return src;
+}
+
+/* Picks the fullest non-full zspage other than 'src' */
+static struct zspage *find_target_zspage(struct size_class *class,
+					 struct zspage *src)
+{
+	int fg;
+	struct zspage *zspage, *dst = NULL;
+
+	for (fg = 0; fg <= ZS_ALMOST_EMPTY; fg++) {
+		list_for_each_entry(zspage, &class->fullness_list[fg], list) {
+			if (zspage == src)
+				continue;
+			if (!dst || zspage->inuse > dst->inuse)
+				dst = zspage;
+		}
+	}
+
+	return dst;
+}
+
+/* Moves every object of 'src' into other zspages of its class */
+static void migrate_zspage(struct size_class *class, struct zspage *src)
+{
+	unsigned int sidx;
+	struct zspage *dst = NULL;
+
+	for (sidx = 0; src->inuse && sidx < class->objs_per_zspage; sidx++) {
+		unsigned long hdr = read_obj_header(src, sidx);
+		unsigned int didx;
+
+		if (!(hdr & OBJ_ALLOCATED_TAG))
+			continue;
+
+		if (!dst || dst->inuse == class->objs_per_zspage) {
+			if (dst)
+				fix_fullness_group(dst);
+			dst = find_target_zspage(class, src);
+			BUG_ON(!dst);
+		}
+
+		didx = obj_alloc(dst,
+				(unsigned long *)(hdr & ~OBJ_ALLOCATED_TAG));
+		copy_object(dst, didx, src, sidx);
+		obj_free(src, sidx);
+	}
+
+	if (dst)
+		fix_fullness_group(dst);
+}
+
+static unsigned long zs_compact_class(struct zs_pool *pool,
+				      struct size_class *class)
+{
+	unsigned long pages_freed = 0;
+	struct zspage *src;
+
+	while (1) {
+		write_lock(&pool->migrate_lock);
+		spin_lock(&class->lock);
+
+		src = find_source_zspage(class);
+		if (!src) {
+			spin_unlock(&class->lock);
+			write_unlock(&pool->migrate_lock);
+			break;
+		}
+
+		migrate_zspage(class, src);
+		BUG_ON(fix_fullness_group(src) != ZS_EMPTY);
+		class->zspages--;
+
+		spin_unlock(&class->lock);
+		write_unlock(&pool->migrate_lock);
+
+		atomic_sub(class->pages_per_zspage, &pool->pages_allocated);
+		pages_freed += class->pages_per_zspage;
+		free_zspage(src);
+
+		cond_resched();
+	}
+
+	return pages_freed;
+}
+
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages_freed = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		pages_freed += zs_compact_class(pool, &pool->size_class[i]);
+		cond_resched();
+	}
+
+	return pages_freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
@@ -0,0 +1,57 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_H_
+#define _ZS_MALLOC_H_
+
+#include <linux/types.h>
+
+/*
+ * zsmalloc packs objects of similar size into "zspages": groups of up
+ * to ZS_MAX_PAGES_PER_ZSPAGE order-0 pages chained together, so objects
+ * may straddle page boundaries and no page is wasted on rounding.
+ *
+ * Objects are referred to by opaque handles rather than addresses so
+ * that zs_compact() can move them between zspages and release pages.
+ * Use zs_map_object()/zs_unmap_object() to access object contents.
+ */
+
+enum zs_mapmode {
+	ZS_MM_RW,	/* read and write back */
+	ZS_MM_RO,	/* read only */
+	ZS_MM_WO,	/* contents will be overwritten */
+};
+
+struct zs_pool;
+
+struct zs_pool *zs_create_pool(void);
+void zs_destroy_pool(struct zs_pool *pool);
+
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags);
+void zs_free(struct zs_pool *pool, unsigned long handle);
+
+/*
+ * The mapping is atomic (KM_USER1 is used): the caller must not sleep
+ * until zs_unmap_object() and must not map two objects at once.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm);
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+
+/*
+ * Moves objects out of sparsely used zspages and frees the emptied
+ * pages. Returns the number of pages freed. The caller must ensure no
+ * object of this pool is mapped while compaction runs.
+ */
+unsigned long zs_compact(struct zs_pool *pool);
+
+#endif
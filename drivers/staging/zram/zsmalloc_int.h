@@ -0,0 +1,108 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+/* User configurable params */
+
+/*
+ * A zspage is made of at most this many order-0 pages. Larger values
+ * waste less space at the end of a zspage for awkward object sizes,
+ * but need more contiguous allocations per zspage.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/*
+ * Size classes are ZS_SIZE_CLASS_DELTA bytes apart. This must be a
+ * multiple of sizeof(unsigned long) so that an object header never
+ * straddles a page boundary.
+ */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*-- End of user params */
+
+#define ZS_SIZE_CLASSES	((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / \
+				ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * Every object starts with a one word header. For allocated objects
+ * it holds the handle (with OBJ_ALLOCATED_TAG set), which lets
+ * compaction find and update the handle of an object it moves. For
+ * free objects it links to the next free object of the zspage.
+ */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+#define OBJ_ALLOCATED_TAG	1UL
+#define OBJ_TAG_BITS		1
+
+/*
+ * A handle points to a word holding the object location: the pfn of
+ * the first page of its zspage and the object index in that zspage.
+ */
+#define OBJ_INDEX_BITS		10
+#define OBJ_INDEX_MASK		((1UL << OBJ_INDEX_BITS) - 1)
+
+/* zspages are grouped by how full they are */
+enum fullness_group {
+	ZS_ALMOST_FULL,		/* more than 3/4 of objects in use */
+	ZS_ALMOST_EMPTY,	/* other zspages with free objects */
+	ZS_FULL,
+	_ZS_NR_FULLNESS_GROUPS,
+	ZS_EMPTY,		/* freed immediately, never on a list */
+};
+
+struct zspage {
+	struct list_head list;		/* in class->fullness_list */
+	struct size_class *class;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	u16 inuse;			/* no. of allocated objects */
+	u16 freeobj;			/* first free object + 1, 0 if none */
+	u8 fullness;			/* enum fullness_group */
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+	u32 size;			/* object size, header included */
+	u32 pages_per_zspage;
+	u32 objs_per_zspage;
+	u64 zspages;			/* no. of zspages in this class */
+};
+
+/* Per-cpu buffer for objects that straddle two pages */
+struct zs_map_area {
+	char *buf;
+	void *vaddr;			/* address returned to the user */
+	struct page *pages[2];
+	u32 off;			/* object offset in pages[0] */
+	u32 size;
+	int spanning;
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+	/*
+	 * Taken for reading by everything that dereferences a handle,
+	 * and for writing by compaction while it moves objects.
+	 */
+	rwlock_t migrate_lock;
+	struct zs_map_area *area;	/* per-cpu */
+	atomic_t pages_allocated;
+};
+
+#endif
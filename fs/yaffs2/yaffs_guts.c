@@ -1364,20 +1364,57 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache
  *   provides write buffering.
  *
- *   There are a small number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   The cache can hold hundreds of chunks, so lookups go through a hash on
+ *   (object id, chunk id). Free and clean chunks sit on one LRU list and
+ *   dirty chunks on another, so a victim is always found at a list head.
  */
 
+static struct list_head *yaffs_cache_bucket(struct yaffs_dev *dev,
+					    const struct yaffs_obj *obj,
+					    int chunk_id)
+{
+	return &dev->cache_hash[(obj->obj_id * 31 + chunk_id) &
+				dev->cache_hash_mask];
+}
+
+/* Make the cache the most recently used one on the list for its state. */
+static void yaffs_mark_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
+			     int dirty)
+{
+	if (dirty && !cache->dirty)
+		dev->n_dirty_caches++;
+	else if (!dirty && cache->dirty)
+		dev->n_dirty_caches--;
+
+	cache->dirty = dirty;
+	list_del_init(&cache->lru);
+	list_add_tail(&cache->lru,
+		      dirty ? &dev->dirty_caches : &dev->clean_caches);
+}
+
+/* Free up a cache. It goes to the head of the clean list to be reused first. */
+static void yaffs_release_cache(struct yaffs_dev *dev,
+				struct yaffs_cache *cache)
+{
+	if (cache->dirty)
+		dev->n_dirty_caches--;
+
+	cache->dirty = 0;
+	cache->object = NULL;
+	list_del_init(&cache->hash_link);
+	list_del_init(&cache->lru);
+	list_add(&cache->lru, &dev->clean_caches);
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct list_head *i;
 	struct yaffs_cache *cache;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	for (i = 0; i < n_caches; i++) {
-		cache = &dev->cache[i];
-		if (cache->object == obj && cache->dirty)
+	list_for_each(i, &dev->dirty_caches) {
+		cache = list_entry(i, struct yaffs_cache, lru);
+		if (cache->object == obj)
 			return 1;
 	}
 
@@ -1387,42 +1424,55 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	struct list_head *i;
+	struct list_head *n;
+	struct list_head *pos;
+	struct list_head to_write;
 	struct yaffs_cache *cache;
-	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
+	int chunk_written = 1;
 
-	if (n_caches < 1)
+	if (dev->param.n_caches < 1)
 		return;
-	do {
-		cache = NULL;
-
-		/* Find the lowest dirty chunk for this object */
-		for (i = 0; i < n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].dirty) {
-				if (!cache ||
-				    dev->cache[i].chunk_id < lowest) {
-					cache = &dev->cache[i];
-					lowest = cache->chunk_id;
-				}
-			}
+
+	/* Pull this object's dirty chunks off the dirty list, sorted so that
+	 * they get written out in file order. Sequential writers dirty chunks
+	 * in ascending order, so the insertion normally stops straight away.
+	 */
+	INIT_LIST_HEAD(&to_write);
+	list_for_each_safe(i, n, &dev->dirty_caches) {
+		cache = list_entry(i, struct yaffs_cache, lru);
+		if (cache->object != obj || cache->locked)
+			continue;
+
+		list_del_init(&cache->lru);
+		for (pos = to_write.prev; pos != &to_write; pos = pos->prev) {
+			if (list_entry(pos, struct yaffs_cache, lru)->chunk_id <
+			    cache->chunk_id)
+				break;
 		}
+		list_add(&cache->lru, pos);
+	}
 
-		if (cache && !cache->locked) {
-			/* Write it out and free it up */
+	while (!list_empty(&to_write)) {
+		cache = list_entry(to_write.next, struct yaffs_cache, lru);
+
+		/* Write it out and free it up */
+		if (chunk_written > 0)
 			chunk_written =
 			    yaffs_wr_data_obj(cache->object,
 					      cache->chunk_id,
 					      cache->data,
 					      cache->n_bytes, 1);
-			cache->dirty = 0;
-			cache->object = NULL;
+
+		if (chunk_written > 0) {
+			yaffs_release_cache(dev, cache);
+		} else {
+			list_del_init(&cache->lru);
+			list_add_tail(&cache->lru, &dev->dirty_caches);
 		}
-	} while (cache && chunk_written > 0);
+	}
 
-	if (cache)
+	if (chunk_written <= 0)
 		/* Hoosterman, disk full while writing cache out. */
 		yaffs_trace(YAFFS_TRACE_ERROR,
 			"yaffs tragedy: no space during cache write");
@@ -1435,136 +1485,113 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
-	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
-	int i;
+	struct yaffs_cache *cache;
+	int n_dirty;
 
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
+	/* Flush the object owning the oldest dirty chunk...
+	 * until there are no further dirty objects, or no progress is made.
 	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
-		}
-		if (obj)
-			yaffs_flush_file_cache(obj);
-	} while (obj);
-
+	while (!list_empty(&dev->dirty_caches)) {
+		n_dirty = dev->n_dirty_caches;
+		cache = list_entry(dev->dirty_caches.next,
+				   struct yaffs_cache, lru);
+		yaffs_flush_file_cache(cache->object);
+		if (dev->n_dirty_caches >= n_dirty)
+			break;
+	}
 }
 
-/* Grab us a cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
- */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
+static struct yaffs_cache *yaffs_grab_chunk_worker(struct list_head *list)
 {
-	int i;
+	struct list_head *i;
+	struct yaffs_cache *cache;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
-		}
+	list_for_each(i, list) {
+		cache = list_entry(i, struct yaffs_cache, lru);
+		if (!cache->locked)
+			return cache;
 	}
 	return NULL;
 }
 
-static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
+/* Grab us a cache chunk for use and hash it in for obj/chunk_id.
+ * First take the least recently used free or clean one.
+ * If they are all dirty, flush the object with the least recently used
+ * dirty chunk and look again.
+ */
+static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_obj *obj,
+						  int chunk_id)
 {
+	struct yaffs_dev *dev = obj->my_dev;
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
 
 	if (dev->param.n_caches < 1)
 		return NULL;
 
-	/* Try find a non-dirty one... */
-
-	cache = yaffs_grab_chunk_worker(dev);
+	cache = yaffs_grab_chunk_worker(&dev->clean_caches);
 
 	if (!cache) {
-		/* They were all dirty, find the LRU object and flush
-		 * its cache, then  find again.
-		 * NB what's here is not very accurate,
-		 * we actually flush the object with the LRU chunk.
-		 */
+		cache = yaffs_grab_chunk_worker(&dev->dirty_caches);
+		if (cache) {
+			yaffs_flush_file_cache(cache->object);
+			cache = yaffs_grab_chunk_worker(&dev->clean_caches);
+		}
+	}
 
-		/* With locking we can't assume we can use entry zero,
-		 * Set the_obj to a valid pointer for Coverity. */
-		the_obj = dev->cache[0].object;
-		usage = -1;
-		cache = NULL;
-		pushout = -1;
+	if (!cache)
+		return NULL;
 
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object &&
-			    !dev->cache[i].locked &&
-			    (dev->cache[i].last_use < usage ||
-			    !cache)) {
-				usage = dev->cache[i].last_use;
-				the_obj = dev->cache[i].object;
-				cache = &dev->cache[i];
-				pushout = i;
-			}
-		}
+	yaffs_release_cache(dev, cache);
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->n_bytes = 0;
+	list_add(&cache->hash_link, yaffs_cache_bucket(dev, obj, chunk_id));
 
-		if (!cache || cache->dirty) {
-			/* Flush and try again */
-			yaffs_flush_file_cache(the_obj);
-			cache = yaffs_grab_chunk_worker(dev);
-		}
-	}
 	return cache;
 }
 
+static struct yaffs_cache *yaffs_lookup_chunk_cache(const struct yaffs_obj *obj,
+						    int chunk_id)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct list_head *i;
+	struct yaffs_cache *cache;
+
+	list_for_each(i, yaffs_cache_bucket(dev, obj, chunk_id)) {
+		cache = list_entry(i, struct yaffs_cache, hash_link);
+		if (cache->object == obj && cache->chunk_id == chunk_id)
+			return cache;
+	}
+	return NULL;
+}
+
 /* Find a cached chunk */
 static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct yaffs_cache *cache;
 
 	if (dev->param.n_caches < 1)
 		return NULL;
 
-	for (i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].object == obj &&
-		    dev->cache[i].chunk_id == chunk_id) {
-			dev->cache_hits++;
+	cache = yaffs_lookup_chunk_cache(obj, chunk_id);
+	if (cache)
+		dev->cache_hits++;
+	else
+		dev->cache_misses++;
 
-			return &dev->cache[i];
-		}
-	}
-	return NULL;
+	return cache;
 }
 
 /* Mark the chunk for the least recently used algorithym */
 static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write)
 {
-	int i;
-
 	if (dev->param.n_caches < 1)
 		return;
 
-	if (dev->cache_last_use < 0 ||
-		dev->cache_last_use > 100000000) {
-		/* Reset the cache usages */
-		for (i = 1; i < dev->param.n_caches; i++)
-			dev->cache[i].last_use = 0;
-
-		dev->cache_last_use = 0;
-	}
-	dev->cache_last_use++;
-	cache->last_use = dev->cache_last_use;
-
-	if (is_write)
-		cache->dirty = 1;
+	yaffs_mark_cache(dev, cache, is_write || cache->dirty);
 }
 
 /* Invalidate a single cache page.
@@ -1576,10 +1603,10 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 	struct yaffs_cache *cache;
 
 	if (object->my_dev->param.n_caches > 0) {
-		cache = yaffs_find_chunk_cache(object, chunk_id);
+		cache = yaffs_lookup_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_release_cache(object->my_dev, cache);
 	}
 }
 
@@ -1595,7 +1622,7 @@ static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->param.n_caches; i++) {
 			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
+				yaffs_release_cache(dev, &dev->cache[i]);
 		}
 	}
 }
@@ -2811,8 +2838,12 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	int min_erased;
 	int erased_chunks;
 	int checkpt_block_adjust;
+	unsigned gc_flags = YAFFS_GC_ENABLE;
+
+	if (dev->param.gc_control)
+		gc_flags = dev->param.gc_control(dev);
 
-	if (dev->param.gc_control && (dev->param.gc_control(dev) & 1) == 0)
+	if (!(gc_flags & YAFFS_GC_ENABLE))
 		return YAFFS_OK;
 
 	if (dev->gc_disable)
@@ -2837,6 +2868,9 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 		if (dev->n_erased_blocks < min_erased)
 			aggressive = 1;
 		else {
+			if (!background && (gc_flags & YAFFS_GC_BACKGROUND))
+				break;
+
 			if (!background
 			    && erased_chunks > (dev->n_free_chunks / 4))
 				break;
@@ -3032,6 +3066,7 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 	    yaffs_write_new_chunk(dev, buffer, &new_tags, use_reserve);
 
 	if (new_chunk_id > 0) {
+		dev->n_data_chunk_writes++;
 		yaffs_put_chunk_in_file(in, inode_chunk, new_chunk_id, 0);
 
 		if (prev_chunk_id > 0)
@@ -3461,14 +3496,9 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 
 				if (!cache) {
 					cache =
-					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					    yaffs_grab_chunk_cache(in, chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
-					cache->n_bytes = 0;
 				}
 
 				yaffs_use_cache(dev, cache, 0);
@@ -3583,11 +3613,8 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 
 				if (!cache &&
 				    yaffs_check_alloc_available(dev, 1)) {
-					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					cache = yaffs_grab_chunk_cache(in,
+								       chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
 				} else if (cache &&
@@ -3618,7 +3645,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 *buffer, loff_t offset,
 						     cache->chunk_id,
 						     cache->data,
 						     cache->n_bytes, 1);
-						cache->dirty = 0;
+						yaffs_mark_cache(dev, cache, 0);
 					}
 				} else {
 					chunk_written = -1;	/* fail write */
@@ -4354,6 +4381,74 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 	return NULL;
 }
 
+/*
+ * yaffs_obj_in_ram() is true when the object's details and name can be
+ * had without reading its object header, ie. neither it nor the object
+ * it links to is still lazy loaded and the name fits in short_name.
+ */
+int yaffs_obj_in_ram(struct yaffs_obj *obj)
+{
+	struct yaffs_obj *equiv = obj;
+
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_HARDLINK)
+		equiv = obj->variant.hardlink_variant.equiv_obj;
+
+	if (obj->lazy_loaded && obj->hdr_chunk > 0)
+		return 0;
+	if (equiv && equiv->lazy_loaded && equiv->hdr_chunk > 0)
+		return 0;
+
+	return obj->obj_id == YAFFS_OBJECTID_LOSTNFOUND ||
+	    obj->short_name[0] || obj->hdr_chunk <= 0;
+}
+
+/*
+ * yaffs_find_by_name_in_ram() does the same search as yaffs_find_by_name()
+ * but gives up with YAFFS_FAIL rather than touch the flash or load any
+ * object details. That lets it run with only the directory tree held,
+ * so lookups don't have to wait for writers.
+ */
+int yaffs_find_by_name_in_ram(struct yaffs_obj *directory, const YCHAR *name,
+			      struct yaffs_obj **found)
+{
+	int sum;
+	struct list_head *i;
+	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
+	struct yaffs_obj *l;
+
+	*found = NULL;
+
+	if (!name)
+		return YAFFS_OK;
+
+	sum = yaffs_calc_name_sum(name);
+
+	list_for_each(i, &directory->variant.dir_variant.children) {
+		l = list_entry(i, struct yaffs_obj, siblings);
+
+		/* Until it is loaded the name sum means nothing */
+		if (l->lazy_loaded && l->hdr_chunk > 0)
+			return YAFFS_FAIL;
+
+		if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND) {
+			if (!strcmp(name, YAFFS_LOSTNFOUND_NAME)) {
+				*found = l;
+				return YAFFS_OK;
+			}
+		} else if (l->sum == sum || l->hdr_chunk <= 0) {
+			if (!yaffs_obj_in_ram(l))
+				return YAFFS_FAIL;
+			yaffs_get_obj_name(l, buffer,
+				YAFFS_MAX_NAME_LENGTH + 1);
+			if (strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0) {
+				*found = l;
+				return YAFFS_OK;
+			}
+		}
+	}
+	return YAFFS_OK;
+}
+
 /* GetEquivalentObject dereferences any hard links to get to the
  * actual object.
  */
@@ -4755,38 +4850,54 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		init_failed = 1;
 
 	dev->cache = NULL;
+	dev->cache_hash = NULL;
 	dev->gc_cleanup_list = NULL;
+	INIT_LIST_HEAD(&dev->clean_caches);
+	INIT_LIST_HEAD(&dev->dirty_caches);
+	dev->n_dirty_caches = 0;
 
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
+		u32 n_buckets;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
 
-		buf = (u8 *) dev->cache;
+		/* A power of two hash buckets, about one per cache */
+		for (n_buckets = 1; n_buckets < dev->param.n_caches;
+		     n_buckets <<= 1)
+			;
+		dev->cache_hash_mask = n_buckets - 1;
+		dev->cache_hash =
+		    kmalloc(n_buckets * sizeof(struct list_head), GFP_NOFS);
+
+		buf = dev->cache_hash ? (u8 *) dev->cache : NULL;
+
+		for (i = 0; i < n_buckets && buf; i++)
+			INIT_LIST_HEAD(&dev->cache_hash[i]);
 
 		if (dev->cache)
 			memset(dev->cache, 0, cache_bytes);
 
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			list_add_tail(&dev->cache[i].lru, &dev->clean_caches);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
+	dev->cache_misses = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -4872,6 +4983,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	/* Zero out stats */
 	dev->n_page_reads = 0;
 	dev->n_page_writes = 0;
+	dev->n_data_chunk_writes = 0;
 	dev->n_erasures = 0;
 	dev->n_gc_copies = 0;
 	dev->n_retired_writes = 0;
@@ -4908,6 +5020,8 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 
 			kfree(dev->cache);
 			dev->cache = NULL;
+			kfree(dev->cache_hash);
+			dev->cache_hash = NULL;
 		}
 
 		kfree(dev->gc_cleanup_list);
@@ -4951,21 +5065,13 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 {
 	/* This is what we report to the outside world */
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
-	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
-	/* Now count and subtract the number of dirty chunks in the cache. */
-
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
-
-	n_free -= n_dirty_caches;
+	/* Now subtract the number of dirty chunks in the cache. */
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
@@ -85,7 +85,17 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA	0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	512
+
+/* Flags returned by the gc_control callback */
+#define YAFFS_GC_ENABLE			1	/* Do garbage collection */
+#define YAFFS_GC_BACKGROUND		2	/* A background thread does the
+						 * passive gc. Writers only gc
+						 * when short of erased blocks.
+						 */
+
+/* summary_wait_fn result for a block that was not queued */
+#define YAFFS_NOT_READ_AHEAD		(-1)
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -110,9 +120,10 @@
 
 /* ChunkCache is used for short read/write operations.*/
 struct yaffs_cache {
+	struct list_head hash_link;	/* In dev->cache_hash */
+	struct list_head lru;	/* In dev->clean_caches or dev->dirty_caches */
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -494,6 +505,9 @@ struct yaffs_buffer {
 
 /*----------------- Device ---------------------------------*/
 
+struct yaffs_summary_tags;
+struct yaffs_summary_acct;
+
 struct yaffs_param {
 	const YCHAR *name;
 
@@ -568,9 +582,23 @@ struct yaffs_param {
 	/* Callback to mark the superblock dirty */
 	void (*sb_dirty_fn) (struct yaffs_dev *dev);
 
-	/*  Callback to control garbage collection. */
+	/*  Callback to control garbage collection.
+	 * Returns YAFFS_GC_xxx flags.
+	 */
 	unsigned (*gc_control) (struct yaffs_dev *dev);
 
+	/* Optional read-ahead of block summaries during the mount scan.
+	 * summary_read_ahead_fn queues a block, in scan order, and returns
+	 * YAFFS_FAIL if the queue is full. summary_wait_fn waits for a
+	 * queued block and copies its summary into st and the read's
+	 * accounting into acct. It returns the result of the read or
+	 * YAFFS_NOT_READ_AHEAD.
+	 */
+	int (*summary_read_ahead_fn) (struct yaffs_dev *dev, int block_no);
+	int (*summary_wait_fn) (struct yaffs_dev *dev, int block_no,
+				struct yaffs_summary_tags *st,
+				struct yaffs_summary_acct *acct);
+
 	/* Debug control flags. Don't use unless you know what you're doing */
 	int use_header_file_size;	/* Flag to determine if we should use
 					 * file sizes from the header */
@@ -696,7 +724,11 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head *cache_hash;	/* Hashed on object id and chunk id */
+	u32 cache_hash_mask;
+	struct list_head clean_caches;	/* Free and clean, least recent first */
+	struct list_head dirty_caches;	/* Dirty, least recent first */
+	int n_dirty_caches;
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted
@@ -736,6 +768,7 @@ struct yaffs_dev {
 	/* Statistics */
 	u32 n_page_writes;
 	u32 n_page_reads;
+	u32 n_data_chunk_writes;	/* File data chunks written for users */
 	u32 n_erasures;
 	u32 n_erase_failures;
 	u32 n_gc_copies;
@@ -754,6 +787,7 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_misses;
 	u32 tags_used;
 	u32 summary_used;
 
@@ -845,6 +879,9 @@ struct yaffs_obj *yaffs_create_dir(struct yaffs_obj *parent, const YCHAR *name,
 				   u32 mode, u32 uid, u32 gid);
 struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *the_dir,
 				     const YCHAR *name);
+int yaffs_find_by_name_in_ram(struct yaffs_obj *the_dir, const YCHAR *name,
+			      struct yaffs_obj **found);
+int yaffs_obj_in_ram(struct yaffs_obj *obj);
 struct yaffs_obj *yaffs_find_by_number(struct yaffs_dev *dev, u32 number);
 
 /* Link operations */
@@ -24,14 +24,25 @@ struct yaffs_linux_context {
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
-	struct mutex gross_lock;	/* Gross locking mutex*/
+	unsigned long last_write;	/* jiffies of the last data write */
+	unsigned long last_dirty;	/* jiffies of the last change */
+	unsigned long last_checkpoint;	/* jiffies of the last idle one */
+	struct kobject *stats_kobj;	/* /sys/fs/yaffs/<dev> */
+	struct rw_semaphore tree_lock;	/* Directory tree. Shared for lookups
+					 * and data access, exclusive to change
+					 * the tree. */
+	struct mutex block_lock;	/* Block manager, allocator, caches and
+					 * everything else in the yaffs core.
+					 * Taken inside tree_lock. */
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the buffer size
 				 * at compile time so we have to allocate it.
 				 */
+	struct mutex spare_lock;	/* Protects spare_buffer */
+	struct yaffs_read_ahead *read_ahead;	/* Mount scan only */
 	struct list_head search_contexts;
+	spinlock_t search_lock;	/* Protects search_contexts */
 	void (*put_super_fn) (struct super_block *sb);
 
-	struct task_struct *readdir_process;
 	unsigned mount_id;
 };
 
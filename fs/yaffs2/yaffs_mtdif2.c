@@ -134,6 +134,9 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 
 	}
 
+	/* The spare buffer is shared with the summary read-ahead thread */
+	mutex_lock(&yaffs_dev_to_lc(dev)->spare_lock);
+
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
 	if (dev->param.inband_tags || (data && !tags))
 		retval = mtd->read(mtd, addr, dev->param.total_bytes_per_chunk,
@@ -181,9 +184,7 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		}
 	}
 
-	if (local_data)
-		yaffs_release_temp_buffer(dev, data);
-
+	/* Also keeps the ECC counts straight with both threads reading */
 	if (tags && retval == -EBADMSG
 	    && tags->ecc_result == YAFFS_ECC_RESULT_NO_ERROR) {
 		tags->ecc_result = YAFFS_ECC_RESULT_UNFIXED;
@@ -194,6 +195,11 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		tags->ecc_result = YAFFS_ECC_RESULT_FIXED;
 		dev->n_ecc_fixed++;
 	}
+
+	mutex_unlock(&yaffs_dev_to_lc(dev)->spare_lock);
+
+	if (local_data)
+		yaffs_release_temp_buffer(dev, data);
 	if (retval == 0)
 		return YAFFS_OK;
 	else
@@ -17,12 +17,27 @@
 #include "yaffs_getblockinfo.h"
 #include "yaffs_summary.h"
 
+/* Reads a chunk without counting the read or handling an ECC error;
+ * the caller must do both. Only the driver's own ECC statistics in dev
+ * are updated, and the driver keeps those under its own lock.
+ */
+int yaffs_rd_chunk_tags_bare(struct yaffs_dev *dev, int nand_chunk,
+			     u8 *buffer, struct yaffs_ext_tags *tags)
+{
+	int flash_chunk = nand_chunk - dev->chunk_offset;
+
+	if (dev->param.read_chunk_tags_fn)
+		return dev->param.read_chunk_tags_fn(dev, flash_chunk, buffer,
+						     tags);
+	else
+		return yaffs_tags_compat_rd(dev, flash_chunk, buffer, tags);
+}
+
 int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 			     u8 *buffer, struct yaffs_ext_tags *tags)
 {
 	int result;
 	struct yaffs_ext_tags local_tags;
-	int flash_chunk = nand_chunk - dev->chunk_offset;
 
 	dev->n_page_reads++;
 
@@ -30,13 +45,7 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 	if (!tags)
 		tags = &local_tags;
 
-	if (dev->param.read_chunk_tags_fn)
-		result =
-		    dev->param.read_chunk_tags_fn(dev, flash_chunk, buffer,
-						  tags);
-	else
-		result = yaffs_tags_compat_rd(dev,
-					      flash_chunk, buffer, tags);
+	result = yaffs_rd_chunk_tags_bare(dev, nand_chunk, buffer, tags);
 	if (tags && tags->ecc_result > YAFFS_ECC_RESULT_NO_ERROR) {
 
 		struct yaffs_block_info *bi;
@@ -130,24 +130,33 @@ static int yaffs_summary_write(struct yaffs_dev *dev, int blk)
 	return result;
 }
 
-int yaffs_summary_read(struct yaffs_dev *dev,
+int yaffs_summary_size(struct yaffs_dev *dev)
+{
+	return sizeof(struct yaffs_summary_tags) * dev->chunks_per_summary;
+}
+
+/* Reads the summary of blk into st using buffer for the chunk data.
+ * The block info and read counts in dev are left alone, so this can run
+ * on a read-ahead thread while the scan carries on with other blocks.
+ * The page reads and any ECC error are returned in acct instead, for
+ * yaffs_summary_read() to account once the scan collects the summary.
+ * The driver still bumps n_ecc_fixed/n_ecc_unfixed itself, under
+ * spare_lock in mtdif2.
+ */
+int yaffs_summary_read_block(struct yaffs_dev *dev,
 			struct yaffs_summary_tags *st,
-			int blk)
+			int blk, u8 *buffer,
+			struct yaffs_summary_acct *acct)
 {
 	struct yaffs_ext_tags tags;
-	u8 *buffer;
 	u8 *sum_buffer = (u8 *)st;
 	int n_bytes;
 	int chunk_id;
 	int chunk_in_nand;
-	int chunk_in_block;
 	int result;
 	int this_tx;
-	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
 
-	buffer = yaffs_get_temp_buffer(dev);
-	n_bytes = sizeof(struct yaffs_summary_tags) * dev->chunks_per_summary;
-	chunk_in_block = dev->chunks_per_summary;
+	n_bytes = yaffs_summary_size(dev);
 	chunk_in_nand = blk * dev->param.chunks_per_block +
 							dev->chunks_per_summary;
 	chunk_id = 1;
@@ -155,8 +164,11 @@ int yaffs_summary_read(struct yaffs_dev *dev,
 		this_tx = n_bytes;
 		if(this_tx > dev->data_bytes_per_chunk)
 			this_tx = dev->data_bytes_per_chunk;
-		result = yaffs_rd_chunk_tags_nand(dev, chunk_in_nand,
+		result = yaffs_rd_chunk_tags_bare(dev, chunk_in_nand,
 						buffer, &tags);
+		acct->n_reads++;
+		if (tags.ecc_result > YAFFS_ECC_RESULT_NO_ERROR)
+			acct->ecc_error = 1;
 
 		if (tags.chunk_id != chunk_id ||
 			tags.obj_id != YAFFS_OBJECTID_SUMMARY ||
@@ -167,23 +179,55 @@ int yaffs_summary_read(struct yaffs_dev *dev,
 		if (result != YAFFS_OK)
 			break;
 
-		if (st == dev->sum_tags) {
-			/* If we're scanning then update the block info */
-			yaffs_set_chunk_bit(dev, blk, chunk_in_block);
-			bi->pages_in_use++;
-		}
-
 		memcpy(sum_buffer, buffer, this_tx);
 		n_bytes -= this_tx;
 		sum_buffer += this_tx;
 		chunk_in_nand++;
-		chunk_in_block++;
 		chunk_id++;
 	} while (result == YAFFS_OK && n_bytes > 0);
-	yaffs_release_temp_buffer(dev, buffer);
 
-	if (st == dev->sum_tags && result == YAFFS_OK)
+	return result;
+}
+
+int yaffs_summary_read(struct yaffs_dev *dev,
+			struct yaffs_summary_tags *st,
+			int blk)
+{
+	u8 *buffer;
+	int result = YAFFS_NOT_READ_AHEAD;
+	int chunk_in_block;
+	int end_chunk;
+	struct yaffs_block_info *bi = yaffs_get_block_info(dev, blk);
+	struct yaffs_summary_acct acct = {0, 0};
+
+	/* Use the read-ahead copy if the scan queued this block */
+	if (st == dev->sum_tags && dev->param.summary_wait_fn)
+		result = dev->param.summary_wait_fn(dev, blk, st, &acct);
+
+	if (result == YAFFS_NOT_READ_AHEAD) {
+		buffer = yaffs_get_temp_buffer(dev);
+		result = yaffs_summary_read_block(dev, st, blk, buffer, &acct);
+		yaffs_release_temp_buffer(dev, buffer);
+	}
+
+	/* As yaffs_rd_chunk_tags_nand() would have done for each chunk */
+	dev->n_page_reads += acct.n_reads;
+	if (acct.ecc_error)
+		yaffs_handle_chunk_error(dev, bi);
+
+	if (st == dev->sum_tags && result == YAFFS_OK) {
+		/* If we're scanning then update the block info */
+		end_chunk = dev->chunks_per_summary +
+			(yaffs_summary_size(dev) +
+			 dev->data_bytes_per_chunk - 1) /
+			dev->data_bytes_per_chunk;
+		for (chunk_in_block = dev->chunks_per_summary;
+		     chunk_in_block < end_chunk; chunk_in_block++) {
+			yaffs_set_chunk_bit(dev, blk, chunk_in_block);
+			bi->pages_in_use++;
+		}
 		bi->has_summary = 1;
+	}
 
 	return result;
 }
@@ -19,6 +19,14 @@
 #include "yaffs_packedtags2.h"
 
 
+/* What yaffs_summary_read_block() leaves for yaffs_summary_read() to
+ * apply to dev.
+ */
+struct yaffs_summary_acct {
+	int n_reads;		/* For dev->n_page_reads */
+	int ecc_error;		/* A chunk needed ECC */
+};
+
 int yaffs_summary_init(struct yaffs_dev *dev);
 void yaffs_summary_deinit(struct yaffs_dev *dev);
 
@@ -28,6 +36,11 @@ int yaffs_summary_add(struct yaffs_dev *dev,
 int yaffs_summary_fetch(struct yaffs_dev *dev,
 			struct yaffs_ext_tags *tags,
 			int chunk_in_block);
+int yaffs_summary_size(struct yaffs_dev *dev);
+int yaffs_summary_read_block(struct yaffs_dev *dev,
+			struct yaffs_summary_tags *st,
+			int blk, u8 *buffer,
+			struct yaffs_summary_acct *acct);
 int yaffs_summary_read(struct yaffs_dev *dev,
 			struct yaffs_summary_tags *st,
 			int blk);
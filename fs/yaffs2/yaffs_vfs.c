@@ -48,6 +48,10 @@
 #define YAFFS_COMPILE_EXPORTFS
 #endif
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 25))
+#define YAFFS_COMPILE_SYSFS
+#endif
+
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 35))
 #define YAFFS_USE_SETATTR_COPY
 #define YAFFS_USE_TRUNCATE_SETSIZE
@@ -96,6 +100,11 @@
 #include <linux/freezer.h>
 #endif
 
+#ifdef YAFFS_COMPILE_SYSFS
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#endif
+
 #include <asm/div64.h>
 
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
@@ -167,6 +176,7 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 #include "yaffs_attribs.h"
 
 #include "yaffs_linux.h"
+#include "yaffs_summary.h"
 
 #include "yaffs_mtdif.h"
 #include "yaffs_mtdif1.h"
@@ -178,6 +188,7 @@ unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
 unsigned int yaffs_auto_select = 1;
+unsigned int yaffs_idle_checkpoint = 5 * 60;	/* seconds, 0 disables */
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_trace_mask, uint, 0644);
@@ -185,6 +196,7 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_idle_checkpoint, uint, 0644);
 #else
 MODULE_PARM(yaffs_trace_mask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
@@ -496,20 +508,80 @@ static int yaffs_vfs_setsize(struct inode *inode, loff_t newsize)
 
 static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 {
-	return yaffs_gc_control;
+	unsigned control = yaffs_gc_control;
+
+	/* While the background thread is collecting, writers leave the
+	 * passive gc to it.
+	 */
+	if (yaffs_bg_enable && yaffs_dev_to_lc(dev)->bg_running)
+		control |= YAFFS_GC_BACKGROUND;
+
+	return control;
 }
 
+/*
+ * Locking.
+ * tree_lock covers the directory tree: which objects exist, their names
+ * and where they live. block_lock covers the rest of the yaffs core,
+ * that is the block manager, allocator, tnodes, caches and the flash.
+ *
+ * yaffs_gross_lock() takes both exclusively, for anything that changes
+ * the tree.
+ * yaffs_data_lock() shares the tree and takes block_lock, for file data
+ * and anything else that goes to flash without changing the tree. The
+ * Linux page lock and i_mutex already keep data access to one object
+ * in order; block_lock is still needed since gc moves any object's
+ * chunks.
+ * yaffs_tree_read_lock() only shares the tree, for lookups and readdir
+ * that can be answered from RAM. They fall back to yaffs_gross_lock()
+ * when they need the flash.
+ */
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	down_write(&(yaffs_dev_to_lc(dev)->tree_lock));
+	mutex_lock(&(yaffs_dev_to_lc(dev)->block_lock));
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
 static void yaffs_gross_unlock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	mutex_unlock(&(yaffs_dev_to_lc(dev)->block_lock));
+	up_write(&(yaffs_dev_to_lc(dev)->tree_lock));
+}
+
+/* Called by every op that changes the fs, so that the idle checkpoint
+ * waits for it to go quiet. See yaffs_bg_thread_fn().
+ */
+static void yaffs_stamp_dirty(struct yaffs_dev *dev)
+{
+	yaffs_dev_to_lc(dev)->last_dirty = jiffies;
+}
+
+static void yaffs_data_lock(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs data locking %p", current);
+	down_read(&(yaffs_dev_to_lc(dev)->tree_lock));
+	mutex_lock(&(yaffs_dev_to_lc(dev)->block_lock));
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs data locked %p", current);
+}
+
+static void yaffs_data_unlock(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs data unlocking %p", current);
+	mutex_unlock(&(yaffs_dev_to_lc(dev)->block_lock));
+	up_read(&(yaffs_dev_to_lc(dev)->tree_lock));
+}
+
+static void yaffs_tree_read_lock(struct yaffs_dev *dev)
+{
+	down_read(&(yaffs_dev_to_lc(dev)->tree_lock));
+}
+
+static void yaffs_tree_read_unlock(struct yaffs_dev *dev)
+{
+	up_read(&(yaffs_dev_to_lc(dev)->tree_lock));
 }
 
 #ifdef YAFFS_COMPILE_EXPORTFS
@@ -597,7 +669,8 @@ static struct export_operations yaffs_export_ops = {
  *
  * A seach context lives for the duration of a readdir.
  *
- * All these functions must be called while yaffs is locked.
+ * All these functions must be called with at least the tree shared.
+ * Readdirs can share it, so the list itself is under search_lock.
  */
 
 struct yaffs_search_context {
@@ -628,7 +701,9 @@ static struct yaffs_search_context *yaffs_new_search(struct yaffs_obj *dir)
 			    list_entry(dir->variant.dir_variant.children.next,
 				       struct yaffs_obj, siblings);
 		INIT_LIST_HEAD(&sc->others);
+		spin_lock(&(yaffs_dev_to_lc(dev)->search_lock));
 		list_add(&sc->others, &(yaffs_dev_to_lc(dev)->search_contexts));
+		spin_unlock(&(yaffs_dev_to_lc(dev)->search_lock));
 	}
 	return sc;
 }
@@ -639,7 +714,9 @@ static struct yaffs_search_context *yaffs_new_search(struct yaffs_obj *dir)
 static void yaffs_search_end(struct yaffs_search_context *sc)
 {
 	if (sc) {
+		spin_lock(&(yaffs_dev_to_lc(sc->dev)->search_lock));
 		list_del(&sc->others);
+		spin_unlock(&(yaffs_dev_to_lc(sc->dev)->search_lock));
 		kfree(sc);
 	}
 }
@@ -685,11 +762,13 @@ static void yaffs_remove_obj_callback(struct yaffs_obj *obj)
 	 * If any are currently on the object being removed, then advance
 	 * the search context to the next object to prevent a hanging pointer.
 	 */
+	spin_lock(&(yaffs_dev_to_lc(obj->my_dev)->search_lock));
 	list_for_each(i, search_contexts) {
 		sc = list_entry(i, struct yaffs_search_context, others);
 		if (sc->next_return == obj)
 			yaffs_search_advance(sc);
 	}
+	spin_unlock(&(yaffs_dev_to_lc(obj->my_dev)->search_lock));
 
 }
 
@@ -703,11 +782,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user * buffer,
 
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
 
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -730,10 +809,10 @@ static int yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	int ret_int = 0;
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
 
 	if (!alias) {
 		ret_int = -ENOMEM;
@@ -780,21 +859,31 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 	struct yaffs_obj *obj;
 	struct inode *inode = NULL;	/* NCB 2.5/2.6 needs NULL here */
 
-	struct yaffs_dev *dev = yaffs_inode_to_obj(dir)->my_dev;
-
-	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_lock(dev);
+	struct yaffs_obj *dir_obj = yaffs_inode_to_obj(dir);
+	struct yaffs_dev *dev = dir_obj->my_dev;
+	int exclusive = 0;
 
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_lookup for %d:%s",
-		yaffs_inode_to_obj(dir)->obj_id, dentry->d_name.name);
+		dir_obj->obj_id, dentry->d_name.name);
+
+	/* Try to answer from RAM, so as not to wait behind writers */
+	yaffs_tree_read_lock(dev);
 
-	obj = yaffs_find_by_name(yaffs_inode_to_obj(dir), dentry->d_name.name);
+	if (yaffs_find_by_name_in_ram(dir_obj, dentry->d_name.name, &obj) !=
+	    YAFFS_OK) {
+		yaffs_tree_read_unlock(dev);
+		yaffs_gross_lock(dev);
+		exclusive = 1;
+		obj = yaffs_find_by_name(dir_obj, dentry->d_name.name);
+	}
 
 	obj = yaffs_get_equivalent_obj(obj);	/* in case it was a hardlink */
 
 	/* Can't hold gross lock when calling yaffs_get_inode() */
-	if (current != yaffs_dev_to_lc(dev)->readdir_process)
+	if (exclusive)
 		yaffs_gross_unlock(dev);
+	else
+		yaffs_tree_read_unlock(dev);
 
 	if (obj) {
 		yaffs_trace(YAFFS_TRACE_OS,
@@ -869,6 +958,7 @@ static void yaffs_evict_inode(struct inode *inode)
 		dev = obj->my_dev;
 		yaffs_gross_lock(dev);
 		yaffs_del_obj(obj);
+		yaffs_stamp_dirty(dev);
 		yaffs_gross_unlock(dev);
 	}
 	if (obj) {
@@ -927,6 +1017,7 @@ static void yaffs_delete_inode(struct inode *inode)
 		dev = obj->my_dev;
 		yaffs_gross_lock(dev);
 		yaffs_del_obj(obj);
+		yaffs_stamp_dirty(dev);
 		yaffs_gross_unlock(dev);
 	}
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 13))
@@ -951,11 +1042,11 @@ static int yaffs_file_flush(struct file *file)
 		obj->obj_id,
 		obj->dirty ? "dirty" : "clean");
 
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 
 	yaffs_flush_file(obj, 1, 0);
 
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
 
 	return 0;
 }
@@ -993,12 +1084,12 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 
 	ret = yaffs_file_rd(obj, pg_buf,
 			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
 
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
 
 	if (ret >= 0)
 		ret = 0;
@@ -1094,7 +1185,7 @@ static int yaffs_writepage(struct page *page)
 
 	obj = yaffs_inode_to_obj(inode);
 	dev = obj->my_dev;
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_writepage at %08x, size %08x",
@@ -1107,12 +1198,13 @@ static int yaffs_writepage(struct page *page)
 				  page->index << PAGE_CACHE_SHIFT, n_bytes, 0);
 
 	yaffs_touch_super(dev);
+	yaffs_dev_to_lc(dev)->last_write = jiffies;
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"writepag1: obj = %05x, ino = %05x",
 		(int)obj->variant.file_variant.file_size, (int)inode->i_size);
 
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
 
 	kunmap(page);
 	set_page_writeback(page);
@@ -1427,7 +1519,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 
 	inode = f->f_dentry->d_inode;
 
@@ -1443,6 +1535,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 	n_written = yaffs_wr_file(obj, buf, ipos, n, 0);
 
 	yaffs_touch_super(dev);
+	yaffs_dev_to_lc(dev)->last_write = jiffies;
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_file_write: %d(%x) bytes written",
@@ -1461,7 +1554,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 		}
 
 	}
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
 	return (n_written == 0) && (n > 0) ? -ENOSPC : n_written;
 }
 
@@ -1480,11 +1573,11 @@ static ssize_t yaffs_hold_space(struct file *f)
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 
 	n_free_chunks = yaffs_get_n_free_chunks(dev);
 
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
 
 	return (n_free_chunks > 20) ? 1 : 0;
 }
@@ -1498,9 +1591,29 @@ static void yaffs_release_space(struct file *f)
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
+}
+
+/*
+ * readdir only shares the tree while the names it returns are in RAM,
+ * and switches to the gross lock for good once it meets one that is not.
+ */
+static void yaffs_readdir_lock(struct yaffs_dev *dev, int exclusive)
+{
+	if (exclusive)
+		yaffs_gross_lock(dev);
+	else
+		yaffs_tree_read_lock(dev);
+}
+
+static void yaffs_readdir_unlock(struct yaffs_dev *dev, int exclusive)
+{
+	if (exclusive)
+		yaffs_gross_unlock(dev);
+	else
+		yaffs_tree_read_unlock(dev);
 }
 
 static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
@@ -1512,15 +1625,14 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	unsigned long offset, curoffs;
 	struct yaffs_obj *l;
 	int ret_val = 0;
+	int exclusive = 0;
 
 	char name[YAFFS_MAX_NAME_LENGTH + 1];
 
 	obj = yaffs_dentry_to_obj(f->f_dentry);
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
-
-	yaffs_dev_to_lc(dev)->readdir_process = current;
+	yaffs_readdir_lock(dev, exclusive);
 
 	offset = f->f_pos;
 
@@ -1537,12 +1649,12 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		yaffs_trace(YAFFS_TRACE_OS,
 			"yaffs_readdir: entry . ino %d",
 			(int)inode->i_ino);
-		yaffs_gross_unlock(dev);
+		yaffs_readdir_unlock(dev, exclusive);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0) {
-			yaffs_gross_lock(dev);
+			yaffs_readdir_lock(dev, exclusive);
 			goto out;
 		}
-		yaffs_gross_lock(dev);
+		yaffs_readdir_lock(dev, exclusive);
 		offset++;
 		f->f_pos++;
 	}
@@ -1550,14 +1662,14 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		yaffs_trace(YAFFS_TRACE_OS,
 			"yaffs_readdir: entry .. ino %d",
 			(int)f->f_dentry->d_parent->d_inode->i_ino);
-		yaffs_gross_unlock(dev);
+		yaffs_readdir_unlock(dev, exclusive);
 		if (filldir(dirent, "..", 2, offset,
 			    f->f_dentry->d_parent->d_inode->i_ino,
 			    DT_DIR) < 0) {
-			yaffs_gross_lock(dev);
+			yaffs_readdir_lock(dev, exclusive);
 			goto out;
 		}
-		yaffs_gross_lock(dev);
+		yaffs_readdir_lock(dev, exclusive);
 		offset++;
 		f->f_pos++;
 	}
@@ -1576,25 +1688,38 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		curoffs++;
 		l = sc->next_return;
 		if (curoffs >= offset) {
-			int this_inode = yaffs_get_obj_inode(l);
-			int this_type = yaffs_get_obj_type(l);
+			int this_inode;
+			int this_type;
+
+			if (!exclusive && !yaffs_obj_in_ram(l)) {
+				/* The search context is kept up to date across
+				 * the unlock, so just pick up where we were. */
+				yaffs_readdir_unlock(dev, exclusive);
+				exclusive = 1;
+				yaffs_readdir_lock(dev, exclusive);
+				curoffs--;
+				continue;
+			}
+
+			this_inode = yaffs_get_obj_inode(l);
+			this_type = yaffs_get_obj_type(l);
 
 			yaffs_get_obj_name(l, name, YAFFS_MAX_NAME_LENGTH + 1);
 			yaffs_trace(YAFFS_TRACE_OS,
 				"yaffs_readdir: %s inode %d",
 				name, yaffs_get_obj_inode(l));
 
-			yaffs_gross_unlock(dev);
+			yaffs_readdir_unlock(dev, exclusive);
 
 			if (filldir(dirent,
 				    name,
 				    strlen(name),
 				    offset, this_inode, this_type) < 0) {
-				yaffs_gross_lock(dev);
+				yaffs_readdir_lock(dev, exclusive);
 				goto out;
 			}
 
-			yaffs_gross_lock(dev);
+			yaffs_readdir_lock(dev, exclusive);
 
 			offset++;
 			f->f_pos++;
@@ -1604,8 +1729,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 
 out:
 	yaffs_search_end(sc);
-	yaffs_dev_to_lc(dev)->readdir_process = NULL;
-	yaffs_gross_unlock(dev);
+	yaffs_readdir_unlock(dev, exclusive);
 
 	return ret_val;
 }
@@ -1694,6 +1818,7 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 		obj = NULL;	/* Do we ever get here? */
 		break;
 	}
+	yaffs_stamp_dirty(dev);
 
 	/* Can not call yaffs_get_inode() with gross lock held */
 	yaffs_gross_unlock(dev);
@@ -1749,6 +1874,7 @@ static int yaffs_unlink(struct inode *dir, struct dentry *dentry)
 	yaffs_gross_lock(dev);
 
 	ret_val = yaffs_unlinker(obj, dentry->d_name.name);
+	yaffs_stamp_dirty(dev);
 
 	if (ret_val == YAFFS_OK) {
 		dentry->d_inode->i_nlink--;
@@ -1788,6 +1914,7 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 		link =
 		    yaffs_link_obj(yaffs_inode_to_obj(dir), dentry->d_name.name,
 				   obj);
+	yaffs_stamp_dirty(dev);
 
 	if (link) {
 		old_dentry->d_inode->i_nlink = yaffs_get_obj_link_count(obj);
@@ -1832,6 +1959,7 @@ static int yaffs_symlink(struct inode *dir, struct dentry *dentry,
 	yaffs_gross_lock(dev);
 	obj = yaffs_create_symlink(yaffs_inode_to_obj(dir), dentry->d_name.name,
 				   S_IFLNK | S_IRWXUGO, uid, gid, symname);
+	yaffs_stamp_dirty(dev);
 	yaffs_gross_unlock(dev);
 
 	if (obj) {
@@ -1869,9 +1997,9 @@ static int yaffs_sync_object(struct file *file, struct dentry *dentry,
 
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_SYNC,
 		"yaffs_sync_object");
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 	yaffs_flush_file(obj, 1, datasync);
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
 	return 0;
 }
 
@@ -1916,6 +2044,7 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 					   yaffs_inode_to_obj(new_dir),
 					   new_dentry->d_name.name);
 	}
+	yaffs_stamp_dirty(dev);
 	yaffs_gross_unlock(dev);
 
 	if (ret_val == YAFFS_OK) {
@@ -1968,6 +2097,7 @@ static int yaffs_setattr(struct dentry *dentry, struct iattr *attr)
 		}
 		yaffs_gross_lock(dev);
 		result = yaffs_set_attribs(yaffs_inode_to_obj(inode), attr);
+		yaffs_stamp_dirty(dev);
 		if (result == YAFFS_OK) {
 			error = 0;
 		} else {
@@ -1997,6 +2127,7 @@ static int yaffs_setxattr(struct dentry *dentry, const char *name,
 		dev = obj->my_dev;
 		yaffs_gross_lock(dev);
 		result = yaffs_set_xattrib(obj, name, value, size, flags);
+		yaffs_stamp_dirty(dev);
 		if (result == YAFFS_OK)
 			error = 0;
 		else if (result < 0)
@@ -2023,9 +2154,9 @@ static ssize_t yaffs_getxattr(struct dentry * dentry, const char *name,
 
 	if (error == 0) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_data_lock(dev);
 		error = yaffs_get_xattrib(obj, name, buff, size);
-		yaffs_gross_unlock(dev);
+		yaffs_data_unlock(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_getxattr done returning %d", error);
@@ -2048,6 +2179,7 @@ static int yaffs_removexattr(struct dentry *dentry, const char *name)
 		dev = obj->my_dev;
 		yaffs_gross_lock(dev);
 		result = yaffs_remove_xattrib(obj, name);
+		yaffs_stamp_dirty(dev);
 		if (result == YAFFS_OK)
 			error = 0;
 		else if (result < 0)
@@ -2073,9 +2205,9 @@ static ssize_t yaffs_listxattr(struct dentry * dentry, char *buff, size_t size)
 
 	if (error == 0) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_data_lock(dev);
 		error = yaffs_list_xattrib(obj, buff, size);
-		yaffs_gross_unlock(dev);
+		yaffs_data_unlock(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS,
@@ -2102,7 +2234,7 @@ static int yaffs_statfs(struct super_block *sb, struct statfs *buf)
 
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_statfs");
 
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 
 	buf->f_type = YAFFS_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
@@ -2154,7 +2286,7 @@ static int yaffs_statfs(struct super_block *sb, struct statfs *buf)
 	buf->f_ffree = 0;
 	buf->f_bavail = buf->f_bfree;
 
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
 	return 0;
 }
 
@@ -2224,7 +2356,7 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 		request_checkpoint ? "checkpoint requested" : "no checkpoint",
 		oneshot_checkpoint ? " one-shot" : "");
 
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 	do_checkpoint = ((request_checkpoint && !gc_urgent) ||
 			 oneshot_checkpoint) && !dev->is_checkpointed;
 
@@ -2234,7 +2366,7 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 		if (oneshot_checkpoint)
 			yaffs_auto_checkpoint &= ~4;
 	}
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
 
 	return 0;
 }
@@ -2251,8 +2383,22 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
  * The thread should not do any writing while the fs is in read only.
  */
 
+/*
+ * The next write after a checkpoint erases the checkpoint blocks before
+ * it can go ahead, so idle checkpoints are kept at least this far apart.
+ */
+#define YAFFS_IDLE_CHECKPOINT_INTERVAL	(30 * 60 * HZ)
+
 #ifdef YAFFS_COMPILE_BACKGROUND
 
+/*
+ * Writes within YAFFS_BG_IDLE_DELAY mean the device is busy and gc keeps
+ * to the pace the urgency asks for, leaving the flash to the writers.
+ * Once idle, gc runs flat out for as long as it is making progress, so
+ * that erased blocks are ready for the next burst of writes.
+ */
+#define YAFFS_BG_IDLE_DELAY	(HZ / 2)
+
 void yaffs_background_waker(unsigned long data)
 {
 	wake_up_process((struct task_struct *)data);
@@ -2267,6 +2413,8 @@ static int yaffs_bg_thread_fn(void *data)
 	unsigned long next_gc = now;
 	unsigned long expires;
 	unsigned int urgency;
+	u32 gcs;
+	int idle;
 
 	int gc_result;
 	struct timer_list timer;
@@ -2287,7 +2435,7 @@ static int yaffs_bg_thread_fn(void *data)
 		if (try_to_freeze())
 			continue;
 #endif
-		yaffs_gross_lock(dev);
+		yaffs_data_lock(dev);
 
 		now = jiffies;
 
@@ -2298,12 +2446,19 @@ static int yaffs_bg_thread_fn(void *data)
 
 		if (time_after(now, next_gc) && yaffs_bg_enable) {
 			if (!dev->is_checkpointed) {
+				idle = time_after(now, context->last_write +
+						  YAFFS_BG_IDLE_DELAY);
+				gcs = dev->all_gcs;
 				urgency = yaffs_bg_gc_urgency(dev);
 				gc_result = yaffs_bg_gc(dev, urgency);
-				if (urgency > 1)
+				if (urgency > 0 && idle && dev->all_gcs != gcs)
+					next_gc = now + HZ / 50 + 1;
+				else if (urgency > 1)
 					next_gc = now + HZ / 20 + 1;
 				else if (urgency > 0)
 					next_gc = now + HZ / 10 + 1;
+				else if (!idle)
+					next_gc = now + HZ / 2;
 				else
 					next_gc = now + HZ * 2;
 			} else	{
@@ -2314,7 +2469,29 @@ static int yaffs_bg_thread_fn(void *data)
 				next_gc = next_dir_update;
                         }
 		}
-		yaffs_gross_unlock(dev);
+
+		/*
+		 * Write a checkpoint once nothing has changed the fs for
+		 * a while, so that the next mount can skip the scan even
+		 * if this one is never cleanly unmounted. Inodes are not
+		 * flushed: s_inodes can't be walked from here.
+		 */
+		if (yaffs_idle_checkpoint && yaffs_auto_checkpoint &&
+		    yaffs_bg_enable && !dev->is_checkpointed &&
+		    time_after(now, context->last_dirty +
+			       yaffs_idle_checkpoint * HZ) &&
+		    time_after(now, context->last_checkpoint +
+			       YAFFS_IDLE_CHECKPOINT_INTERVAL) &&
+		    !yaffs_bg_gc_urgency(dev)) {
+			yaffs_trace(YAFFS_TRACE_BACKGROUND |
+				YAFFS_TRACE_CHECKPOINT,
+				"yaffs_background: idle checkpoint");
+			yaffs_update_dirty_dirs(dev);
+			yaffs_flush_whole_cache(dev);
+			yaffs_checkpoint_save(dev);
+			context->last_checkpoint = now;
+		}
+		yaffs_data_unlock(dev);
 #if 1
 		expires = next_dir_update;
 		if (time_before(next_gc, expires))
@@ -2372,6 +2549,224 @@ static void yaffs_bg_stop(struct yaffs_dev *dev)
 		ctxt->bg_thread = NULL;
 	}
 }
+
+/*
+ * Summary read-ahead for the mount scan.
+ * The scan has to process blocks one at a time in sequence order, but
+ * it knows that order before it starts. On SMP a helper thread reads
+ * the block summaries up to YAFFS_READ_AHEAD_BLOCKS ahead of the scan,
+ * so that the NAND reads overlap with building the object tree.
+ *
+ * yaffs_read_ahead_enable() hooks it in before yaffs_guts_initialise()
+ * and yaffs_read_ahead_stop() unhooks it after. The thread is only
+ * started if the scan actually queues something, so a mount from a
+ * checkpoint never sees it.
+ */
+#define YAFFS_READ_AHEAD_BLOCKS	16
+
+struct yaffs_read_ahead {
+	struct yaffs_dev *dev;
+	struct task_struct *thread;
+	wait_queue_head_t wait;
+	spinlock_t lock;
+	unsigned queued;	/* Blocks queued by the scan */
+	unsigned done;		/* Blocks read by the thread */
+	unsigned taken;		/* Blocks collected by the scan */
+	int block[YAFFS_READ_AHEAD_BLOCKS];
+	int result[YAFFS_READ_AHEAD_BLOCKS];
+	struct yaffs_summary_acct acct[YAFFS_READ_AHEAD_BLOCKS];
+	u8 *sums;		/* One summary per slot */
+	u8 *buffer;		/* Chunk buffer for the thread */
+};
+
+static struct yaffs_summary_tags *yaffs_read_ahead_sum(
+			struct yaffs_read_ahead *ra, unsigned i)
+{
+	return (struct yaffs_summary_tags *)(ra->sums +
+		(i % YAFFS_READ_AHEAD_BLOCKS) * yaffs_summary_size(ra->dev));
+}
+
+/* Returns non-zero once the thread has read past block i */
+static int yaffs_read_ahead_done(struct yaffs_read_ahead *ra, unsigned i)
+{
+	int done;
+
+	spin_lock(&ra->lock);
+	done = (int)(ra->done - i) > 0;
+	spin_unlock(&ra->lock);
+	return done;
+}
+
+/* Returns non-zero if there are queued blocks the thread has not read */
+static int yaffs_read_ahead_pending(struct yaffs_read_ahead *ra)
+{
+	int pending;
+
+	spin_lock(&ra->lock);
+	pending = ra->done != ra->queued;
+	spin_unlock(&ra->lock);
+	return pending;
+}
+
+static int yaffs_read_ahead_thread_fn(void *data)
+{
+	struct yaffs_read_ahead *ra = (struct yaffs_read_ahead *)data;
+	struct yaffs_summary_acct *acct;
+	unsigned i;
+	int result;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(ra->wait,
+			yaffs_read_ahead_pending(ra) ||
+			kthread_should_stop());
+
+		if (!yaffs_read_ahead_pending(ra))
+			continue;
+
+		/* Only this thread moves done on */
+		i = ra->done;
+		acct = &ra->acct[i % YAFFS_READ_AHEAD_BLOCKS];
+		acct->n_reads = 0;
+		acct->ecc_error = 0;
+		result = yaffs_summary_read_block(ra->dev,
+				yaffs_read_ahead_sum(ra, i),
+				ra->block[i % YAFFS_READ_AHEAD_BLOCKS],
+				ra->buffer, acct);
+
+		spin_lock(&ra->lock);
+		ra->result[i % YAFFS_READ_AHEAD_BLOCKS] = result;
+		ra->done++;
+		spin_unlock(&ra->lock);
+		wake_up(&ra->wait);
+	}
+
+	return 0;
+}
+
+static struct yaffs_read_ahead *yaffs_read_ahead_start(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	struct yaffs_read_ahead *ra;
+
+	ra = kzalloc(sizeof(struct yaffs_read_ahead), GFP_NOFS);
+	if (!ra)
+		return NULL;
+
+	ra->dev = dev;
+	init_waitqueue_head(&ra->wait);
+	spin_lock_init(&ra->lock);
+	ra->sums = kmalloc(YAFFS_READ_AHEAD_BLOCKS * yaffs_summary_size(dev),
+			   GFP_NOFS);
+	ra->buffer = kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
+
+	if (ra->sums && ra->buffer) {
+		ra->thread = kthread_run(yaffs_read_ahead_thread_fn, ra,
+					 "yaffs-ra-%d", lc->mount_id);
+		if (IS_ERR(ra->thread))
+			ra->thread = NULL;
+	}
+
+	if (!ra->thread) {
+		kfree(ra->sums);
+		kfree(ra->buffer);
+		kfree(ra);
+		return NULL;
+	}
+
+	lc->read_ahead = ra;
+	return ra;
+}
+
+static int yaffs_read_ahead_queue(struct yaffs_dev *dev, int block_no)
+{
+	struct yaffs_read_ahead *ra = yaffs_dev_to_lc(dev)->read_ahead;
+	int queued = 0;
+
+	if (!ra) {
+		ra = yaffs_read_ahead_start(dev);
+		if (!ra) {
+			/* Carry on without, the scan reads for itself */
+			dev->param.summary_read_ahead_fn = NULL;
+			dev->param.summary_wait_fn = NULL;
+			return YAFFS_FAIL;
+		}
+	}
+
+	spin_lock(&ra->lock);
+	if (ra->queued - ra->taken < YAFFS_READ_AHEAD_BLOCKS) {
+		ra->block[ra->queued % YAFFS_READ_AHEAD_BLOCKS] = block_no;
+		ra->queued++;
+		queued = 1;
+	}
+	spin_unlock(&ra->lock);
+
+	if (!queued)
+		return YAFFS_FAIL;
+
+	wake_up(&ra->wait);
+	return YAFFS_OK;
+}
+
+static int yaffs_read_ahead_wait(struct yaffs_dev *dev, int block_no,
+				 struct yaffs_summary_tags *st,
+				 struct yaffs_summary_acct *acct)
+{
+	struct yaffs_read_ahead *ra = yaffs_dev_to_lc(dev)->read_ahead;
+	unsigned i;
+	int queued;
+	int result;
+
+	if (!ra)
+		return YAFFS_NOT_READ_AHEAD;
+
+	spin_lock(&ra->lock);
+	i = ra->taken;
+	queued = (i != ra->queued &&
+		  ra->block[i % YAFFS_READ_AHEAD_BLOCKS] == block_no);
+	spin_unlock(&ra->lock);
+
+	if (!queued)
+		return YAFFS_NOT_READ_AHEAD;
+
+	wait_event(ra->wait, yaffs_read_ahead_done(ra, i));
+
+	memcpy(st, yaffs_read_ahead_sum(ra, i), yaffs_summary_size(dev));
+	result = ra->result[i % YAFFS_READ_AHEAD_BLOCKS];
+	*acct = ra->acct[i % YAFFS_READ_AHEAD_BLOCKS];
+
+	spin_lock(&ra->lock);
+	ra->taken++;
+	spin_unlock(&ra->lock);
+
+	return result;
+}
+
+static void yaffs_read_ahead_enable(struct yaffs_dev *dev)
+{
+	if (!dev->param.is_yaffs2 || num_online_cpus() < 2)
+		return;
+
+	dev->param.summary_read_ahead_fn = yaffs_read_ahead_queue;
+	dev->param.summary_wait_fn = yaffs_read_ahead_wait;
+}
+
+static void yaffs_read_ahead_stop(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	struct yaffs_read_ahead *ra = lc->read_ahead;
+
+	dev->param.summary_read_ahead_fn = NULL;
+	dev->param.summary_wait_fn = NULL;
+
+	if (!ra)
+		return;
+
+	kthread_stop(ra->thread);
+	kfree(ra->sums);
+	kfree(ra->buffer);
+	kfree(ra);
+	lc->read_ahead = NULL;
+}
 #else
 static int yaffs_bg_thread_fn(void *data)
 {
@@ -2386,6 +2781,14 @@ static int yaffs_bg_start(struct yaffs_dev *dev)
 static void yaffs_bg_stop(struct yaffs_dev *dev)
 {
 }
+
+static void yaffs_read_ahead_enable(struct yaffs_dev *dev)
+{
+}
+
+static void yaffs_read_ahead_stop(struct yaffs_dev *dev)
+{
+}
 #endif
 
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
@@ -2444,13 +2847,13 @@ static struct inode *yaffs_iget(struct super_block *sb, unsigned long ino)
 	 * need to lock again.
 	 */
 
-	yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 
 	obj = yaffs_find_by_number(dev, inode->i_ino);
 
 	yaffs_fill_inode_from_obj(inode, obj);
 
-	yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
 
 	unlock_new_inode(inode);
 	return inode;
@@ -2471,15 +2874,13 @@ static void yaffs_read_inode(struct inode *inode)
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_read_inode for %d", (int)inode->i_ino);
 
-	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_lock(dev);
+	yaffs_data_lock(dev);
 
 	obj = yaffs_find_by_number(dev, inode->i_ino);
 
 	yaffs_fill_inode_from_obj(inode, obj);
 
-	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_unlock(dev);
+	yaffs_data_unlock(dev);
 }
 
 #endif
@@ -2487,12 +2888,150 @@ static void yaffs_read_inode(struct inode *inode)
 static LIST_HEAD(yaffs_context_list);
 struct mutex yaffs_context_lock;
 
+#ifdef YAFFS_COMPILE_SYSFS
+/*
+ * Per mount gc and write statistics in /sys/fs/yaffs/<dev>/.
+ * The attributes find their device through yaffs_context_list, so
+ * nothing has to outlive the mount.
+ */
+static struct kobject *yaffs_kobj;
+
+struct yaffs_stat_attr {
+	struct kobj_attribute attr;
+	size_t offset;		/* of a u32 counter in struct yaffs_dev */
+};
+
+static struct yaffs_dev *yaffs_kobj_to_dev(struct kobject *kobj)
+{
+	struct yaffs_linux_context *lc;
+
+	list_for_each_entry(lc, &yaffs_context_list, context_list) {
+		if (lc->stats_kobj == kobj)
+			return lc->dev;
+	}
+	return NULL;
+}
+
+static ssize_t yaffs_stat_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	struct yaffs_stat_attr *sa =
+	    container_of(attr, struct yaffs_stat_attr, attr);
+	struct yaffs_dev *dev;
+	ssize_t ret = -ENODEV;
+
+	mutex_lock(&yaffs_context_lock);
+	dev = yaffs_kobj_to_dev(kobj);
+	if (dev)
+		ret = sprintf(buf, "%u\n", *(u32 *)((u8 *)dev + sa->offset));
+	mutex_unlock(&yaffs_context_lock);
+
+	return ret;
+}
+
+/* Flash chunks written for each chunk of file data, to two decimals */
+static ssize_t yaffs_write_amp_show(struct kobject *kobj,
+				    struct kobj_attribute *attr, char *buf)
+{
+	struct yaffs_dev *dev;
+	u64 ratio = 0;
+	u32 rem;
+	ssize_t ret = -ENODEV;
+
+	mutex_lock(&yaffs_context_lock);
+	dev = yaffs_kobj_to_dev(kobj);
+	if (dev) {
+		if (dev->n_data_chunk_writes) {
+			ratio = (u64)dev->n_page_writes * 100;
+			do_div(ratio, dev->n_data_chunk_writes);
+		}
+		rem = do_div(ratio, 100);
+		ret = sprintf(buf, "%llu.%02u\n",
+			      (unsigned long long)ratio, rem);
+	}
+	mutex_unlock(&yaffs_context_lock);
+
+	return ret;
+}
+
+#define YAFFS_STAT_ATTR(_name, _field)					\
+static struct yaffs_stat_attr yaffs_stat_##_name = {			\
+	.attr = __ATTR(_name, S_IRUGO, yaffs_stat_show, NULL),		\
+	.offset = offsetof(struct yaffs_dev, _field),			\
+}
+
+YAFFS_STAT_ATTR(page_writes, n_page_writes);
+YAFFS_STAT_ATTR(data_chunk_writes, n_data_chunk_writes);
+YAFFS_STAT_ATTR(erasures, n_erasures);
+YAFFS_STAT_ATTR(gc_copies, n_gc_copies);
+YAFFS_STAT_ATTR(gc_blocks, n_gc_blocks);
+YAFFS_STAT_ATTR(all_gcs, all_gcs);
+YAFFS_STAT_ATTR(passive_gcs, passive_gc_count);
+YAFFS_STAT_ATTR(bg_gcs, bg_gcs);
+
+static struct kobj_attribute yaffs_write_amp_attr =
+	__ATTR(write_amplification, S_IRUGO, yaffs_write_amp_show, NULL);
+
+static struct attribute *yaffs_stat_attrs[] = {
+	&yaffs_stat_page_writes.attr.attr,
+	&yaffs_stat_data_chunk_writes.attr.attr,
+	&yaffs_stat_erasures.attr.attr,
+	&yaffs_stat_gc_copies.attr.attr,
+	&yaffs_stat_gc_blocks.attr.attr,
+	&yaffs_stat_all_gcs.attr.attr,
+	&yaffs_stat_passive_gcs.attr.attr,
+	&yaffs_stat_bg_gcs.attr.attr,
+	&yaffs_write_amp_attr.attr,
+	NULL
+};
+
+static struct attribute_group yaffs_stat_group = {
+	.attrs = yaffs_stat_attrs,
+};
+
+static void yaffs_sysfs_add(struct yaffs_dev *dev, struct super_block *sb)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+
+	if (!yaffs_kobj)
+		return;
+
+	lc->stats_kobj = kobject_create_and_add(sb->s_id, yaffs_kobj);
+	if (lc->stats_kobj &&
+	    sysfs_create_group(lc->stats_kobj, &yaffs_stat_group)) {
+		kobject_put(lc->stats_kobj);
+		lc->stats_kobj = NULL;
+	}
+}
+
+static void yaffs_sysfs_remove(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+
+	if (lc->stats_kobj) {
+		sysfs_remove_group(lc->stats_kobj, &yaffs_stat_group);
+		kobject_put(lc->stats_kobj);
+		lc->stats_kobj = NULL;
+	}
+}
+#else
+static void yaffs_sysfs_add(struct yaffs_dev *dev, struct super_block *sb)
+{
+}
+
+static void yaffs_sysfs_remove(struct yaffs_dev *dev)
+{
+}
+#endif
+
 static void yaffs_put_super(struct super_block *sb)
 {
 	struct yaffs_dev *dev = yaffs_super_to_dev(sb);
 
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_put_super");
 
+	yaffs_sysfs_remove(dev);
+
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_BACKGROUND,
 		"Shutting down yaffs background thread");
 	yaffs_bg_stop(dev);
@@ -2539,6 +3078,7 @@ static void yaffs_touch_super(struct yaffs_dev *dev)
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_touch_super() sb = %p", sb);
 	if (sb)
 		sb->s_dirt = 1;
+	yaffs_stamp_dirty(dev);
 }
 
 struct yaffs_options {
@@ -2621,6 +3161,27 @@ static int yaffs_parse_options(struct yaffs_options *options,
 	return error;
 }
 
+/* Give the short op cache about 1/512th of RAM, but no fewer chunks than
+ * the fixed 10 it used to get.
+ */
+#define YAFFS_CACHE_RAM_SHIFT	9
+
+static int yaffs_calc_n_caches(int bytes_per_chunk)
+{
+	unsigned long bytes;
+	unsigned long n_caches;
+
+	bytes = (totalram_pages >> YAFFS_CACHE_RAM_SHIFT) << PAGE_SHIFT;
+	n_caches = bytes / bytes_per_chunk;
+
+	if (n_caches < 10)
+		n_caches = 10;
+	if (n_caches > YAFFS_MAX_SHORT_OP_CACHES)
+		n_caches = YAFFS_MAX_SHORT_OP_CACHES;
+
+	return n_caches;
+}
+
 static struct super_block *yaffs_internal_read_super(int yaffs_version,
 						     struct super_block *sb,
 						     void *data, int silent)
@@ -2831,6 +3392,9 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	INIT_LIST_HEAD(&(context->context_list));
 	context->dev = dev;
 	context->super = sb;
+	context->last_write = jiffies;
+	context->last_dirty = jiffies;
+	context->last_checkpoint = jiffies - YAFFS_IDLE_CHECKPOINT_INTERVAL;
 
 	dev->read_only = read_only;
 
@@ -2854,7 +3418,6 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
 	param->inband_tags = options.inband_tags;
 
 	param->enable_xattr = 1;
@@ -2908,6 +3471,9 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 #endif
 		param->is_yaffs2 = 0;
 	}
+	param->n_caches = (options.no_cache) ? 0 :
+	    yaffs_calc_n_caches(param->total_bytes_per_chunk);
+
 	/* ... and common functions */
 	param->erase_fn = nandmtd_erase_block;
 	param->initialise_flash_fn = nandmtd_initialise;
@@ -2945,14 +3511,21 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 	/* Directory search handling... */
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
+	spin_lock_init(&(yaffs_dev_to_lc(dev)->search_lock));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
-	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->tree_lock));
+	mutex_init(&(yaffs_dev_to_lc(dev)->block_lock));
+	mutex_init(&(yaffs_dev_to_lc(dev)->spare_lock));
+
+	yaffs_read_ahead_enable(dev);
 
 	yaffs_gross_lock(dev);
 
 	err = yaffs_guts_initialise(dev);
 
+	yaffs_read_ahead_stop(dev);
+
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_read_super: guts initialised %s",
 		(err == YAFFS_OK) ? "OK" : "FAILED");
@@ -2992,6 +3565,8 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		"yaffs_read_super: is_checkpointed %d",
 		dev->is_checkpointed);
 
+	yaffs_sysfs_add(dev, sb);
+
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_read_super: done");
 	cleancache_init_fs(sb);
 	return sb;
@@ -3134,6 +3709,8 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "n_page_writes........ %u\n", dev->n_page_writes);
 	buf += sprintf(buf, "n_page_reads......... %u\n", dev->n_page_reads);
+	buf += sprintf(buf, "n_data_chunk_writes.. %u\n",
+				dev->n_data_chunk_writes);
 	buf += sprintf(buf, "n_erasures........... %u\n", dev->n_erasures);
 	buf += sprintf(buf, "n_gc_copies.......... %u\n", dev->n_gc_copies);
 	buf += sprintf(buf, "all_gcs.............. %u\n", dev->all_gcs);
@@ -3154,6 +3731,7 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_tags_ecc_unfixed... %u\n",
 				dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits........... %u\n", dev->cache_hits);
+	buf += sprintf(buf, "cache_misses......... %u\n", dev->cache_misses);
 	buf += sprintf(buf, "n_deleted_files...... %u\n", dev->n_deleted_files);
 	buf += sprintf(buf, "n_unlinked_files..... %u\n",
 				dev->n_unlinked_files);
@@ -3389,6 +3967,11 @@ static int __init init_yaffs_fs(void)
 
 	mutex_init(&yaffs_context_lock);
 
+#ifdef YAFFS_COMPILE_SYSFS
+	/* Statistics are optional, carry on without them */
+	yaffs_kobj = kobject_create_and_add("yaffs", fs_kobj);
+#endif
+
 	/* Install the proc_fs entries */
 	my_proc_entry = create_proc_entry("yaffs",
 					  S_IRUGO | S_IFREG, YPROC_ROOT);
@@ -3438,6 +4021,10 @@ static void __exit exit_yaffs_fs(void)
 
 	remove_proc_entry("yaffs", YPROC_ROOT);
 
+#ifdef YAFFS_COMPILE_SYSFS
+	kobject_put(yaffs_kobj);
+#endif
+
 	fsinst = fs_to_install;
 
 	while (fsinst->fst) {
@@ -1346,6 +1346,7 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	int block_iter;
 	int start_iter;
 	int end_iter;
+	int ra_iter;
 	int n_to_scan = 0;
 	enum yaffs_block_state state;
 	int c;
@@ -1456,6 +1457,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	end_iter = n_to_scan - 1;
 	yaffs_trace(YAFFS_TRACE_SCAN_DEBUG, "%d blocks to scan", n_to_scan);
 
+	ra_iter = end_iter;
+
 	/* For each block.... backwards */
 	for (block_iter = end_iter;
 	     !alloc_failed && block_iter >= start_iter;
@@ -1464,6 +1467,13 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		   long that watchdog timers expire. */
 		cond_resched();
 
+		/* Keep the summary read-ahead queue topped up */
+		while (dev->sum_tags && dev->param.summary_read_ahead_fn &&
+		       ra_iter >= start_iter &&
+		       dev->param.summary_read_ahead_fn(dev,
+				block_index[ra_iter].block) == YAFFS_OK)
+			ra_iter--;
+
 		/* get the block to scan in the correct order */
 		blk = block_index[block_iter].block;
 		bi = yaffs_get_block_info(dev, blk);
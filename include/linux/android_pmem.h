@@ -61,6 +61,12 @@
 
 #define PMEM_GET_FREE_SPACE	_IOW(PMEM_IOCTL_MAGIC, 14, unsigned int)
 #define PMEM_ALLOCATE_ALIGNED	_IOW(PMEM_IOCTL_MAGIC, 15, unsigned int)
+/* Like PMEM_ALLOCATE, but allows the kernel to move the allocation to
+ * defragment the region while it is not in use by hardware. Moving stops
+ * for good once PMEM_GET_PHYS is called on it, it is connected to, or it is
+ * mapped more than once.
+ */
+#define PMEM_ALLOCATE_MOVABLE	_IOW(PMEM_IOCTL_MAGIC, 16, unsigned int)
 struct pmem_region {
 	unsigned long offset;
 	unsigned long len;
@@ -105,6 +111,8 @@ enum pmem_allocator_type {
 
 	PMEM_ALLOCATORTYPE_ALLORNOTHING,
 	PMEM_ALLOCATORTYPE_BUDDYBESTFIT,
+	/* best fit over rbtrees of free extents, supports alignment */
+	PMEM_ALLOCATORTYPE_EXTENT,
 
 	PMEM_ALLOCATORTYPE_MAX,
 };
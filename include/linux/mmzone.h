@@ -350,6 +350,12 @@ struct zone {
 	unsigned long		pages_scanned;	   /* since last reclaim */
 	unsigned long		flags;		   /* zone flags, see below */
 
+#ifdef CONFIG_VMPRESSURE
+	/* Current reclaim efficiency window, see mm/vmpressure.c */
+	unsigned long		vmpressure_scanned;
+	unsigned long		vmpressure_reclaimed;
+#endif
+
 	/* Zone statistics */
 	atomic_long_t		vm_stat[NR_VM_ZONE_STAT_ITEMS];
 
@@ -1274,6 +1274,10 @@ struct task_struct {
 #endif
 
 	struct list_head tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* thread group leaders only, protected by tasklist_lock */
+	struct list_head lowmem_adj_node;
+#endif
 	struct plist_node pushable_tasks;
 
 	struct mm_struct *mm, *active_mm;
@@ -0,0 +1,27 @@
+#ifndef _LINUX_VMPRESSURE_H
+#define _LINUX_VMPRESSURE_H
+
+#include <linux/gfp.h>
+#include <linux/notifier.h>
+
+struct zone;
+
+/*
+ * Reclaim efficiency ("pressure") is reported in percent: 0 means every
+ * scanned page was reclaimed, 100 means nothing could be reclaimed.
+ * Listeners are called from process context with the pressure in @val
+ * and the zone it was measured on in @data.
+ */
+#ifdef CONFIG_VMPRESSURE
+extern void vmpressure(gfp_t gfp, struct zone *zone,
+		       unsigned long scanned, unsigned long reclaimed);
+extern int register_vmpressure_notifier(struct notifier_block *nb);
+extern int unregister_vmpressure_notifier(struct notifier_block *nb);
+#else
+static inline void vmpressure(gfp_t gfp, struct zone *zone,
+			      unsigned long scanned, unsigned long reclaimed)
+{
+}
+#endif
+
+#endif /* _LINUX_VMPRESSURE_H */
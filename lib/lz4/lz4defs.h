@@ -61,9 +61,11 @@
  */
 #define BYTE	u8
 #if defined(CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS)
+typedef struct _U16_S { u16 v; } U16_S;
 typedef struct _U32_S { u32 v; } U32_S;
 typedef struct _U64_S { u64 v; } U64_S;
 
+#define A16(x) (((U16_S *)(x))->v)
 #define A32(x) (((U32_S *)(x))->v)
 #define A64(x) (((U64_S *)(x))->v)
 
@@ -71,20 +73,55 @@ typedef struct _U64_S { u64 v; } U64_S;
 #define PUT8(s, d) (A64(d) = A64(s))
 #else /* CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS */
 
+#define A16(x) get_unaligned((const u16 *) (x))
+#define A32(x) get_unaligned((const u32 *) (x))
+#define A64(x) get_unaligned((const u64 *) (x))
+
 #define PUT4(s, d) \
 	put_unaligned(get_unaligned((const u32 *) s), (u32 *) d)
 #define PUT8(s, d) \
 	put_unaligned(get_unaligned((const u64 *) s), (u64 *) d)
 #endif
 
+#define MINMATCH 4
 #define COPYLENGTH 8
+#define LASTLITERALS 5
+#define MFLIMIT (COPYLENGTH + MINMATCH)
+#define MINLENGTH (MFLIMIT + 1)
+#define MAXD_LOG 16
+#define MAXD (1 << MAXD_LOG)
+#define MAX_DISTANCE (MAXD - 1)
+
 #define ML_BITS  4
 #define ML_MASK  ((1U << ML_BITS) - 1)
 #define RUN_BITS (8 - ML_BITS)
 #define RUN_MASK ((1U << RUN_BITS) - 1)
 
+/*
+ * Compressor tuning: the hash table takes (1 << MEMORY_USAGE) bytes,
+ * which must match LZ4_MEM_COMPRESS in <linux/lz4.h>.
+ */
+#define MEMORY_USAGE	14
+#define HASH_LOG	(MEMORY_USAGE - 2)
+#define SKIPSTRENGTH	6
+/* Inputs below this size index the table with 16-bit offsets */
+#define LZ4_64KLIMIT	((1 << 16) + (MFLIMIT - 1))
+#define HASHLOG64K	(HASH_LOG + 1)
+
+#define LZ4_HASH_VALUE(p)	\
+	((A32(p) * 2654435761U) >> ((MINMATCH * 8) - HASH_LOG))
+#define LZ4_HASH64K_VALUE(p)	\
+	((A32(p) * 2654435761U) >> ((MINMATCH * 8) - HASHLOG64K))
+
 #if LZ4_ARCH64/* 64-bit */
 #define STEPSIZE 8
+#define HTYPE u32
+
+#ifdef __BIG_ENDIAN
+#define LZ4_NBCOMMONBYTES(val) (__builtin_clzll(val) >> 3)
+#else
+#define LZ4_NBCOMMONBYTES(val) (__builtin_ctzll(val) >> 3)
+#endif
 
 #define LZ4_COPYSTEP(s, d)	\
 	do {	\
@@ -104,6 +141,13 @@ typedef struct _U64_S { u64 v; } U64_S;
 
 #else	/* 32-bit */
 #define STEPSIZE 4
+#define HTYPE const u8*
+
+#ifdef __BIG_ENDIAN
+#define LZ4_NBCOMMONBYTES(val) (__builtin_clz(val) >> 3)
+#else
+#define LZ4_NBCOMMONBYTES(val) (__builtin_ctz(val) >> 3)
+#endif
 
 #define LZ4_COPYSTEP(s, d)	\
 	do {	\
@@ -127,3 +171,16 @@ typedef struct _U64_S { u64 v; } U64_S;
 	do {				\
 		LZ4_COPYPACKET(s, d);	\
 	} while (d < e)
+
+#define LZ4_WRITE_LITTLEENDIAN_16(p, v)	\
+	do {	\
+		put_unaligned_le16(v, p);	\
+		p += 2;	\
+	} while (0)
+
+#define LZ4_BLINDCOPY(s, d, l)	\
+	do {	\
+		u8 *e = (d) + l;	\
+		LZ4_WILDCOPY(s, d, e);	\
+		d = e;	\
+	} while (0)
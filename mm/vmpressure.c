@@ -0,0 +1,108 @@
+/*
+ * Reclaim efficiency tracking
+ *
+ * Page reclaim reports how many pages it scanned and how many of those
+ * it managed to free, per zone. Once a zone has seen a window's worth of
+ * scanning, the ratio is turned into a pressure value and handed to the
+ * registered listeners. A high value means reclaim is working hard for
+ * little gain, which is a better sign of memory shortage than the
+ * amount of free memory alone.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/mmzone.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/vmpressure.h>
+#include <linux/workqueue.h>
+
+/* Pages to scan in a zone before its efficiency is evaluated */
+#define VMPRESSURE_WIN		(SWAP_CLUSTER_MAX * 16)
+
+static BLOCKING_NOTIFIER_HEAD(vmpressure_chain);
+
+/* Protects the per-zone windows and the pending report */
+static DEFINE_SPINLOCK(vmpressure_lock);
+static struct zone *vmpressure_zone;
+static unsigned long vmpressure_pending;
+
+static void vmpressure_work_fn(struct work_struct *work)
+{
+	struct zone *zone;
+	unsigned long pressure;
+
+	spin_lock(&vmpressure_lock);
+	zone = vmpressure_zone;
+	pressure = vmpressure_pending;
+	vmpressure_zone = NULL;
+	vmpressure_pending = 0;
+	spin_unlock(&vmpressure_lock);
+
+	if (zone)
+		blocking_notifier_call_chain(&vmpressure_chain, pressure, zone);
+}
+static DECLARE_WORK(vmpressure_work, vmpressure_work_fn);
+
+static unsigned long vmpressure_calc(unsigned long scanned,
+				     unsigned long reclaimed)
+{
+	if (reclaimed >= scanned)
+		return 0;
+	return (scanned - reclaimed) * 100 / scanned;
+}
+
+/*
+ * Called by page reclaim after each pass over @zone. Reclaim runs with
+ * locks held that listeners may need, so the report is deferred to a
+ * work item; if several windows complete before it runs, the worst one
+ * is reported.
+ */
+void vmpressure(gfp_t gfp, struct zone *zone,
+		unsigned long scanned, unsigned long reclaimed)
+{
+	unsigned long pressure;
+
+	/*
+	 * Allocations that cannot use highmem or movable pages and may
+	 * not do I/O say little about the state of the LRU lists.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpressure_lock);
+	zone->vmpressure_scanned += scanned;
+	zone->vmpressure_reclaimed += reclaimed;
+	if (zone->vmpressure_scanned < VMPRESSURE_WIN) {
+		spin_unlock(&vmpressure_lock);
+		return;
+	}
+
+	pressure = vmpressure_calc(zone->vmpressure_scanned,
+				   zone->vmpressure_reclaimed);
+	zone->vmpressure_scanned = 0;
+	zone->vmpressure_reclaimed = 0;
+	if (!vmpressure_zone || pressure >= vmpressure_pending) {
+		vmpressure_zone = zone;
+		vmpressure_pending = pressure;
+	}
+	spin_unlock(&vmpressure_lock);
+
+	schedule_work(&vmpressure_work);
+}
+
+int register_vmpressure_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_chain, nb);
+}
+EXPORT_SYMBOL_GPL(register_vmpressure_notifier);
+
+int unregister_vmpressure_notifier(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_chain, nb);
+}
+EXPORT_SYMBOL_GPL(unregister_vmpressure_notifier);